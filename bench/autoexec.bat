@@ -0,0 +1,9 @@
+@echo off
+subsume
+portio
+clisti
+teletype
+scroll
+diskread
+cow
+benchend
@@ -0,0 +1,10 @@
+; last program in the benchmark run: powers QEMU off through isa-debug-exit
+use16
+org 0x100
+
+%define DEBUG_EXIT 0xf4
+
+    xor al, al
+    out DEBUG_EXIT, al
+    ; not running under QEMU with isa-debug-exit
+    int 0x20
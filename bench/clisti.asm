@@ -0,0 +1,16 @@
+; CLI/STI storm: both are emulated, and STI may deliver pending IRQs
+use16
+org 0x100
+
+%include "bench.inc"
+
+%define ITERATIONS 10000
+
+start:
+    BENCH_BEGIN
+    mov cx, ITERATIONS
+.loop:
+    cli
+    sti
+    loop .loop
+    BENCH_END "clisti", ITERATIONS
@@ -0,0 +1,30 @@
+; first write to each page of conventional memory above this program. low
+; memory is copy-on-write after reset, so every write takes a page fault
+use16
+org 0x100
+
+%include "bench.inc"
+
+; pages from 64 KiB above our PSP up to segment 9000h
+%define LIMIT_SEGMENT 0x9000
+
+start:
+    mov ax, cs
+    add ax, 0x1000
+    mov [first], ax
+
+    BENCH_BEGIN
+    mov ax, [first]
+    xor ebx, ebx
+.loop:
+    mov es, ax
+    mov byte [es:0], 1
+    inc ebx
+    add ax, PAGE_SIZE >> 4
+    cmp ax, LIMIT_SEGMENT
+    jb .loop
+    mov [pages], ebx
+    BENCH_END "cow", [pages]
+
+first dw 0
+pages dd 0
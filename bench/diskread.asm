@@ -0,0 +1,23 @@
+; INT 13h reads of the first sector of the first hard disk
+use16
+org 0x100
+
+%include "bench.inc"
+
+%define ITERATIONS 256
+
+start:
+    BENCH_BEGIN
+    mov cx, ITERATIONS
+.loop:
+    push cx
+    mov ax, 0x0201 ; read one sector
+    mov cx, 0x0001 ; cylinder 0, sector 1
+    mov dx, 0x0080 ; head 0, drive 80h
+    mov bx, buffer
+    int 0x13
+    pop cx
+    loop .loop
+    BENCH_END "diskread", ITERATIONS
+
+buffer times 512 db 0
@@ -0,0 +1,16 @@
+; tight port I/O loop: every IN and OUT traps into the kernel
+use16
+org 0x100
+
+%include "bench.inc"
+
+%define ITERATIONS 10000
+
+start:
+    BENCH_BEGIN
+    mov cx, ITERATIONS
+.loop:
+    in al, 0x61
+    out 0x80, al
+    loop .loop
+    BENCH_END "portio", ITERATIONS
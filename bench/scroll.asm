@@ -0,0 +1,21 @@
+; INT 10h scroll of the whole 80x25 screen by one line
+use16
+org 0x100
+
+%include "bench.inc"
+
+%define ITERATIONS 500
+
+start:
+    BENCH_BEGIN
+    mov cx, ITERATIONS
+.loop:
+    push cx
+    mov ax, 0x0601 ; scroll up one line
+    mov bh, 0x07 ; attribute for blank line
+    xor cx, cx ; top left 0,0
+    mov dx, 0x184f ; bottom right 24,79
+    int 0x10
+    pop cx
+    loop .loop
+    BENCH_END "scroll", ITERATIONS
@@ -0,0 +1,26 @@
+; INT 10h teletype output of 20 full rows, starting from the top of the
+; screen so that nothing scrolls
+use16
+org 0x100
+
+%include "bench.inc"
+
+%define ITERATIONS (20 * 80)
+
+start:
+    ; cursor to row 0, column 0
+    mov ah, 0x02
+    xor bh, bh
+    xor dx, dx
+    int 0x10
+
+    BENCH_BEGIN
+    mov cx, ITERATIONS
+.loop:
+    push cx
+    mov ax, 0x0e00 | '.'
+    xor bh, bh
+    int 0x10
+    pop cx
+    loop .loop
+    BENCH_END "teletype", ITERATIONS
@@ -0,0 +1,1102 @@
+// runs the framebuffer renderer, the VM8086 instruction emulator and the
+// DPMI host as an ordinary Linux program, against fake guest memory, ports
+// and LFB.
+//
+// usage: host/harness test         check emulation and golden frames
+//        host/harness bench        cycles per refresh and per instruction
+//        host/harness dump <dir>   write the golden frames out as PPMs
+//
+// -v echoes the kernel's debug output to stderr
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "a20.h"
+#include "console.h"
+#include "dpmi.h"
+#include "io.h"
+#include "stats.h"
+#include "wset.h"
+#include "x86.h"
+
+#define LFB_PHYS        0xfd000000
+#define LFB_WIDTH       1024
+#define LFB_HEIGHT      768
+#define LFB_PITCH       (LFB_WIDTH * 3)
+
+#define GUEST_CS        0x1000
+#define GUEST_IP        0x0100
+#define GUEST_SS        0x2000
+#define GUEST_SP        0x1000
+
+static uint16_t* const
+text = GUEST_PTR(0xb8000);
+
+static regs_t
+regs;
+
+static task_t
+task;
+
+static uint32_t
+failures;
+
+static void
+check(bool ok, const char* what, uint32_t line)
+{
+    if (!ok) {
+        fprintf(stderr, "harness.c:%u: check failed: %s\n", line, what);
+        failures++;
+    }
+}
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static uint8_t*
+guest(uint16_t segment, uint16_t offset)
+{
+    return GUEST_PTR(((uint32_t)segment << 4) + offset);
+}
+
+static uint16_t
+guest16(uint16_t segment, uint16_t offset)
+{
+    uint16_t value;
+    memcpy(&value, guest(segment, offset), sizeof(value));
+    return value;
+}
+
+static void
+set_guest16(uint16_t segment, uint16_t offset, uint16_t value)
+{
+    memcpy(guest(segment, offset), &value, sizeof(value));
+}
+
+static void
+set_vector(uint8_t vector, uint16_t segment, uint16_t offset)
+{
+    set_guest16(0, vector * 4, offset);
+    set_guest16(0, vector * 4 + 2, segment);
+}
+
+// fresh guest with interrupts enabled, about to execute code at CS:IP
+static void
+guest_reset(const uint8_t* code, uint32_t len)
+{
+    memset(&regs, 0, sizeof(regs));
+    memset(&task, 0, sizeof(task));
+
+    task.regs = &regs;
+    task.has_reset = true;
+    task.interrupts_enabled = true;
+
+    regs.cs.word.lo = GUEST_CS;
+    regs.eip.word.lo = GUEST_IP;
+    regs.ss.word.lo = GUEST_SS;
+    regs.esp.word.lo = GUEST_SP;
+    regs.eflags.dword = FLAG_VM8086 | FLAG_INTERRUPT;
+
+    memcpy(guest(GUEST_CS, GUEST_IP), code, len);
+}
+
+#define GUEST_CODE(...) do { \
+        static const uint8_t code[] = { __VA_ARGS__ }; \
+        guest_reset(code, sizeof(code)); \
+    } while (0)
+
+static void
+test_cli_sti()
+{
+    GUEST_CODE(0xfa); // cli
+    vm86_gpf(&task);
+    CHECK(!task.interrupts_enabled);
+    CHECK(regs.eip.word.lo == GUEST_IP + 1);
+
+    // sti delivers a pending IRQ straight away
+    GUEST_CODE(0xfb); // sti
+    task.interrupts_enabled = false;
+    task.pending_irqs = 1 << 1;
+    set_vector(0x09, 0xf000, 0x1234);
+    vm86_gpf(&task);
+    CHECK(task.interrupts_enabled);
+    CHECK(task.pending_irqs == 0);
+    CHECK(regs.cs.word.lo == 0xf000);
+    CHECK(regs.eip.word.lo == 0x1234);
+    CHECK(regs.esp.word.lo == GUEST_SP - 6);
+    CHECK(guest16(GUEST_SS, GUEST_SP - 6) == GUEST_IP + 1);
+    CHECK(guest16(GUEST_SS, GUEST_SP - 4) == GUEST_CS);
+}
+
+static void
+test_halt()
+{
+    // hlt leaves the guest asleep until an IRQ is delivered
+    GUEST_CODE(0xf4); // hlt
+    vm86_gpf(&task);
+    CHECK(task.halted);
+    CHECK(regs.eip.word.lo == GUEST_IP + 1);
+
+    task.pending_irqs = 1 << 0;
+    set_vector(0x08, 0xf000, 0xfea5);
+    vm86_pending(&task);
+    CHECK(!task.halted);
+    CHECK(regs.cs.word.lo == 0xf000);
+
+    // a tight burst of empty keyboard polls halts too
+    GUEST_CODE(0xcd, 0x16); // int 16h
+    set_vector(0x16, 0xf000, 0xe82e);
+    set_guest16(0x40, 0x1a, 0x1e);
+    set_guest16(0x40, 0x1c, 0x1e);
+    for (uint32_t i = 0; i < 64 && !task.halted; i++) {
+        regs.cs.word.lo = GUEST_CS;
+        regs.eip.word.lo = GUEST_IP;
+        regs.esp.word.lo = GUEST_SP;
+        regs.eax.word.lo = 0x0100;
+        vm86_gpf(&task);
+    }
+    CHECK(task.halted);
+    CHECK(regs.cs.word.lo == 0xf000);
+
+    // the multitasker idle call is answered without the guest's handler
+    GUEST_CODE(0xcd, 0x2f); // int 2fh
+    regs.eax.word.lo = 0x1680;
+    vm86_gpf(&task);
+    CHECK(task.halted);
+    CHECK(regs.eax.byte.lo == 0x00);
+    CHECK(regs.cs.word.lo == GUEST_CS);
+    CHECK(regs.eip.word.lo == GUEST_IP + 2);
+}
+
+static void
+test_pushf_popf()
+{
+    // pushf shows the guest's virtual IF, not the real one
+    GUEST_CODE(0x9c); // pushf
+    task.interrupts_enabled = false;
+    vm86_gpf(&task);
+    CHECK(regs.esp.word.lo == GUEST_SP - 2);
+    CHECK(!(guest16(GUEST_SS, GUEST_SP - 2) & FLAG_INTERRUPT));
+    CHECK(regs.eip.word.lo == GUEST_IP + 1);
+
+    GUEST_CODE(0x9d); // popf
+    task.interrupts_enabled = false;
+    regs.esp.word.lo -= 2;
+    set_guest16(GUEST_SS, regs.esp.word.lo, FLAG_INTERRUPT | 0x0001);
+    vm86_gpf(&task);
+    CHECK(task.interrupts_enabled);
+    CHECK(regs.esp.word.lo == GUEST_SP);
+    CHECK(regs.eflags.word.lo & 0x0001);
+    CHECK(regs.eip.word.lo == GUEST_IP + 1);
+}
+
+static void
+test_int_iret()
+{
+    GUEST_CODE(0xcd, 0x21); // int 21h
+    set_vector(0x21, 0x0070, 0x0456);
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0x0070);
+    CHECK(regs.eip.word.lo == 0x0456);
+    CHECK(guest16(GUEST_SS, GUEST_SP - 6) == GUEST_IP + 2);
+    CHECK(guest16(GUEST_SS, GUEST_SP - 4) == GUEST_CS);
+    CHECK(guest16(GUEST_SS, GUEST_SP - 2) & FLAG_INTERRUPT);
+
+    GUEST_CODE(0xcf); // iret
+    regs.esp.word.lo -= 6;
+    set_guest16(GUEST_SS, regs.esp.word.lo + 0, 0x0789);
+    set_guest16(GUEST_SS, regs.esp.word.lo + 2, 0x0050);
+    set_guest16(GUEST_SS, regs.esp.word.lo + 4, 0);
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0x0050);
+    CHECK(regs.eip.word.lo == 0x0789);
+    CHECK(regs.esp.word.lo == GUEST_SP);
+    CHECK(!task.interrupts_enabled);
+}
+
+static void
+test_port_io()
+{
+    GUEST_CODE(0xee); // out dx, al
+    regs.edx.word.lo = 0x378;
+    regs.eax.byte.lo = 0x5a;
+    vm86_gpf(&task);
+    CHECK(host_ports[0x378] == 0x5a);
+    CHECK(regs.eip.word.lo == GUEST_IP + 1);
+
+    GUEST_CODE(0xe4, 0x60); // in al, 60h
+    host_ports[0x60] = 0x1c;
+    vm86_gpf(&task);
+    CHECK(regs.eax.byte.lo == 0x1c);
+    CHECK(regs.eip.word.lo == GUEST_IP + 2);
+
+    GUEST_CODE(0x66, 0xef); // out dx, eax
+    regs.edx.word.lo = 0x300;
+    regs.eax.dword = 0x12345678;
+    vm86_gpf(&task);
+    CHECK(ind(0x300) == 0x12345678);
+    CHECK(regs.eip.word.lo == GUEST_IP + 2);
+
+    GUEST_CODE(0xf3, 0x6c); // rep insb
+    regs.edx.word.lo = 0x60;
+    regs.ecx.word.lo = 4;
+    regs.es16.word.lo = 0x3000;
+    regs.edi.word.lo = 0x0010;
+    vm86_gpf(&task);
+    CHECK(memcmp(guest(0x3000, 0x0010), "\x1c\x1c\x1c\x1c", 4) == 0);
+    CHECK(*guest(0x3000, 0x0014) == 0);
+    CHECK(regs.edi.word.lo == 0x0014);
+    CHECK(regs.ecx.word.lo == 0);
+    CHECK(regs.eip.word.lo == GUEST_IP + 2);
+}
+
+static void
+test_a20()
+{
+    // port A
+    GUEST_CODE(0xe6, 0x92); // out 92h, al
+    regs.eax.byte.lo = 0x00;
+    vm86_gpf(&task);
+    CHECK(!lomem_a20_enabled());
+
+    GUEST_CODE(0xe4, 0x92); // in al, 92h
+    vm86_gpf(&task);
+    CHECK(regs.eax.byte.lo == 0x00);
+
+    // 8042 write output port, which must not reach the controller
+    host_ports[0x64] = 0;
+    host_ports[0x60] = 0;
+    GUEST_CODE(0xe6, 0x64, 0xe6, 0x60); // out 64h, al; out 60h, al
+    regs.eax.byte.lo = 0xd1;
+    vm86_gpf(&task);
+    regs.eax.byte.lo = 0xdf;
+    vm86_gpf(&task);
+    CHECK(lomem_a20_enabled());
+    CHECK(host_ports[0x64] == 0 && host_ports[0x60] == 0);
+
+    // INT 15h AX=2400h, then AX=2402h
+    GUEST_CODE(0xcd, 0x15); // int 15h
+    set_vector(0x15, 0xf000, 0xf859);
+    regs.eax.word.lo = 0x2400;
+    regs.eflags.word.lo |= 0x0001;
+    vm86_gpf(&task);
+    CHECK(!lomem_a20_enabled());
+    CHECK(regs.cs.word.lo == GUEST_CS);
+    CHECK(!(regs.eflags.word.lo & 0x0001));
+
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x2402;
+    vm86_gpf(&task);
+    CHECK(regs.eax.word.lo == 0x0000);
+
+    lomem_a20(true);
+}
+
+static void
+test_hypercall()
+{
+    GUEST_CODE(0xcd, HYPERCALL_VECTOR);
+    regs.eax.byte.hi = HYPERCALL_STATS;
+    regs.ecx.word.lo = 4;
+    regs.es16.word.lo = 0x3000;
+    regs.edi.word.lo = 0;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == GUEST_CS);
+    CHECK(regs.eip.word.lo == GUEST_IP + 2);
+    CHECK(regs.ecx.word.lo == sizeof(stats_t));
+    CHECK(guest16(0x3000, 0) == sizeof(stats_t));
+
+    GUEST_CODE(0xcd, HYPERCALL_VECTOR);
+    regs.eax.byte.hi = HYPERCALL_WSET;
+    regs.ecx.word.lo = 2;
+    regs.es16.word.lo = 0x3000;
+    regs.edi.word.lo = 0x10;
+    vm86_gpf(&task);
+    CHECK(regs.ecx.word.lo == sizeof(wset_t));
+    CHECK(guest16(0x3000, 0x10) == sizeof(wset_t));
+
+    // nothing is written where the guest couldn't write itself
+    GUEST_CODE(0xcd, HYPERCALL_VECTOR);
+    regs.eax.byte.hi = HYPERCALL_STATS;
+    regs.ecx.word.lo = 0x40;
+    regs.es16.word.lo = 0xffff;
+    regs.edi.word.lo = 0xfff0;
+    vm86_gpf(&task);
+    CHECK(regs.ecx.word.lo == 0);
+}
+
+static void
+set_cursor(uint8_t column, uint8_t row)
+{
+    *guest(0x40, 0x50) = column;
+    *guest(0x40, 0x51) = row;
+}
+
+static void
+test_console()
+{
+    // 80x25 colour text, page 0
+    *guest(0x40, 0x49) = 0x03;
+    set_guest16(0x40, 0x4a, 80);
+    set_guest16(0x40, 0x4e, 0);
+    *guest(0x40, 0x62) = 0;
+    set_vector(0x10, 0xc000, 0x0000);
+    console_reset();
+
+    for (uint32_t i = 0; i < 80 * 25; i++) {
+        text[i] = 0x1720;
+    }
+
+    // teletype wraps at the end of the screen and scrolls
+    GUEST_CODE(0xcd, 0x10); // int 10h
+    set_cursor(78, 24);
+    regs.eax.word.lo = 0x0e41;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == GUEST_CS);
+    CHECK(text[24 * 80 + 78] == 0x1741);
+
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x0e42;
+    vm86_gpf(&task);
+    CHECK(text[23 * 80 + 78] == 0x1741);
+    CHECK(text[23 * 80 + 79] == 0x1742);
+    CHECK(text[24 * 80 + 79] == 0x1720);
+    CHECK(*guest(0x40, 0x50) == 0 && *guest(0x40, 0x51) == 24);
+
+    // BEL is left to the BIOS
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x0e07;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0xc000);
+
+    // DOS: list of lists at 0070:0000 points at one SFT block at 0080:0000,
+    // the SDA at 0050:0000 names the PSP at 0060:0000, whose handle 1 is SFT
+    // entry 1
+    set_guest16(0x70, 0x04, 0x0000);
+    set_guest16(0x70, 0x06, 0x0080);
+    set_guest16(0x80, 0x00, 0xffff);
+    set_guest16(0x80, 0x02, 0xffff);
+    set_guest16(0x80, 0x04, 5);
+    set_guest16(0x80, 0x06 + 1 * 0x3b + 0x05, 0x0083);
+    set_guest16(0x50, 0x10, 0x0060);
+    set_guest16(0x60, 0x32, 20);
+    set_guest16(0x60, 0x34, 0x0018);
+    set_guest16(0x60, 0x36, 0x0060);
+    memcpy(guest(0x60, 0x18), "\x00\x01\x02", 3);
+    set_guest16(0x40, 0x1a, 0x1e);
+    set_guest16(0x40, 0x1c, 0x1e);
+    set_vector(0x21, 0xd000, 0x0000);
+    console_dos_info(0x0070, 0x0000, 0x0050, 0x0000);
+
+    GUEST_CODE(0xcd, 0x21); // int 21h
+    memcpy(guest(0x3000, 0), "hi\r\nthere$", 11);
+    set_cursor(0, 0);
+    regs.eax.byte.hi = 0x09;
+    regs.ds16.word.lo = 0x3000;
+    regs.edx.word.lo = 0;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == GUEST_CS);
+    CHECK(text[0] == 0x1768 && text[1] == 0x1769);
+    CHECK(text[80] == 0x1774);
+    CHECK(*guest(0x40, 0x50) == 5 && *guest(0x40, 0x51) == 1);
+
+    // with stdout redirected to a file, DOS does the write
+    set_guest16(0x80, 0x06 + 1 * 0x3b + 0x05, 0x0002);
+    regs.eip.word.lo = GUEST_IP;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0xd000);
+
+    // and once something has hooked INT 10h or 21h, it sees every call
+    set_guest16(0x80, 0x06 + 1 * 0x3b + 0x05, 0x0083);
+    set_vector(0x21, 0xe000, 0x0000);
+    GUEST_CODE(0xcd, 0x21); // int 21h
+    regs.eax.byte.hi = 0x09;
+    regs.ds16.word.lo = 0x3000;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0xe000);
+
+    set_vector(0x10, 0xe000, 0x0100);
+    GUEST_CODE(0xcd, 0x10); // int 10h
+    regs.eax.word.lo = 0x0e41;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0xe000 && regs.eip.word.lo == 0x0100);
+
+    set_vector(0x10, 0xc000, 0x0000);
+    set_vector(0x21, 0xd000, 0x0000);
+}
+
+// frames
+
+static uint8_t
+font[256 * 16];
+
+static void
+framebuffer_setup()
+{
+    // any deterministic font will do, as long as glyphs differ
+    for (uint32_t c = 0; c < 256; c++) {
+        for (uint32_t row = 0; row < 16; row++) {
+            font[c * 16 + row] = (c * 0x9d + row * 0x3b) ^ (c >> 3) ^ (row << 4);
+        }
+    }
+
+    vbe_mode_info_t mode_info;
+    memset(&mode_info, 0, sizeof(mode_info));
+    mode_info.x_res = LFB_WIDTH;
+    mode_info.y_res = LFB_HEIGHT;
+    mode_info.pitch = LFB_PITCH;
+    mode_info.bpp = 24;
+    mode_info.physbase = LFB_PHYS;
+
+    host_lfb_phys = LFB_PHYS;
+    framebuffer_init(&mode_info, font, 0);
+    framebuffer_reset();
+
+    if (!host_lfb) {
+        panic("framebuffer_reset did not map the LFB");
+    }
+}
+
+static void
+scene_blank()
+{
+    for (uint32_t i = 0; i < 80 * 25; i++) {
+        text[i] = 0x0720;
+    }
+}
+
+static void
+scene_charset()
+{
+    // every character in every attribute somewhere on screen
+    for (uint32_t i = 0; i < 80 * 25; i++) {
+        text[i] = ((i * 7) & 0xff) << 8 | (i & 0xff);
+    }
+}
+
+static void
+scene_dos()
+{
+    static const char* const lines[] = {
+        "Starting MS-DOS...",
+        "",
+        "C:\\>dir",
+        "",
+        " Volume in drive C has no label",
+        " Directory of C:\\",
+        "",
+        "COMMAND  COM        54,645 05-31-94   6:22a",
+        "SUBSUME  COM        32,768 01-01-19  12:00a",
+        "AUTOEXEC BAT            24 01-01-19  12:00a",
+        "",
+        "C:\\>",
+    };
+
+    scene_blank();
+    for (uint32_t y = 0; y < sizeof(lines) / sizeof(lines[0]); y++) {
+        for (uint32_t x = 0; lines[y][x]; x++) {
+            text[y * 80 + x] = 0x0700 | (uint8_t)lines[y][x];
+        }
+    }
+    // a highlighted bottom line
+    for (uint32_t x = 0; x < 80; x++) {
+        text[24 * 80 + x] = 0x1f00 | (text[24 * 80 + x] & 0xff);
+    }
+}
+
+static const struct {
+    const char* name;
+    void (*setup)();
+    // FNV-1a of the whole LFB after a refresh
+    uint32_t golden;
+} scenes[] = {
+    { "blank", scene_blank, 0x231f4795 },
+    { "charset", scene_charset, 0x438731c7 },
+    { "dos", scene_dos, 0x29631edf },
+};
+
+#define SCENES (sizeof(scenes) / sizeof(scenes[0]))
+
+static uint32_t
+frame_hash()
+{
+    uint32_t hash = 0x811c9dc5;
+    for (uint32_t i = 0; i < LFB_HEIGHT * LFB_PITCH; i++) {
+        hash = (hash ^ host_lfb[i]) * 0x01000193;
+    }
+    return hash;
+}
+
+static void
+test_frames()
+{
+    for (uint32_t i = 0; i < SCENES; i++) {
+        scenes[i].setup();
+        framebuffer_refresh();
+
+        uint32_t hash = frame_hash();
+        if (hash != scenes[i].golden) {
+            fprintf(stderr, "frame %s: hash %08x, expected %08x\n", scenes[i].name, hash, scenes[i].golden);
+            failures++;
+        }
+    }
+}
+
+static void
+dump_frames(const char* dir)
+{
+    for (uint32_t i = 0; i < SCENES; i++) {
+        scenes[i].setup();
+        framebuffer_refresh();
+
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s.ppm", dir, scenes[i].name);
+        FILE* file = fopen(path, "wb");
+        if (!file) {
+            perror(path);
+            exit(1);
+        }
+
+        // the LFB is BGR, PPM wants RGB
+        fprintf(file, "P6\n%u %u\n255\n", LFB_WIDTH, LFB_HEIGHT);
+        for (uint32_t y = 0; y < LFB_HEIGHT; y++) {
+            for (uint32_t x = 0; x < LFB_WIDTH; x++) {
+                const uint8_t* pixel = &host_lfb[y * LFB_PITCH + x * 3];
+                fputc(pixel[2], file);
+                fputc(pixel[1], file);
+                fputc(pixel[0], file);
+            }
+        }
+
+        fclose(file);
+        printf("%s %08x\n", path, frame_hash());
+    }
+}
+
+static void
+test_lfb()
+{
+    // the guest takes the frame buffer with the kernel's own mode, and the
+    // console stops drawing over it
+    scene_dos();
+    framebuffer_refresh();
+    uint32_t console = frame_hash();
+
+    GUEST_CODE(0xcd, 0x10); // int 10h
+    set_vector(0x10, 0xc000, 0x0000);
+    task.text = text;
+    regs.eax.word.lo = 0x4f02;
+    regs.ebx.word.lo = VBE_MODE | 0x4000;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == GUEST_CS);
+    CHECK(regs.eax.word.lo == 0x004f);
+
+    scene_charset();
+    framebuffer_refresh();
+    uint32_t cleared = frame_hash();
+    CHECK(cleared != console);
+    CHECK(host_lfb[0] == 0 && host_lfb[LFB_HEIGHT * LFB_PITCH - 1] == 0);
+
+    // other modes would take the card from the kernel
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x4f02;
+    regs.ebx.word.lo = 0x0101;
+    vm86_gpf(&task);
+    CHECK(regs.eax.word.lo == 0x014f);
+
+    // the mode information has window A at A0000, switched by the loader's
+    // window function
+    framebuffer_window(0x0900, 0x0004);
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x4f01;
+    regs.ecx.word.lo = VBE_MODE;
+    regs.es16.word.lo = 0x3000;
+    regs.edi.word.lo = 0;
+    vm86_gpf(&task);
+    CHECK(regs.eax.word.lo == 0x004f);
+    CHECK(*guest(0x3000, 2) == 0x07);
+    CHECK(guest16(0x3000, 8) == 0xa000);
+    CHECK(guest16(0x3000, 12) == 0x0004 && guest16(0x3000, 14) == 0x0900);
+    CHECK(guest16(0x3000, 18) == LFB_WIDTH);
+
+    // bank switches are answered without the BIOS
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x4f05;
+    regs.ebx.word.lo = 0x0000;
+    regs.edx.word.lo = 3;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == GUEST_CS);
+    CHECK(regs.eax.word.lo == 0x004f);
+
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x4f05;
+    regs.ebx.word.lo = 0x0100;
+    regs.edx.word.lo = 0;
+    vm86_gpf(&task);
+    CHECK(regs.eax.word.lo == 0x004f && regs.edx.word.lo == 3);
+
+    // another guest shown gets the console only once the owner's CPU has
+    // moved it onto a copy of its picture, which comes back with the focus
+    static uint16_t other[80 * 25];
+    host_lfb[0] = 0x5a;
+    host_lfb[LFB_HEIGHT / 2 * LFB_PITCH + LFB_PITCH / 2] = 0x5a;
+    uint32_t picture = frame_hash();
+    framebuffer_show(other);
+    CHECK(frame_hash() == picture);
+    cpus[0].task = &task;
+    framebuffer_follow();
+    framebuffer_refresh();
+    CHECK(frame_hash() != picture);
+    framebuffer_show(text);
+    framebuffer_follow();
+    CHECK(frame_hash() == picture);
+    cpus[0].task = 0;
+
+    // back to text mode through the BIOS, and the console with it
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x0003;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0xc000);
+    framebuffer_refresh();
+    CHECK(frame_hash() != cleared);
+
+    // and its bank switches go to the BIOS again
+    regs.cs.word.lo = GUEST_CS;
+    regs.eip.word.lo = GUEST_IP;
+    regs.eax.word.lo = 0x4f05;
+    regs.ebx.word.lo = 0x0000;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0xc000);
+}
+
+static void
+dac_out(uint16_t port, uint8_t value)
+{
+    GUEST_CODE(0xee); // out dx, al
+    task.text = text;
+    regs.edx.word.lo = port;
+    regs.eax.byte.lo = value;
+    vm86_gpf(&task);
+}
+
+static uint8_t
+dac_in(uint16_t port)
+{
+    GUEST_CODE(0xec); // in al, dx
+    task.text = text;
+    regs.edx.word.lo = port;
+    vm86_gpf(&task);
+    return regs.eax.byte.lo;
+}
+
+static void
+test_mode13h()
+{
+    // the BIOS sets mode 13h, into RAM behind A0000
+    GUEST_CODE(0xcd, 0x10); // int 10h
+    set_vector(0x10, 0xc000, 0x0000);
+    task.text = text;
+    cpus[0].task = &task;
+    regs.eax.word.lo = 0x0013;
+    vm86_gpf(&task);
+    CHECK(regs.cs.word.lo == 0xc000);
+
+    // and loads the DAC, which reads back what it was given
+    dac_out(0x3c8, 1);
+    dac_out(0x3c9, 63);
+    dac_out(0x3c9, 32);
+    dac_out(0x3c9, 0);
+    dac_out(0x3c7, 1);
+    CHECK(dac_in(0x3c9) == 63);
+    CHECK(dac_in(0x3c9) == 32);
+    CHECK(dac_in(0x3c9) == 0);
+
+    // pixels come out scaled up 3 times and centred, BGR
+    memset(guest(0xa000, 0), 0, 320 * 200);
+    *guest(0xa000, 0) = 1;
+    framebuffer_convert();
+    const uint8_t* pixel = &host_lfb[84 * LFB_PITCH + 32 * 3];
+    CHECK(pixel[0] == 0 && pixel[1] == 130 && pixel[2] == 255);
+    CHECK(pixel[2 * LFB_PITCH + 2 * 3 + 2] == 255);
+    CHECK(pixel[3 * 3 + 2] == 0);
+    CHECK(host_lfb[0] == 0);
+
+    // text mode gives the display back to the console
+    GUEST_CODE(0xcd, 0x10); // int 10h
+    task.text = text;
+    regs.eax.word.lo = 0x0003;
+    vm86_gpf(&task);
+    *guest(0xa000, 0) = 0;
+    framebuffer_convert();
+    CHECK(pixel[2] == 255);
+    cpus[0].task = 0;
+}
+
+// a 16 bit DPMI client, entering from real mode at CLIENT_CS:0000 with DS and
+// SS at GUEST_SS. its protected mode code runs from the start of the same
+// segment, through the selector the host gives it
+#define STUB_CS         0x0900
+#define CLIENT_CS       0x1100
+#define CLIENT_PSP      0x3000
+#define CLIENT_PRIVATE  0x2800
+#define CLIENT_CODE_SEL 0x27
+#define CLIENT_DATA_SEL 0x2f
+#define HOST_CODE_SEL   0x0f
+#define FLAG_CARRY      0x0001
+
+static void
+client_gpf(uint32_t error, const uint8_t* code, uint32_t len)
+{
+    memcpy(guest(CLIENT_CS, 0), code, len);
+    regs.eip.dword = 0;
+    regs.error_code = error;
+    dpmi_gpf(&task);
+}
+
+#define CLIENT_CODE(error, ...) do { \
+        static const uint8_t code[] = { __VA_ARGS__ }; \
+        client_gpf((error), code, sizeof(code)); \
+    } while (0)
+
+static void
+int31(uint16_t function)
+{
+    // INT 31h finds a ring 0 gate in the IDT
+    regs.eax.word.lo = function;
+    CLIENT_CODE(0x31 << 3 | 2, 0xcd, 0x31);
+}
+
+static bool
+carry()
+{
+    return regs.eflags.dword & FLAG_CARRY;
+}
+
+static void
+enter_client()
+{
+    // the client far calls the entry stub
+    GUEST_CODE(0x90);
+    regs.cs.word.lo = STUB_CS;
+    regs.eip.word.lo = 0x0000;
+    regs.ds16.word.lo = GUEST_SS;
+    regs.es16.word.lo = CLIENT_PRIVATE;
+    regs.esp.word.lo -= 4;
+    set_guest16(GUEST_SS, regs.esp.word.lo, 0x0000);
+    set_guest16(GUEST_SS, regs.esp.word.lo + 2, CLIENT_CS);
+    regs.eax.word.lo = 0;
+    vm86_gpf(&task);
+}
+
+static uint32_t
+free_memory()
+{
+    regs.es_ = CLIENT_DATA_SEL;
+    regs.edi.word.lo = 0x0100;
+    int31(0x0500);
+    uint32_t free;
+    memcpy(&free, guest(GUEST_SS, 0x0100), sizeof(free));
+    return free;
+}
+
+static void
+test_dpmi()
+{
+    // DOS is running the client, whose PSP has no environment
+    console_dos_info(0x0070, 0x0000, 0x0050, 0x0000);
+    set_guest16(0x0050, 0x0010, CLIENT_PSP);
+    set_guest16(CLIENT_PSP, 0x2c, 0);
+
+    // which enters through the loader's stub
+    memcpy(guest(STUB_CS, 0), "\xcd" "\x7f", 2);
+    dpmi_stub(STUB_CS, 0x0000);
+    enter_client();
+    CHECK(task.dpmi != 0);
+    CHECK(!(regs.eflags.dword & FLAG_VM8086) && !carry());
+    CHECK(regs.cs.word.lo == CLIENT_CODE_SEL && regs.eip.dword == 0);
+    CHECK(regs.ss.word.lo == CLIENT_DATA_SEL && regs.ds_ == CLIENT_DATA_SEL);
+    CHECK(regs.esp.dword == GUEST_SP);
+
+    // IRQs come in on the real mode vectors, master PIC base in DH
+    int31(0x0400);
+    CHECK(!carry() && regs.eax.word.lo == 0x005a);
+    CHECK(regs.edx.word.lo == 0x0870);
+
+    // descriptors are allocated blank and can be moved and resized
+    regs.ecx.word.lo = 1;
+    int31(0x0000);
+    uint16_t selector = regs.eax.word.lo;
+    CHECK(!carry() && (selector & 7) == 7);
+    CHECK(regs.eip.dword == 2);
+
+    regs.ebx.word.lo = selector;
+    regs.ecx.word.lo = 0x0001;
+    regs.edx.word.lo = 0x2345;
+    int31(0x0007);
+    regs.ecx.dword = regs.edx.dword = 0;
+    int31(0x0006);
+    CHECK(!carry() && regs.ecx.word.lo == 0x0001 && regs.edx.word.lo == 0x2345);
+
+    // limits past 1 MiB are in pages, so must end on a page boundary
+    regs.ecx.word.lo = 0x0012;
+    regs.edx.word.lo = 0x3456;
+    int31(0x0008);
+    CHECK(carry() && regs.eax.word.lo == 0x8021);
+    regs.ebx.word.lo = selector;
+    regs.edx.word.lo = 0xffff;
+    int31(0x0008);
+    CHECK(!carry());
+
+    // rebuilding kept the access byte, and the raw descriptor shows it all
+    uint8_t* descriptor = guest(GUEST_SS, 0x0100);
+    regs.es_ = CLIENT_DATA_SEL;
+    regs.edi.word.lo = 0x0100;
+    int31(0x000b);
+    CHECK(!carry());
+    CHECK(memcmp(descriptor, "\x2f\x01\x45\x23\x01\xf2\x80\x00", 8) == 0);
+
+    // only ring 3 code and data segments, never system or 64 bit ones
+    regs.ecx.word.lo = 0x0092;
+    int31(0x0009);
+    CHECK(carry() && regs.eax.word.lo == 0x8021);
+    regs.ecx.word.lo = 0x20fa;
+    int31(0x0009);
+    CHECK(carry());
+    regs.ecx.word.lo = 0x40fa;
+    int31(0x0009);
+    CHECK(!carry());
+    int31(0x000b);
+    CHECK(descriptor[5] == 0xfa && descriptor[6] == 0x40);
+
+    descriptor[5] = 0x82;
+    int31(0x000c);
+    CHECK(carry() && regs.eax.word.lo == 0x8021);
+
+    // the host's selectors aren't the client's to free
+    regs.ebx.word.lo = HOST_CODE_SEL;
+    int31(0x0001);
+    CHECK(carry() && regs.eax.word.lo == 0x8022);
+    regs.ebx.word.lo = selector;
+    int31(0x0001);
+    CHECK(!carry());
+    int31(0x0006);
+    CHECK(carry() && regs.eax.word.lo == 0x8022);
+
+    // 0300h reflects the interrupt on the private stack, returning to the
+    // stub's second alias
+    uint8_t* call = guest(GUEST_SS, 0x0200);
+    memset(call, 0, 0x32);
+    memcpy(call + 0x1c, "\x34\x12\x00\x00", 4);
+    set_vector(0x60, 0x3100, 0x0010);
+    regs.es_ = CLIENT_DATA_SEL;
+    regs.edi.word.lo = 0x0200;
+    regs.ebx.word.lo = 0x0060;
+    regs.ecx.word.lo = 0;
+    int31(0x0300);
+    CHECK(regs.eflags.dword & FLAG_VM8086);
+    CHECK(regs.cs.word.lo == 0x3100 && regs.eip.word.lo == 0x0010);
+    CHECK(regs.eax.word.lo == 0x1234);
+    CHECK(regs.ss.word.lo == CLIENT_PRIVATE && regs.esp.word.lo == 0x200 - 6);
+    CHECK(guest16(CLIENT_PRIVATE, 0x200 - 6) == 0x0010);
+    CHECK(guest16(CLIENT_PRIVATE, 0x200 - 4) == STUB_CS - 1);
+
+    // whose IRET lands back in protected mode, with the results in the
+    // call structure
+    regs.cs.word.lo = STUB_CS - 1;
+    regs.eip.word.lo = 0x0010;
+    regs.esp.word.lo += 6;
+    regs.eax.word.lo = 0x5678;
+    regs.eflags.dword |= FLAG_CARRY;
+    vm86_gpf(&task);
+    CHECK(!(regs.eflags.dword & FLAG_VM8086) && !carry());
+    CHECK(regs.cs.word.lo == CLIENT_CODE_SEL && regs.eip.dword == 2);
+    CHECK(guest16(GUEST_SS, 0x0200 + 0x1c) == 0x5678);
+    CHECK(guest16(GUEST_SS, 0x0200 + 0x20) & FLAG_CARRY);
+
+    // CLI, STI, port I/O and RDTSC are emulated, prefixes and all
+    CLIENT_CODE(0, 0xfa); // cli
+    CHECK(!task.interrupts_enabled && regs.eip.dword == 1);
+    CLIENT_CODE(0, 0xfb); // sti
+    CHECK(task.interrupts_enabled && regs.eip.dword == 1);
+
+    regs.edx.word.lo = 0x300;
+    regs.eax.dword = 0xcafef00d;
+    CLIENT_CODE(0, 0x66, 0xef); // out dx, eax
+    CHECK(ind(0x300) == 0xcafef00d && regs.eip.dword == 2);
+
+    host_ports[0x61] = 0x42;
+    CLIENT_CODE(0, 0x2e, 0xe4, 0x61); // cs: in al, 61h
+    CHECK(regs.eax.byte.lo == 0x42 && regs.eip.dword == 3);
+
+    regs.eax.dword = regs.edx.dword = 0;
+    CLIENT_CODE(0, 0x0f, 0x31); // rdtsc
+    CHECK((regs.eax.dword || regs.edx.dword) && regs.eip.dword == 2);
+
+    // memory is committed as it's allocated
+    uint32_t free = free_memory();
+    regs.ebx.word.lo = 0x0000;
+    regs.ecx.word.lo = 0x1000;
+    int31(0x0501);
+    CHECK(!carry());
+    CHECK(free_memory() == free - 0x1000);
+
+    // anything else is the client's own fault, which ends it through DOS
+    set_vector(0x21, 0x3200, 0x0020);
+    CLIENT_CODE(0, 0x0f, 0x01, 0xd8); // vmrun
+    CHECK(task.dpmi == 0);
+    CHECK(regs.eflags.dword & FLAG_VM8086);
+    CHECK(regs.cs.word.lo == 0x3200 && regs.eax.word.lo == 0x4cff);
+
+    // the next client starts afresh, in the pages the last one left behind
+    enter_client();
+    CHECK(task.dpmi != 0 && !(regs.eflags.dword & FLAG_VM8086));
+    CHECK(free_memory() == free);
+    CLIENT_CODE(0, 0x0f, 0x01, 0xd8); // vmrun
+    CHECK(task.dpmi == 0);
+}
+
+static void
+mcb(uint16_t segment, uint8_t type, uint16_t size)
+{
+    *guest(segment, 0) = type;
+    set_guest16(segment, 1, 0);
+    set_guest16(segment, 3, size);
+}
+
+static void
+test_umb()
+{
+    // DOS 5 with conventional memory ending in a free block up to A000h
+    GUEST_CODE(0xcd, HYPERCALL_VECTOR);
+    regs.eax.byte.hi = HYPERCALL_DOS_INFO;
+    regs.es16.word.lo = 0x0060;
+    regs.ebx.word.lo = 0x0026;
+    set_guest16(0x0060, 0x0024, 0x0700);
+    set_guest16(0x0060, 0x0026 + 0x66, 0xffff);
+    mcb(0x0700, 'M', 0x08ff);
+    mcb(0x1000, 'Z', 0x8fff);
+    vm86_gpf(&task);
+
+    // which gives a paragraph for the system block over video memory and
+    // the ROMs before the first UMB
+    CHECK(guest16(0x0060, 0x0026 + 0x66) == 0x9fff);
+    CHECK(*guest(0x1000, 0) == 'Z' && guest16(0x1000, 3) == 0x8ffe);
+    CHECK(*guest(0x9fff, 0) == 'M' && guest16(0x9fff, 1) == 8 && guest16(0x9fff, 3) == 0x3000);
+    CHECK(memcmp(guest(0x9fff, 8), "SC", 2) == 0);
+
+    // the UMBs are free, with a system block over the ROMs between them
+    CHECK(*guest(0xd000, 0) == 'M' && guest16(0xd000, 1) == 0 && guest16(0xd000, 3) == 0x03fe);
+    CHECK(*guest(0xd3ff, 0) == 'M' && guest16(0xd3ff, 1) == 8 && guest16(0xd3ff, 3) == 0x0c00);
+    CHECK(*guest(0xe000, 0) == 'Z' && guest16(0xe000, 1) == 0 && guest16(0xe000, 3) == 0x00ff);
+
+    // and only once
+    vm86_gpf(&task);
+    CHECK(guest16(0x1000, 3) == 0x8ffe);
+}
+
+// benchmarks
+
+#define REFRESH_ITERATIONS  200
+#define INSN_ITERATIONS     1000000
+
+static void
+bench_refresh()
+{
+    scene_dos();
+    framebuffer_refresh();
+
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < REFRESH_ITERATIONS; i++) {
+        framebuffer_refresh();
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    printf("%-16s %12llu cycles\n", "refresh", cycles / REFRESH_ITERATIONS);
+}
+
+static void
+bench_insn(const char* name, const uint8_t* code, uint32_t len)
+{
+    guest_reset(code, len);
+    set_vector(0x21, GUEST_CS, GUEST_IP + len);
+    regs.edx.word.lo = 0x80;
+
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < INSN_ITERATIONS; i++) {
+        regs.cs.word.lo = GUEST_CS;
+        regs.eip.word.lo = GUEST_IP;
+        regs.esp.word.lo = GUEST_SP;
+        task.interrupts_enabled = true;
+        vm86_gpf(&task);
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    printf("%-16s %12llu cycles\n", name, cycles / INSN_ITERATIONS);
+}
+
+#define BENCH_INSN(name, ...) do { \
+        static const uint8_t code[] = { __VA_ARGS__ }; \
+        bench_insn(name, code, sizeof(code)); \
+    } while (0)
+
+int
+main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        host_verbose = true;
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [-v] test | bench | dump <dir>\n", argv[0]);
+        return 2;
+    }
+
+    a20_init();
+    framebuffer_setup();
+
+    if (strcmp(argv[1], "test") == 0) {
+        test_cli_sti();
+        test_halt();
+        test_pushf_popf();
+        test_int_iret();
+        test_port_io();
+        test_a20();
+        test_hypercall();
+        test_console();
+        test_frames();
+        test_lfb();
+        test_mode13h();
+        test_dpmi();
+        test_umb();
+
+        if (failures) {
+            fprintf(stderr, "%u check(s) failed\n", failures);
+            return 1;
+        }
+
+        printf("all checks passed\n");
+        return 0;
+    }
+
+    if (strcmp(argv[1], "bench") == 0) {
+        bench_refresh();
+        BENCH_INSN("cli", 0xfa);
+        BENCH_INSN("sti", 0xfb);
+        BENCH_INSN("pushf", 0x9c);
+        BENCH_INSN("out dx, al", 0xee);
+        BENCH_INSN("in al, imm", 0xe4, 0x61);
+        BENCH_INSN("int 21h", 0xcd, 0x21);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "dump") == 0 && argc > 2) {
+        dump_frames(argv[2]);
+        return 0;
+    }
+
+    fprintf(stderr, "usage: %s [-v] test | bench | dump <dir>\n", argv[0]);
+    return 2;
+}
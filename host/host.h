@@ -0,0 +1,29 @@
+#ifndef HOST_H
+#define HOST_H
+
+// shared between the host harness and its stubs. libc headers must come
+// before this, the kernel's own types.h defines NULL differently
+#undef NULL
+
+#include "framebuffer.h"
+#include "kernel.h"
+#include "mm.h"
+#include "task.h"
+
+// fake I/O ports, read by inb and friends and written by outb and friends
+extern uint8_t
+host_ports[0x10000];
+
+// physical address framebuffer_reset maps the LFB from, and where the stub
+// page_map found it mapped
+extern phys_t
+host_lfb_phys;
+
+extern uint8_t*
+host_lfb;
+
+// echo kernel debug output (port 0xe9) to stderr
+extern bool
+host_verbose;
+
+#endif
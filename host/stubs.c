@@ -0,0 +1,397 @@
+// stand-ins for the kernel services used by the units the host harness
+// links in: page tables, port I/O, locking and the rest of the kernel
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "interrupt.h"
+#include "io.h"
+#include "replay.h"
+#include "smp.h"
+#include "stats.h"
+#include "wset.h"
+
+uint8_t
+guest_memory[LOW_MEM_MAX] __attribute__((aligned(PAGE_SIZE)));
+
+uint8_t
+host_ports[0x10000];
+
+phys_t
+host_lfb_phys;
+
+uint8_t*
+host_lfb;
+
+bool
+host_verbose;
+
+cpu_t
+cpus[MAX_CPUS];
+
+uint32_t
+cpu_count = 1;
+
+stats_t
+stats;
+
+void
+panic(const char* msg)
+{
+    fprintf(stderr, "panic: %s\n", msg);
+    abort();
+}
+
+bool
+critical_begin()
+{
+    return false;
+}
+
+void
+critical_end(bool prev)
+{
+    (void)prev;
+}
+
+void
+spin_lock(spinlock_t* lock)
+{
+    *lock = 1;
+}
+
+void
+spin_unlock(spinlock_t* lock)
+{
+    *lock = 0;
+}
+
+void
+outb(uint16_t port, uint8_t value)
+{
+    if (port == 0xe9) {
+        if (host_verbose) {
+            fputc(value, stderr);
+        }
+        return;
+    }
+
+    host_ports[port] = value;
+}
+
+uint8_t
+inb(uint16_t port)
+{
+    return host_ports[port];
+}
+
+void
+outw(uint16_t port, uint16_t value)
+{
+    memcpy(&host_ports[port], &value, sizeof(value));
+}
+
+uint16_t
+inw(uint16_t port)
+{
+    uint16_t value;
+    memcpy(&value, &host_ports[port], sizeof(value));
+    return value;
+}
+
+void
+outd(uint16_t port, uint32_t value)
+{
+    memcpy(&host_ports[port], &value, sizeof(value));
+}
+
+uint32_t
+ind(uint16_t port)
+{
+    uint32_t value;
+    memcpy(&value, &host_ports[port], sizeof(value));
+    return value;
+}
+
+void
+outsb(uint16_t port, const void* buf, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        outb(port, ((const uint8_t*)buf)[i]);
+    }
+}
+
+// there are no page tables: virtual and physical addresses are the same and
+// page_map and page_map_range only remember where the LFB went. freed pages
+// are reused last in first out without clearing them, as the kernel does
+
+static void*
+virt_free_list;
+
+void*
+virt_alloc()
+{
+    if (virt_free_list) {
+        void* page = virt_free_list;
+        virt_free_list = *(void**)page;
+        return page;
+    }
+
+    void* page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (!page) {
+        panic("virt_alloc: out of memory");
+    }
+    memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+void
+virt_free(void* virt)
+{
+    *(void**)virt = virt_free_list;
+    virt_free_list = virt;
+}
+
+void
+zero_page(void* page)
+{
+    memset(page, 0, PAGE_SIZE);
+}
+
+phys_t
+phys_alloc()
+{
+    return 0;
+}
+
+void
+phys_free(phys_t phys)
+{
+    (void)phys;
+}
+
+phys_t
+virt_to_phys(void* virt)
+{
+    return (phys_t)virt;
+}
+
+void
+page_map(void* virt, phys_t phys, uint16_t flags)
+{
+    (void)flags;
+
+    if (host_lfb_phys && phys == host_lfb_phys) {
+        host_lfb = virt;
+    }
+}
+
+void
+page_map_range(void* virt, phys_t phys, uint32_t count, uint16_t flags)
+{
+    (void)count;
+    page_map(virt, phys, flags);
+}
+
+phys_t
+page_unmap(void* virt)
+{
+    (void)virt;
+    return 0;
+}
+
+void
+page_unmap_range(void* virt, uint32_t count)
+{
+    (void)virt;
+    (void)count;
+}
+
+void*
+temp_map(phys_t phys)
+{
+    // one scratch page stands in for whatever phys was
+    static uint8_t page[PAGE_SIZE];
+    (void)phys;
+    return page;
+}
+
+void
+temp_unmap()
+{
+}
+
+void
+lomem_reset()
+{
+}
+
+void
+lomem_private(uint32_t addr)
+{
+    (void)addr;
+}
+
+bool
+user_access(uint32_t addr, uint32_t len, bool write)
+{
+    (void)write;
+    return addr < LOW_MEM_MAX && len <= LOW_MEM_MAX - addr;
+}
+
+void
+lomem_map(uint32_t addr, phys_t phys, uint32_t count)
+{
+    (void)addr;
+    (void)phys;
+    (void)count;
+}
+
+uint32_t
+lomem_dirty(uint32_t addr, uint32_t count)
+{
+    // without dirty bits every page may have been written
+    (void)addr;
+    return (1u << count) - 1;
+}
+
+uint64_t
+lomem_umbs()
+{
+    // D0000-D3FFF and E0000-E0FFF
+    return (0xfULL << ((0xd0000 - UMB_BASE) / PAGE_SIZE)) | (1ULL << ((0xe0000 - UMB_BASE) / PAGE_SIZE));
+}
+
+static bool
+a20 = true;
+
+void
+lomem_a20(bool enabled)
+{
+    a20 = enabled;
+}
+
+bool
+lomem_a20_enabled()
+{
+    return a20;
+}
+
+void
+sched_start(uint32_t count)
+{
+    (void)count;
+}
+
+void
+smp_wake(cpu_t* cpu)
+{
+    (void)cpu;
+}
+
+void
+irq_claim(struct task* task, uint16_t port)
+{
+    (void)task;
+    (void)port;
+}
+
+// nothing is ever recorded or replayed
+
+void
+replay_hypercall(struct task* task)
+{
+    (void)task;
+}
+
+uint32_t
+replay_in(struct task* task, uint16_t port, uint8_t size, uint32_t value)
+{
+    (void)task;
+    (void)port;
+    (void)size;
+    return value;
+}
+
+uint64_t
+replay_tsc(struct task* task, uint64_t tsc)
+{
+    (void)task;
+    return tsc;
+}
+
+void
+replay_irq(struct task* task, uint8_t irq)
+{
+    (void)task;
+    (void)irq;
+}
+
+bool
+replay_live_irq(struct task* task)
+{
+    (void)task;
+    return true;
+}
+
+bool
+replay_poll(struct task* task)
+{
+    (void)task;
+    return false;
+}
+
+// timer.h's timer_t clashes with libc's, the log only needs these two
+
+bool
+timer_available()
+{
+    return false;
+}
+
+void
+timer_arm(struct timer* timer, uint32_t usecs)
+{
+    (void)timer;
+    (void)usecs;
+}
+
+bool
+ioapic_enabled()
+{
+    return false;
+}
+
+void
+stats_io(uint16_t port)
+{
+    (void)port;
+}
+
+void
+stats_snapshot(stats_t* out)
+{
+    *out = stats;
+    out->size = sizeof(stats);
+}
+
+void
+stats_status(uint16_t* row, uint32_t width)
+{
+    // a fixed status row, so frames don't depend on counters
+    static const char text[] = " subsume host harness";
+
+    for (uint32_t i = 0; i < width; i++) {
+        uint8_t c = i < sizeof(text) - 1 ? text[i] : ' ';
+        row[i] = 0x7000 | c;
+    }
+}
+
+void
+wset_snapshot(wset_t* out)
+{
+    memset(out, 0, sizeof(*out));
+    out->size = sizeof(*out);
+}
@@ -0,0 +1,151 @@
+#include "a20.h"
+#include "debug.h"
+#include "io.h"
+#include "ioport.h"
+#include "mm.h"
+#include "task.h"
+
+#define PORT_A              0x92
+#define PORT_A_A20          (1 << 1)
+
+#define KBC_DATA            0x60
+#define KBC_COMMAND         0x64
+#define KBC_STATUS_OBF      (1 << 0)
+#define KBC_READ_OUTPUT     0xd0
+#define KBC_WRITE_OUTPUT    0xd1
+#define KBC_A20_OFF         0xdd
+#define KBC_A20_ON          0xdf
+
+// output port bits besides A20 as a guest reading it expects them: out of
+// reset, keyboard IRQ enabled, clock and data lines idle
+#define OUTPUT_IDLE         0xdd
+#define OUTPUT_A20          (1 << 1)
+
+#define FLAG_CARRY          (1 << 0)
+
+static void
+set_a20(bool enabled)
+{
+    if (enabled == lomem_a20_enabled()) {
+        return;
+    }
+
+    print("a20: ");
+    print(enabled ? "on\n" : "off\n");
+    lomem_a20(enabled);
+}
+
+static bool
+a20_in(struct task* task, uint16_t port, uint8_t size, uint32_t* value)
+{
+    if (size != 1) {
+        return false;
+    }
+
+    if (port == PORT_A) {
+        *value = lomem_a20_enabled() ? PORT_A_A20 : 0;
+        return true;
+    }
+
+    if (task->kbc_command != KBC_READ_OUTPUT) {
+        return false;
+    }
+
+    // the output port read was never sent to the controller, so its status
+    // and data are made up until the guest has read the byte
+    if (port == KBC_COMMAND) {
+        *value = inb(KBC_COMMAND) | KBC_STATUS_OBF;
+        return true;
+    }
+
+    if (port == KBC_DATA) {
+        task->kbc_command = 0;
+        *value = (OUTPUT_IDLE & ~OUTPUT_A20) | (lomem_a20_enabled() ? OUTPUT_A20 : 0);
+        return true;
+    }
+
+    return false;
+}
+
+static bool
+a20_out(struct task* task, uint16_t port, uint8_t size, uint32_t value)
+{
+    if (size != 1) {
+        return false;
+    }
+
+    // bit 0 of port A and of the 8042 output port reset the machine, so
+    // none of these ever reach the hardware
+    if (port == PORT_A) {
+        set_a20(value & PORT_A_A20);
+        return true;
+    }
+
+    if (port == KBC_COMMAND) {
+        task->kbc_command = 0;
+
+        switch (value) {
+        case KBC_READ_OUTPUT:
+        case KBC_WRITE_OUTPUT:
+            task->kbc_command = value;
+            return true;
+        case KBC_A20_OFF:
+            set_a20(false);
+            return true;
+        case KBC_A20_ON:
+            set_a20(true);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    if (port == KBC_DATA && task->kbc_command == KBC_WRITE_OUTPUT) {
+        task->kbc_command = 0;
+        set_a20(value & OUTPUT_A20);
+        return true;
+    }
+
+    return false;
+}
+
+void
+a20_init()
+{
+    static const io_handler_t handler = { a20_in, a20_out };
+    io_register(KBC_DATA, KBC_DATA, &handler);
+    io_register(KBC_COMMAND, KBC_COMMAND, &handler);
+    io_register(PORT_A, PORT_A, &handler);
+}
+
+bool
+a20_int(struct task* task, uint8_t vector)
+{
+    // INT 15h AX=2400h..2403h. the BIOS would go to the real gate
+    regs_t* regs = task->regs;
+    if (vector != 0x15 || regs->eax.byte.hi != 0x24) {
+        return false;
+    }
+
+    switch (regs->eax.byte.lo) {
+    case 0x00:
+        set_a20(false);
+        break;
+    case 0x01:
+        set_a20(true);
+        break;
+    case 0x02:
+        regs->eax.byte.lo = lomem_a20_enabled();
+        break;
+    case 0x03:
+        // supported through both the 8042 and port A
+        regs->ebx.word.lo = 0x0003;
+        break;
+    default:
+        return false;
+    }
+
+    regs->eax.byte.hi = 0x00;
+    regs->eflags.word.lo &= ~FLAG_CARRY;
+    return true;
+}
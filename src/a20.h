@@ -0,0 +1,19 @@
+#ifndef A20_H
+#define A20_H
+
+#include "types.h"
+
+struct task;
+
+// virtual A20 gate. port 0x92, the 8042 output port and INT 15h AH=24h all
+// switch the guest's HMA mapping, never the real gate the kernel relies on
+
+// claims port 0x92 and the 8042's ports
+void
+a20_init();
+
+// handle a software interrupt, returns false to reflect it to the guest
+bool
+a20_int(struct task* task, uint8_t vector);
+
+#endif
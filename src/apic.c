@@ -0,0 +1,249 @@
+#include "apic.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "io.h"
+#include "kernel.h"
+#include "mm.h"
+#include "smp.h"
+#include "tables.h"
+#include "timer.h"
+#include "x86.h"
+
+#define LAPIC_ID            0x020
+#define LAPIC_EOI           0x0b0
+#define LAPIC_SVR           0x0f0
+#define LAPIC_ICR_LO        0x300
+#define LAPIC_ICR_HI        0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_PERF      0x340
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3e0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LVT_NMI             0x00000400
+#define LVT_TSC_DEADLINE    0x00040000
+#define TIMER_DIVIDE_16     0x3
+
+#define ICR_FIXED           0x00000000
+#define ICR_INIT            0x00000500
+#define ICR_STARTUP         0x00000600
+#define ICR_PENDING         0x00001000
+#define ICR_ASSERT          0x00004000
+
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WINDOW       0x10
+#define IOAPIC_VERSION      0x01
+#define IOAPIC_REDIRECT     0x10
+
+#define REDIRECT_ACTIVE_LOW 0x00002000
+#define REDIRECT_LEVEL      0x00008000
+#define REDIRECT_MASKED     0x00010000
+
+static volatile uint32_t*
+lapic;
+
+// for the IRQ fast path in isrs.asm
+volatile uint32_t*
+lapic_eoi_register;
+
+static volatile uint32_t*
+ioapic;
+
+static bool
+tsc_deadline;
+
+static uint32_t
+lapic_read(uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+static void
+lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic[reg / 4] = value;
+}
+
+bool
+lapic_init()
+{
+    if (!lapic) {
+        // first call, on the BSP
+        if (!(cpuid(CPUID_FEATURES).edx & CPUID_FEATURE_EDX_APIC)) {
+            return false;
+        }
+
+        phys_t base = tables.lapic;
+        if (!base) {
+            base = rdmsr(MSR_APIC_BASE) & PAGE_MASK;
+        }
+
+        print("lapic: base ");
+        print32(base);
+        print("\n");
+
+        lapic = mmio_map(base);
+        lapic_eoi_register = &lapic[LAPIC_EOI / 4];
+        tsc_deadline = !!(cpuid(CPUID_FEATURES).ecx & CPUID_FEATURE_ECX_TSC_DEADLINE);
+    }
+
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS);
+
+    // the timer stays idle until armed by the first kernel timer
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER | (tsc_deadline ? LVT_TSC_DEADLINE : 0));
+    return true;
+}
+
+bool
+lapic_present()
+{
+    return lapic != NULL;
+}
+
+uint8_t
+lapic_id()
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void
+lapic_eoi()
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void
+send_icr(uint8_t apic_id, uint32_t command)
+{
+    lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, command);
+
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) {
+        pause();
+    }
+}
+
+void
+lapic_ipi(uint8_t apic_id, uint8_t vector)
+{
+    send_icr(apic_id, ICR_FIXED | ICR_ASSERT | vector);
+}
+
+bool
+lapic_tsc_deadline()
+{
+    return tsc_deadline;
+}
+
+void
+lapic_timer_deadline(uint64_t tsc)
+{
+    wrmsr(MSR_TSC_DEADLINE, tsc);
+}
+
+void
+lapic_timer_oneshot(uint32_t count)
+{
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+uint32_t
+lapic_timer_current()
+{
+    return lapic_read(LAPIC_TIMER_CURRENT);
+}
+
+void
+lapic_perf_nmi()
+{
+    // performance counter overflows raise an NMI. delivery masks the entry
+    // again, so this is repeated after every overflow
+    lapic_write(LAPIC_LVT_PERF, LVT_NMI);
+}
+
+void
+lapic_start_ap(uint8_t apic_id, phys_t trampoline)
+{
+    // INIT-SIPI-SIPI
+    send_icr(apic_id, ICR_INIT | ICR_ASSERT);
+    udelay(10000);
+
+    for (uint32_t i = 0; i < 2; i++) {
+        send_icr(apic_id, ICR_STARTUP | (trampoline >> 12));
+        udelay(200);
+    }
+}
+
+static uint32_t
+ioapic_read(uint32_t reg)
+{
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    return ioapic[IOAPIC_WINDOW / 4];
+}
+
+static void
+ioapic_write(uint32_t reg, uint32_t value)
+{
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    ioapic[IOAPIC_WINDOW / 4] = value;
+}
+
+static void
+ioapic_route(uint32_t pin, uint32_t low, uint8_t apic_id)
+{
+    ioapic_write(IOAPIC_REDIRECT + pin * 2 + 1, (uint32_t)apic_id << 24);
+    ioapic_write(IOAPIC_REDIRECT + pin * 2, low);
+}
+
+bool
+ioapic_init()
+{
+    if (!lapic || !tables.ioapic) {
+        print("ioapic: not present, using legacy PICs\n");
+        return false;
+    }
+
+    print("ioapic: base ");
+    print32(tables.ioapic);
+    print("\n");
+
+    ioapic = mmio_map(tables.ioapic);
+    uint32_t pins = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xff) + 1;
+
+    for (uint32_t pin = 0; pin < pins; pin++) {
+        ioapic_route(pin, REDIRECT_MASKED, 0);
+    }
+
+    // ISA IRQs all go to the boot CPU, as they did with the PICs. IRQ 2 is
+    // the PIC cascade and never fires
+    for (uint8_t irq = 0; irq < ISA_IRQS; irq++) {
+        uint32_t pin = tables.irq_gsi[irq] - tables.ioapic_gsi_base;
+        if (irq == 2 || pin >= pins) {
+            continue;
+        }
+
+        uint32_t low = IOAPIC_BASE + irq;
+        if ((tables.irq_flags[irq] & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW) {
+            low |= REDIRECT_ACTIVE_LOW;
+        }
+        if ((tables.irq_flags[irq] & INTI_TRIGGER_MASK) == INTI_LEVEL) {
+            low |= REDIRECT_LEVEL;
+        }
+
+        ioapic_route(pin, low, lapic_id());
+    }
+
+    // the PICs stay initialised for their spurious vectors, but never raise
+    // real interrupts again
+    outb(PIC1_DATA, 0xff);
+    outb(PIC2_DATA, 0xff);
+    return true;
+}
+
+bool
+ioapic_enabled()
+{
+    return ioapic != NULL;
+}
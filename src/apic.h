@@ -0,0 +1,45 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include "types.h"
+
+bool
+lapic_init();
+
+bool
+lapic_present();
+
+uint8_t
+lapic_id();
+
+void
+lapic_eoi();
+
+void
+lapic_ipi(uint8_t apic_id, uint8_t vector);
+
+bool
+lapic_tsc_deadline();
+
+void
+lapic_timer_deadline(uint64_t tsc);
+
+void
+lapic_timer_oneshot(uint32_t count);
+
+uint32_t
+lapic_timer_current();
+
+void
+lapic_perf_nmi();
+
+void
+lapic_start_ap(uint8_t apic_id, phys_t trampoline);
+
+bool
+ioapic_init();
+
+bool
+ioapic_enabled();
+
+#endif
@@ -0,0 +1,391 @@
+#include "console.h"
+#include "debug.h"
+#include "mm.h"
+#include "task.h"
+
+#define TEXT_COLUMNS        80
+#define TEXT_ROWS           25
+
+#define BDA_KBD_HEAD        0x41a
+#define BDA_KBD_TAIL        0x41c
+#define BDA_VIDEO_MODE      0x449
+#define BDA_COLUMNS         0x44a
+#define BDA_PAGE_START      0x44e
+#define BDA_CURSOR          0x450 // column, row for page 0
+#define BDA_ACTIVE_PAGE     0x462
+
+// DOS 4.0 and later
+#define LOL_SFT             0x04
+#define SDA_CURRENT_PSP     0x10
+#define PSP_JFT_SIZE        0x32
+#define PSP_JFT             0x34
+#define SFT_NEXT            0x00
+#define SFT_COUNT           0x04
+#define SFT_ENTRIES         0x06
+#define SFT_ENTRY_SIZE      0x3b
+#define SFT_DEVICE_INFO     0x05
+#define SFT_MAX_BLOCKS      16
+
+#define DEVICE_INFO_CHAR    (1 << 7)
+#define DEVICE_INFO_STDOUT  (1 << 1)
+
+#define STDOUT              1
+// longest string written in one go, anything longer goes to the guest
+#define MAX_STRING          4096
+
+#define FLAG_CARRY          (1 << 0)
+
+#define BEL                 0x07
+#define BS                  0x08
+#define TAB                 0x09
+#define LF                  0x0a
+#define CR                  0x0d
+#define ESC                 0x1b
+
+static uint16_t* const
+text = GUEST_PTR(0xb8000);
+
+// BDA video mode when the kernel took over the display, whatever the loader's
+// VBE mode switch left there
+static uint8_t
+reset_mode;
+
+static uint32_t
+dos_lol, dos_sda;
+
+// INT 10h and 21h as the BIOS and DOS left them. once a TSR or program hooks
+// one, its calls go through the guest's own chain
+static uint32_t
+int10_handler, int21_handler;
+
+static uint32_t
+far_ptr(uint32_t linear)
+{
+    // segment:offset stored at linear, as a linear address
+    return ((uint32_t)peek16(linear + 2) << 4) + peek16(linear);
+}
+
+static uint32_t
+handler(uint8_t vector)
+{
+    // the IVT entry as it's stored, offset in the low word
+    return (uint32_t)peek16(vector * 4 + 2) << 16 | peek16(vector * 4);
+}
+
+static bool
+text_mode()
+{
+    // the kernel displays the text buffer as 80x25 page 0 from reset, so
+    // that's what the guest gets until it sets some other mode
+    uint8_t mode = peek8(BDA_VIDEO_MODE);
+    if (mode != reset_mode && mode != 0x02 && mode != 0x03 && mode != 0x07) {
+        return false;
+    }
+
+    return peek16(BDA_COLUMNS) == TEXT_COLUMNS && peek8(BDA_ACTIVE_PAGE) == 0 && peek16(BDA_PAGE_START) == 0;
+}
+
+static void
+scroll()
+{
+    // the new bottom line takes the attribute of the one it replaces
+    uint16_t blank = (text[(TEXT_ROWS - 1) * TEXT_COLUMNS] & 0xff00) | ' ';
+
+    for (uint32_t i = 0; i < (TEXT_ROWS - 1) * TEXT_COLUMNS; i++) {
+        text[i] = text[i + TEXT_COLUMNS];
+    }
+    for (uint32_t i = (TEXT_ROWS - 1) * TEXT_COLUMNS; i < TEXT_ROWS * TEXT_COLUMNS; i++) {
+        text[i] = blank;
+    }
+}
+
+typedef struct {
+    uint8_t column, row;
+}
+cursor_t;
+
+static cursor_t
+get_cursor()
+{
+    cursor_t cursor = { peek8(BDA_CURSOR), peek8(BDA_CURSOR + 1) };
+    return cursor;
+}
+
+static bool
+cursor_valid(cursor_t cursor)
+{
+    return cursor.column < TEXT_COLUMNS && cursor.row < TEXT_ROWS;
+}
+
+static void
+set_cursor(cursor_t cursor)
+{
+    lomem_private(BDA_CURSOR);
+    *(uint8_t*)guest_ptr(BDA_CURSOR) = cursor.column;
+    *(uint8_t*)guest_ptr(BDA_CURSOR + 1) = cursor.row;
+}
+
+static void
+teletype(cursor_t* cursor, uint8_t c, int attr)
+{
+    // as INT 10h AH=0Eh, plus an attribute for AH=13h. attr < 0 keeps the
+    // one already on screen
+    switch (c) {
+    case BS:
+        if (cursor->column) {
+            cursor->column--;
+        }
+        return;
+    case LF:
+        cursor->row++;
+        break;
+    case CR:
+        cursor->column = 0;
+        return;
+    default: {
+        uint16_t* cell = &text[cursor->row * TEXT_COLUMNS + cursor->column];
+        *cell = (attr < 0 ? *cell & 0xff00 : (uint16_t)attr << 8) | c;
+
+        if (++cursor->column == TEXT_COLUMNS) {
+            cursor->column = 0;
+            cursor->row++;
+        }
+        break;
+    }
+    }
+
+    if (cursor->row == TEXT_ROWS) {
+        scroll();
+        cursor->row = TEXT_ROWS - 1;
+    }
+}
+
+static bool
+plain(uint32_t linear, uint32_t len, uint32_t stride)
+{
+    // control characters other than the ones teletype handles are left to
+    // the guest: BEL beeps, TAB is expanded by DOS and ESC may be ANSI.SYS
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t c = peek8(linear + i * stride);
+        if (c == BEL || c == TAB || c == ESC) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+int10(regs_t* regs)
+{
+    if (!text_mode() || regs->ebx.byte.hi != 0) {
+        // page other than 0
+        return false;
+    }
+
+    cursor_t cursor = get_cursor();
+    if (!cursor_valid(cursor)) {
+        return false;
+    }
+
+    switch (regs->eax.byte.hi) {
+    case 0x0e: {
+        // teletype output
+        uint8_t c = regs->eax.byte.lo;
+        if (c == BEL) {
+            return false;
+        }
+        teletype(&cursor, c, -1);
+        set_cursor(cursor);
+        return true;
+    }
+    case 0x09: {
+        // write character and attribute CX times, cursor stays put
+        uint32_t pos = cursor.row * TEXT_COLUMNS + cursor.column;
+        uint16_t cell = (uint16_t)regs->ebx.byte.lo << 8 | regs->eax.byte.lo;
+        for (uint32_t n = regs->ecx.word.lo; n && pos < TEXT_ROWS * TEXT_COLUMNS; n--) {
+            text[pos++] = cell;
+        }
+        return true;
+    }
+    case 0x13: {
+        // write string at ES:BP. AL bit 0 moves the cursor, bit 1 means the
+        // string alternates characters and attributes
+        uint8_t mode = regs->eax.byte.lo;
+        uint32_t len = regs->ecx.word.lo;
+        uint32_t string = seg_off(regs->es16.word.lo, regs->ebp.word.lo);
+        uint32_t stride = mode & 2 ? 2 : 1;
+        cursor_t at = { regs->edx.byte.lo, regs->edx.byte.hi };
+
+        if (mode > 3 || !cursor_valid(at) || !plain(string, len, stride)) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < len; i++) {
+            uint8_t attr = mode & 2 ? peek8(string + i * 2 + 1) : regs->ebx.byte.lo;
+            teletype(&at, peek8(string + i * stride), attr);
+        }
+
+        if (mode & 1) {
+            set_cursor(at);
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+uint16_t
+console_psp()
+{
+    return dos_sda ? peek16(dos_sda + SDA_CURRENT_PSP) : 0;
+}
+
+static bool
+console_handle(uint16_t handle)
+{
+    // is the handle in the current process open on the console device?
+    uint32_t psp = seg_off(console_psp(), 0);
+    if (handle >= peek16(psp + PSP_JFT_SIZE)) {
+        return false;
+    }
+
+    uint8_t index = peek8(far_ptr(psp + PSP_JFT) + handle);
+    uint32_t block = far_ptr(dos_lol + LOL_SFT);
+
+    for (uint32_t i = 0; i < SFT_MAX_BLOCKS; i++) {
+        uint16_t count = peek16(block + SFT_COUNT);
+        if (index < count) {
+            uint16_t info = peek16(block + SFT_ENTRIES + index * SFT_ENTRY_SIZE + SFT_DEVICE_INFO);
+            return (info & DEVICE_INFO_CHAR) && (info & DEVICE_INFO_STDOUT);
+        }
+
+        index -= count;
+        if (peek16(block + SFT_NEXT) == 0xffff) {
+            return false;
+        }
+        block = far_ptr(block + SFT_NEXT);
+    }
+
+    return false;
+}
+
+static bool
+write_console(uint32_t string, uint32_t len)
+{
+    cursor_t cursor = get_cursor();
+    if (!cursor_valid(cursor) || !plain(string, len, 1)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < len; i++) {
+        teletype(&cursor, peek8(string + i), -1);
+    }
+    set_cursor(cursor);
+    return true;
+}
+
+static bool
+int21(regs_t* regs)
+{
+    if (!dos_sda || !text_mode()) {
+        return false;
+    }
+
+    // keystrokes waiting may be ^C, ^S or ^P, which DOS checks for while
+    // writing to the console
+    if (peek16(BDA_KBD_HEAD) != peek16(BDA_KBD_TAIL)) {
+        return false;
+    }
+
+    switch (regs->eax.byte.hi) {
+    case 0x02:
+    case 0x06: {
+        // write character in DL. DL = FFh is input for AH=06h
+        uint8_t c = regs->edx.byte.lo;
+        cursor_t cursor = get_cursor();
+        if ((regs->eax.byte.hi == 0x06 && c == 0xff) || c == BEL || c == TAB || c == ESC) {
+            return false;
+        }
+        if (!cursor_valid(cursor) || !console_handle(STDOUT)) {
+            return false;
+        }
+
+        teletype(&cursor, c, -1);
+        set_cursor(cursor);
+        regs->eax.byte.lo = c;
+        return true;
+    }
+    case 0x09: {
+        // write '$' terminated string at DS:DX
+        uint32_t string = seg_off(regs->ds16.word.lo, regs->edx.word.lo);
+        uint32_t len = 0;
+        while (len < MAX_STRING && peek8(string + len) != '$') {
+            len++;
+        }
+
+        if (len == MAX_STRING || !console_handle(STDOUT) || !write_console(string, len)) {
+            return false;
+        }
+        regs->eax.byte.lo = '$';
+        return true;
+    }
+    case 0x40: {
+        // write CX bytes at DS:DX to handle BX
+        uint32_t len = regs->ecx.word.lo;
+        if (len > MAX_STRING || !console_handle(regs->ebx.word.lo)) {
+            return false;
+        }
+        if (!write_console(seg_off(regs->ds16.word.lo, regs->edx.word.lo), len)) {
+            return false;
+        }
+        regs->eax.word.lo = len;
+        regs->eflags.word.lo &= ~FLAG_CARRY;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+void
+console_reset()
+{
+    reset_mode = peek8(BDA_VIDEO_MODE);
+    int10_handler = handler(0x10);
+}
+
+void
+console_dos_info(uint16_t lol_segment, uint16_t lol_offset, uint16_t sda_segment, uint16_t sda_offset)
+{
+    print("console: DOS list of lists ");
+    print16(lol_segment);
+    print(":");
+    print16(lol_offset);
+    print(", SDA ");
+    print16(sda_segment);
+    print(":");
+    print16(sda_offset);
+    print("\n");
+
+    dos_lol = seg_off(lol_segment, lol_offset);
+    dos_sda = seg_off(sda_segment, sda_offset);
+    int21_handler = handler(0x21);
+}
+
+bool
+console_int(struct task* task, uint8_t vector)
+{
+    if (!task->has_reset) {
+        return false;
+    }
+
+    switch (vector) {
+    case 0x10:
+        return handler(0x10) == int10_handler && int10(task->regs);
+    case 0x21:
+        return handler(0x21) == int21_handler && int21(task->regs);
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "types.h"
+
+struct task;
+
+// paravirtual console output: text the video BIOS and DOS would write a
+// character at a time through trapped port I/O goes straight into the
+// guest's text buffer instead. anything unusual still goes to the guest, as
+// does everything once something in the guest has hooked INT 10h or 21h
+
+void
+console_reset();
+
+void
+console_dos_info(uint16_t lol_segment, uint16_t lol_offset, uint16_t sda_segment, uint16_t sda_offset);
+
+// segment of the running DOS program's PSP, or 0 if DOS didn't tell us
+uint16_t
+console_psp();
+
+// handle a software interrupt, returns false to reflect it to the guest
+bool
+console_int(struct task* task, uint8_t vector);
+
+#endif
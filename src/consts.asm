@@ -14,20 +14,58 @@
 %define SEG_UCODE   0x1b
 %define SEG_UDATA   0x23
 %define SEG_TSS     0x28
+%define SEG_CPU     0x30
+%define SEG_LDT     0x38
 
 %define TSS_ESP0    0x04
 %define TSS_SS0     0x08
 %define TSS_IOPB    0x66
 %define TSS_SIZE    104
 
+; kept free at the top of each kernel stack, see smp.h
+%define FRAME_PAD   16
+
 %define PAGE_PRESENT    0x001
 %define PAGE_RW         0x002
 %define PAGE_USER       0x004
 %define PAGE_FLAGS      0xfff
 
+; the current address space's page tables, mapped through the last page
+; directory entry
+%define PAGE_TABLE      0xffc00000
+
+%define IOAPIC_BASE     0x30
+%define PIC_EOI         0x20
+
+%define IPI_WAKE        0xf0
+%define IPI_TICK        0xf1
+%define APIC_TIMER      0xf2
+%define IPI_SHOOTDOWN   0xf3
+%define APIC_SPURIOUS   0xff
+
 %define FLAG_INTERRUPT  (1 << 9)
 %define FLAG_VM8086     (1 << 17)
 
+; offsets into cpu_t and task_t, checked in smp.h and task.h
+%define CPU_TASK                4
+%define CPU_FAST_IRQS           8
+%define CPU_ENTRY_TSC           12
+%define TASK_INTERRUPTS_ENABLED 109
+%define TASK_PENDING_IRQS       110
+%define STATS_IRQS_REFLECTED    4
+
+%define HYPERCALL_VECTOR       0x7f
+%define HYPERCALL_RESET        0x00
+%define HYPERCALL_HIST_DUMP    0x01
+%define HYPERCALL_STATS        0x02
+%define HYPERCALL_PRINT        0x03
+%define HYPERCALL_PROFILE_DUMP 0x04
+%define HYPERCALL_DOS_INFO     0x05
+%define HYPERCALL_DPMI_STUB    0x06
+%define HYPERCALL_REPLAY       0x07
+%define HYPERCALL_WSET         0x08
+%define HYPERCALL_VBE_WINDOW   0x09
+
 %define TASK_SIZE       (2 * 5)
 %define TASK_CS         0
 %define TASK_IP         2
@@ -35,7 +73,15 @@
 %define TASK_SS         6
 %define TASK_SP         8
 
+; the kernel's display mode, 1024x768x24. must match framebuffer.h
+%define VBE_MODE            0x0118
+
+; VBE protected mode interface table, preceded by its length. must match
+; framebuffer.h
+%define VBE_PMI_MAX         1022
+
 %define REALDATA_FONT       0                           ; size = 4096
 %define REALDATA_VBE_INFO   (REALDATA_FONT + 4096)      ; size = 512
-%define REALDATA_TASK       (REALDATA_VBE_INFO + 512)   ; size = TASK_SIZE
+%define REALDATA_VBE_PMI    (REALDATA_VBE_INFO + 512)   ; size = VBE_PMI_MAX + 2
+%define REALDATA_TASK       (REALDATA_VBE_PMI + VBE_PMI_MAX + 2) ; size = TASK_SIZE
 %define REALDATA_MEMMAP     (REALDATA_TASK + TASK_SIZE) ; size indeterminate
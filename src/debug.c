@@ -1,12 +1,14 @@
 #include "debug.h"
-#include "io.h"
+#include "log.h"
 
 void
 print(const char* msg)
 {
-    for(; *msg; msg++) {
-        outb(0xe9, *msg);
+    uint32_t len = 0;
+    while (msg[len]) {
+        len++;
     }
+    log_write(msg, len);
 }
 
 static const char* hexmap = "0123456789abcdef";
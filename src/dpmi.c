@@ -0,0 +1,1959 @@
+#include "dpmi.h"
+#include "console.h"
+#include "debug.h"
+#include "framebuffer.h"
+#include "interrupt.h"
+#include "kernel.h"
+#include "mm.h"
+#include "smp.h"
+#include "task.h"
+#include "x86.h"
+
+#define FLAG_CARRY          (1 << 0)
+#define FLAG_TRAP           (1 << 8)
+#define ARITH_FLAGS         0x08d5 // CF PF AF ZF SF OF
+// flags a client may set for itself. IOPL and NT stay clear, IF stays set
+#define CLIENT_FLAGS        (ARITH_FLAGS | FLAG_TRAP | 0x00240400) // TF DF AC ID
+#define RESERVED_FLAGS      0x0002
+
+#define LDT_ENTRIES         (PAGE_SIZE / 8)
+// entries below LDT_CLIENT belong to the host
+#define LDT_HOST_CODE       1
+#define LDT_HOST_STACK      2
+#define LDT_CALLBACK_STACK  3
+#define LDT_CLIENT          4
+
+// ldt_flags
+#define LDT_USED            (1 << 0)
+#define LDT_HOST            (1 << 1)
+#define LDT_SEGMENT         (1 << 2) // from 0002h, never changed or freed
+
+#define SELECTOR_LDT        (1 << 2)
+#define SELECTOR(index)     (((index) << 3) | SELECTOR_LDT | 3)
+#define HOST_CODE_SEL       SELECTOR(LDT_HOST_CODE)
+#define HOST_STACK_SEL      SELECTOR(LDT_HOST_STACK)
+#define CALLBACK_STACK_SEL  SELECTOR(LDT_CALLBACK_STACK)
+
+// descriptor access byte
+#define ACC_ACCESSED        0x01
+#define ACC_RW              0x02
+#define ACC_CONFORMING      0x04
+#define ACC_CODE            0x08
+#define ACC_SEGMENT         0x10
+#define ACC_DPL3            0x60
+#define ACC_PRESENT         0x80
+#define ACC_DATA            (ACC_PRESENT | ACC_DPL3 | ACC_SEGMENT | ACC_RW)
+#define ACC_CODE_RX         (ACC_PRESENT | ACC_DPL3 | ACC_SEGMENT | ACC_CODE | ACC_RW)
+#define LDT_DESCRIPTOR      0x82
+
+// descriptor flags nibble, as in the high half of byte 6
+#define DESC_AVL            0x10
+#define DESC_LONG           0x20
+#define DESC_32             0x40
+#define DESC_PAGES          0x80
+
+// linear addresses in a client's address space, above low memory
+#define HOST_CODE           0x00200000
+#define HOST_STACK          0x00201000
+#define HEAP_BASE           0x00400000
+#define HEAP_END            0x40000000
+
+// every byte of the host code page is a HLT, so the offset a client traps
+// at says what it wanted
+#define HOST_INT            0x000 // + vector, default interrupt handlers
+#define HOST_EXCEPTION      0x100 // + exception, default exception handlers
+#define HOST_IRQ_RETURN     0x120
+#define HOST_EXCEPTION_RETURN 0x121
+#define HOST_CALLBACK_RETURN 0x122
+
+// aliases of the stub, segment decreasing as the offset rises by 16
+#define STUB_ENTRY          0
+#define STUB_RETURN         1
+#define STUB_CALLBACK       2 // + callback
+
+#define EXCEPTIONS          32
+#define MAX_CALLBACKS       16
+#define MAX_BLOCKS          32
+#define MAX_CONTEXTS        8
+// memory blocks per client, a cap so one guest can't starve the others
+#define MAX_MEMORY          (16 * 1024 * 1024)
+
+// paragraphs of private data the client allocates for us, which is the
+// real mode stack for everything we reflect
+#define PRIVATE_PARAS       0x20
+
+#define PSP_ENVIRONMENT     0x2c
+#define MCB_SIZE            0x03
+#define OP_HLT              0xf4
+
+// the PICs' bases in real mode, which dpmi_irq delivers IRQs through
+#define MASTER_PIC_BASE     0x08
+#define SLAVE_PIC_BASE      0x70
+
+#define EXIT_FAILURE        0x4cff
+
+#define DOS_ALLOCATE        0x48
+#define DOS_FREE            0x49
+#define DOS_RESIZE          0x4a
+
+#define ERROR_UNSUPPORTED   0x8001
+#define ERROR_DESCRIPTOR_UNAVAILABLE 0x8011
+#define ERROR_LINEAR_UNAVAILABLE 0x8012
+#define ERROR_PHYSICAL_UNAVAILABLE 0x8013
+#define ERROR_CALLBACK_UNAVAILABLE 0x8015
+#define ERROR_HANDLE_UNAVAILABLE 0x8016
+#define ERROR_INVALID_VALUE 0x8021
+#define ERROR_INVALID_SELECTOR 0x8022
+#define ERROR_INVALID_HANDLE 0x8023
+#define ERROR_INVALID_CALLBACK 0x8024
+
+typedef struct {
+    uint16_t selector;
+    uint32_t offset;
+} __attribute__((packed))
+far_t;
+
+// real mode call structure of 0300h-0302h and callbacks
+typedef struct {
+    uint32_t edi, esi, ebp, reserved, ebx, edx, ecx, eax;
+    uint16_t flags, es, ds, fs, gs, ip, cs, sp, ss;
+} __attribute__((packed))
+rm_call_t;
+
+STATIC_ASSERT(rm_call_t_size, sizeof(rm_call_t) == 0x32);
+
+enum context_kind {
+    CONTEXT_INT,        // software interrupt reflected to real mode
+    CONTEXT_IRQ,        // hardware interrupt, to either mode
+    CONTEXT_CALL,       // 0300h-0302h
+    CONTEXT_DOS,        // DOS memory, 0100h-0102h
+    CONTEXT_CALLBACK,   // real mode callback running in protected mode
+};
+
+// what to go back to when a switch to the other mode finishes
+typedef struct {
+    regs_t regs;
+    uint8_t kind;
+    // finish with an IRET, for a client handler which chained to ours
+    bool iret;
+    // CONTEXT_CALL: the call structure
+    uint32_t call;
+}
+context_t;
+
+typedef struct dpmi {
+    uint64_t* ldt;
+    uint8_t ldt_flags[LDT_ENTRIES];
+    bool bits32;
+    // the client's PSP, and its environment segment which the client sees
+    // as a selector while it runs
+    uint16_t psp;
+    uint16_t environment;
+    uint16_t rm_stack;
+    far_t vectors[256];
+    far_t exceptions[EXCEPTIONS];
+    struct {
+        bool used;
+        far_t handler;
+        far_t call;
+    } callbacks[MAX_CALLBACKS];
+    struct {
+        uint32_t base;
+        uint32_t size;
+    } blocks[MAX_BLOCKS];
+    uint32_t heap_next;
+    uint32_t memory_used;
+    // the frame buffer, while mapped by 0800h
+    uint32_t lfb;
+    uint32_t lfb_size;
+    context_t contexts[MAX_CONTEXTS];
+    uint32_t depth;
+}
+dpmi_t;
+
+STATIC_ASSERT(dpmi_t_fits_in_single_page, sizeof(dpmi_t) <= PAGE_SIZE);
+
+static uint16_t
+stub_segment, stub_offset;
+
+static uint32_t
+stub_linear;
+
+static void terminate(task_t* task, uint16_t exit);
+
+static void
+copy_regs(regs_t* dst, const regs_t* src)
+{
+    uint32_t* dst32 = (uint32_t*)dst;
+    const uint32_t* src32 = (const uint32_t*)src;
+
+    for (uint32_t i = 0; i < sizeof(regs_t) / 4; i++) {
+        dst32[i] = src32[i];
+    }
+}
+
+static bool
+protected_mode(const regs_t* regs)
+{
+    return !(regs->eflags.dword & FLAG_VM8086);
+}
+
+static void*
+rm_ptr(uint16_t segment, uint16_t offset, uint32_t len, bool write)
+{
+    // low memory is always mapped, but may still be copy-on-write
+    uint32_t linear = seg_off(segment, offset);
+    return write ? guest_writable(linear, len) : guest_ptr(linear);
+}
+
+static void*
+client_ptr(uint32_t linear, uint32_t len, bool write)
+{
+    // memory the client handed us, NULL if it couldn't access it itself
+    if (!user_access(linear, len, write)) {
+        return NULL;
+    }
+    return GUEST_PTR(linear);
+}
+
+static void
+rm_push16(regs_t* regs, uint16_t value)
+{
+    regs->esp.word.lo -= 2;
+    *(uint16_t*)rm_ptr(regs->ss.word.lo, regs->esp.word.lo, 2, true) = value;
+}
+
+static uint16_t
+rm_pop16(regs_t* regs)
+{
+    uint16_t value = *(uint16_t*)rm_ptr(regs->ss.word.lo, regs->esp.word.lo, 2, false);
+    regs->esp.word.lo += 2;
+    return value;
+}
+
+static uint64_t
+make_descriptor(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags)
+{
+    if (limit > 0xfffff) {
+        limit >>= 12;
+        flags |= DESC_PAGES;
+    }
+
+    return (limit & 0xffff)
+        | (uint64_t)(base & 0xffffff) << 16
+        | (uint64_t)access << 40
+        | (uint64_t)(((limit >> 16) & 0x0f) | (flags & 0xf0)) << 48
+        | (uint64_t)(base >> 24) << 56;
+}
+
+static uint32_t
+descriptor_base(uint64_t descriptor)
+{
+    return ((descriptor >> 16) & 0xffffff) | (uint32_t)(descriptor >> 56) << 24;
+}
+
+static uint8_t
+descriptor_access(uint64_t descriptor)
+{
+    return descriptor >> 40;
+}
+
+static uint8_t
+descriptor_flags(uint64_t descriptor)
+{
+    return (descriptor >> 48) & 0xf0;
+}
+
+static uint32_t
+descriptor_limit(uint64_t descriptor)
+{
+    uint32_t limit = (descriptor & 0xffff) | ((descriptor >> 32) & 0xf0000);
+    if (descriptor_flags(descriptor) & DESC_PAGES) {
+        limit = (limit << 12) | 0xfff;
+    }
+    return limit;
+}
+
+static uint64_t
+rebuild(uint64_t descriptor, uint32_t base, uint32_t limit)
+{
+    // the same kind of segment, moved or resized
+    return make_descriptor(base, limit, descriptor_access(descriptor), descriptor_flags(descriptor) & ~DESC_PAGES);
+}
+
+static bool
+valid_access(uint8_t access, uint8_t flags)
+{
+    // clients get ring 3 code and data segments, never system descriptors
+    return (access & (ACC_SEGMENT | ACC_DPL3)) == (ACC_SEGMENT | ACC_DPL3) && !(flags & DESC_LONG);
+}
+
+static uint64_t*
+ldt_entry(dpmi_t* dpmi, uint16_t selector)
+{
+    // any entry in use, the host's included
+    uint32_t index = selector >> 3;
+    if (!(selector & SELECTOR_LDT) || index >= LDT_ENTRIES || !(dpmi->ldt_flags[index] & LDT_USED)) {
+        return NULL;
+    }
+    return &dpmi->ldt[index];
+}
+
+static uint64_t*
+client_entry(dpmi_t* dpmi, uint16_t selector)
+{
+    // an entry the client may change or free
+    uint64_t* entry = ldt_entry(dpmi, selector);
+    if (!entry || (dpmi->ldt_flags[selector >> 3] & (LDT_HOST | LDT_SEGMENT))) {
+        return NULL;
+    }
+    return entry;
+}
+
+static uint32_t
+segment_base(dpmi_t* dpmi, uint16_t selector)
+{
+    uint64_t* entry = ldt_entry(dpmi, selector);
+    return entry ? descriptor_base(*entry) : 0;
+}
+
+static bool
+segment_32(dpmi_t* dpmi, uint16_t selector)
+{
+    uint64_t* entry = ldt_entry(dpmi, selector);
+    return entry && (descriptor_flags(*entry) & DESC_32);
+}
+
+static uint32_t
+alloc_entries(dpmi_t* dpmi, uint32_t count)
+{
+    // first index of count consecutive free entries, or 0
+    for (uint32_t first = LDT_CLIENT; first + count <= LDT_ENTRIES; first++) {
+        uint32_t free = 0;
+        while (free < count && !(dpmi->ldt_flags[first + free] & LDT_USED)) {
+            free++;
+        }
+
+        if (free == count) {
+            for (uint32_t i = first; i < first + count; i++) {
+                dpmi->ldt_flags[i] = LDT_USED;
+                dpmi->ldt[i] = make_descriptor(0, 0, ACC_DATA, dpmi->bits32 ? DESC_32 : 0);
+            }
+            return first;
+        }
+
+        first += free;
+    }
+
+    return 0;
+}
+
+static uint16_t
+alloc_selector(dpmi_t* dpmi, uint32_t base, uint32_t limit, uint8_t access)
+{
+    uint32_t index = alloc_entries(dpmi, 1);
+    if (!index) {
+        return 0;
+    }
+
+    dpmi->ldt[index] = make_descriptor(base, limit, access, 0);
+    return SELECTOR(index);
+}
+
+static uint16_t
+segment_selector(dpmi_t* dpmi, uint16_t segment)
+{
+    // 0002h hands out one selector per real mode segment, for good
+    for (uint32_t i = LDT_CLIENT; i < LDT_ENTRIES; i++) {
+        if ((dpmi->ldt_flags[i] & LDT_SEGMENT) && descriptor_base(dpmi->ldt[i]) == (uint32_t)segment << 4) {
+            return SELECTOR(i);
+        }
+    }
+
+    uint16_t selector = alloc_selector(dpmi, (uint32_t)segment << 4, 0xffff, ACC_DATA);
+    if (selector) {
+        dpmi->ldt_flags[selector >> 3] |= LDT_SEGMENT;
+    }
+    return selector;
+}
+
+static void
+set_host_entry(dpmi_t* dpmi, uint32_t index, uint64_t descriptor)
+{
+    dpmi->ldt[index] = descriptor;
+    dpmi->ldt_flags[index] = LDT_USED | LDT_HOST;
+}
+
+static uint32_t
+offset(dpmi_t* dpmi, reg32_t reg)
+{
+    // 32 bit clients pass offsets in the full register
+    return dpmi->bits32 ? reg.dword : reg.word.lo;
+}
+
+static void
+set_offset(dpmi_t* dpmi, reg32_t* reg, uint32_t value)
+{
+    if (dpmi->bits32) {
+        reg->dword = value;
+    } else {
+        reg->word.lo = value;
+    }
+}
+
+static bool
+pm_push(dpmi_t* dpmi, regs_t* regs, uint32_t value)
+{
+    // frames are as wide as the client, the stack pointer as wide as SS
+    uint32_t size = dpmi->bits32 ? 4 : 2;
+    bool big = segment_32(dpmi, regs->ss.word.lo);
+    uint32_t esp = (big ? regs->esp.dword : regs->esp.word.lo) - size;
+    if (!big) {
+        esp &= 0xffff;
+    }
+
+    void* ptr = client_ptr(segment_base(dpmi, regs->ss.word.lo) + esp, size, true);
+    if (!ptr) {
+        return false;
+    }
+
+    if (size == 4) {
+        *(uint32_t*)ptr = value;
+    } else {
+        *(uint16_t*)ptr = value;
+    }
+
+    if (big) {
+        regs->esp.dword = esp;
+    } else {
+        regs->esp.word.lo = esp;
+    }
+    return true;
+}
+
+static bool
+pm_pop(dpmi_t* dpmi, regs_t* regs, uint32_t* value)
+{
+    uint32_t size = dpmi->bits32 ? 4 : 2;
+    bool big = segment_32(dpmi, regs->ss.word.lo);
+    uint32_t esp = big ? regs->esp.dword : regs->esp.word.lo;
+
+    void* ptr = client_ptr(segment_base(dpmi, regs->ss.word.lo) + esp, size, false);
+    if (!ptr) {
+        return false;
+    }
+
+    *value = size == 4 ? *(uint32_t*)ptr : *(uint16_t*)ptr;
+
+    esp += size;
+    if (big) {
+        regs->esp.dword = esp;
+    } else {
+        regs->esp.word.lo = esp;
+    }
+    return true;
+}
+
+static uint32_t
+virtual_flags(task_t* task)
+{
+    // flags as the client sees them, with its virtual interrupt flag
+    uint32_t flags = task->regs->eflags.dword & ~(FLAG_INTERRUPT | FLAG_VM8086);
+    return task->interrupts_enabled ? flags | FLAG_INTERRUPT : flags;
+}
+
+static bool
+is_default(dpmi_t* dpmi, uint8_t vector)
+{
+    return dpmi->vectors[vector].selector == HOST_CODE_SEL && dpmi->vectors[vector].offset == HOST_INT + vector;
+}
+
+static void
+fail(regs_t* regs, uint16_t error)
+{
+    regs->eax.word.lo = error;
+    regs->eflags.dword |= FLAG_CARRY;
+}
+
+static context_t*
+push_context(task_t* task, uint8_t kind, bool iret)
+{
+    dpmi_t* dpmi = task->dpmi;
+    if (dpmi->depth == MAX_CONTEXTS) {
+        return NULL;
+    }
+
+    context_t* context = &dpmi->contexts[dpmi->depth++];
+    copy_regs(&context->regs, task->regs);
+    context->kind = kind;
+    context->iret = iret;
+    return context;
+}
+
+static void
+host_stack(dpmi_t* dpmi, regs_t* regs)
+{
+    // handlers run on the host's stack, below any use of it further up the
+    // chain of contexts
+    uint32_t esp = PAGE_SIZE;
+
+    if (protected_mode(regs) && regs->ss.word.lo == HOST_STACK_SEL) {
+        esp = regs->esp.dword;
+    } else {
+        for (uint32_t i = dpmi->depth; i-- > 0;) {
+            const regs_t* outer = &dpmi->contexts[i].regs;
+            if (protected_mode(outer)) {
+                if (outer->ss.word.lo == HOST_STACK_SEL) {
+                    esp = outer->esp.dword;
+                }
+                break;
+            }
+        }
+    }
+
+    regs->ss.word.lo = HOST_STACK_SEL;
+    regs->esp.dword = esp;
+}
+
+static void
+to_real_mode(task_t* task)
+{
+    // reflections run on the stack the innermost real mode context left
+    // off at, or else the top of the client's private data area
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+
+    regs->eflags.dword = (regs->eflags.dword & ARITH_FLAGS) | FLAG_VM8086 | FLAG_INTERRUPT | RESERVED_FLAGS;
+    regs->ss.word.lo = dpmi->rm_stack;
+    regs->esp.dword = PRIVATE_PARAS * 16;
+
+    for (uint32_t i = dpmi->depth; i-- > 0;) {
+        const regs_t* outer = &dpmi->contexts[i].regs;
+        if (!protected_mode(outer)) {
+            regs->ss.word.lo = outer->ss.word.lo;
+            regs->esp.dword = outer->esp.word.lo;
+            break;
+        }
+    }
+
+    regs->ds16.dword = dpmi->rm_stack;
+    regs->es16.dword = dpmi->rm_stack;
+    regs->fs16.dword = 0;
+    regs->gs16.dword = 0;
+    regs->ds_ = regs->es_ = regs->fs_ = regs->gs_ = 0;
+}
+
+static void
+push_return(task_t* task, bool flags)
+{
+    // real mode returns to the host at the stub's second alias
+    regs_t* regs = task->regs;
+
+    if (flags) {
+        rm_push16(regs, virtual_flags(task));
+    }
+    rm_push16(regs, stub_segment - STUB_RETURN);
+    rm_push16(regs, stub_offset + 16 * STUB_RETURN);
+}
+
+static void
+rm_return(task_t* task);
+
+static void
+rm_int(task_t* task, uint8_t vector)
+{
+    regs_t* regs = task->regs;
+    uint16_t* ivt = rm_ptr(0, vector * 4, 4, false);
+
+    // video mode switches, reflected or simulated, are the kernel's. ones it
+    // answers itself return at once
+    if (framebuffer_int(task, vector)) {
+        rm_return(task);
+        return;
+    }
+
+    push_return(task, true);
+    regs->eip.dword = ivt[0];
+    regs->cs.word.lo = ivt[1];
+}
+
+static void
+pm_iret(task_t* task)
+{
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint32_t eip, cs, flags;
+
+    if (!pm_pop(dpmi, regs, &eip) || !pm_pop(dpmi, regs, &cs) || !pm_pop(dpmi, regs, &flags)) {
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    // results in the arithmetic flags survive
+    regs->eip.dword = eip;
+    regs->cs.word.lo = cs;
+    regs->eflags.dword = (flags & CLIENT_FLAGS & ~ARITH_FLAGS) | (regs->eflags.dword & ARITH_FLAGS) | FLAG_INTERRUPT | RESERVED_FLAGS;
+    task->interrupts_enabled = flags & FLAG_INTERRUPT;
+}
+
+static void
+finish(task_t* task, bool chained)
+{
+    if (chained) {
+        pm_iret(task);
+    }
+}
+
+static void
+release(task_t* task)
+{
+    // give back everything the client had
+    dpmi_t* dpmi = task->dpmi;
+
+    if (dpmi->environment) {
+        *(uint16_t*)rm_ptr(dpmi->psp, PSP_ENVIRONMENT, 2, true) = dpmi->environment;
+    }
+
+    for (uint32_t i = 0; i < MAX_BLOCKS; i++) {
+        for (uint32_t page = 0; page < dpmi->blocks[i].size; page += PAGE_SIZE) {
+            phys_free(page_unmap((void*)(dpmi->blocks[i].base + page)));
+        }
+    }
+    dpmi_unmap_lfb(task);
+
+    phys_free(page_unmap((void*)HOST_CODE));
+    phys_free(page_unmap((void*)HOST_STACK));
+
+    task->dpmi = NULL;
+    dpmi_load(task);
+    virt_free(dpmi->ldt);
+    virt_free(dpmi);
+}
+
+static void
+terminate(task_t* task, uint16_t exit)
+{
+    // back to real mode for good, where DOS ends the client's process
+    regs_t* regs = task->regs;
+    uint16_t psp = task->dpmi->psp;
+    uint16_t stack = task->dpmi->rm_stack;
+
+    print("dpmi: client terminated\n");
+    release(task);
+
+    regs->eflags.dword = (regs->eflags.dword & ARITH_FLAGS) | FLAG_VM8086 | FLAG_INTERRUPT | RESERVED_FLAGS;
+    regs->ss.word.lo = stack;
+    regs->esp.dword = PRIVATE_PARAS * 16;
+    regs->ds16.dword = psp;
+    regs->es16.dword = psp;
+    regs->fs16.dword = 0;
+    regs->gs16.dword = 0;
+    regs->ds_ = regs->es_ = regs->fs_ = regs->gs_ = 0;
+    regs->eax.word.lo = exit;
+
+    task->interrupts_enabled = true;
+    rm_int(task, 0x21);
+}
+
+static void
+enter(task_t* task)
+{
+    // the client far called the stub's entry alias
+    regs_t* regs = task->regs;
+    uint16_t ip = rm_pop16(regs);
+    uint16_t cs = rm_pop16(regs);
+    regs->eip.dword = ip;
+    regs->cs.word.lo = cs;
+
+    // one client per guest, and we need to know its PSP
+    uint16_t psp = console_psp();
+    if (task->dpmi || !psp) {
+        regs->eflags.dword |= FLAG_CARRY;
+        return;
+    }
+
+    print("dpmi: client entering protected mode\n");
+
+    // freed pages come back as they were left, likely by the last client
+    dpmi_t* dpmi = virt_alloc();
+    zero_page(dpmi);
+    dpmi->ldt = virt_alloc();
+    zero_page(dpmi->ldt);
+    dpmi->bits32 = regs->eax.word.lo & 1;
+    dpmi->psp = psp;
+    dpmi->rm_stack = regs->es16.word.lo;
+    dpmi->heap_next = HEAP_BASE;
+
+    // the host code page is read only to the client, so it's filled in
+    // before it's mapped
+    phys_t host_code = phys_alloc();
+    bool crit = critical_begin();
+    uint8_t* hlts = temp_map(host_code);
+    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+        hlts[i] = OP_HLT;
+    }
+    temp_unmap();
+    critical_end(crit);
+
+    page_map((void*)HOST_CODE, host_code, PAGE_USER);
+    page_map((void*)HOST_STACK, phys_alloc(), PAGE_RW | PAGE_USER);
+
+    set_host_entry(dpmi, LDT_HOST_CODE, make_descriptor(HOST_CODE, PAGE_SIZE - 1, ACC_CODE_RX, DESC_32));
+    set_host_entry(dpmi, LDT_HOST_STACK, make_descriptor(HOST_STACK, PAGE_SIZE - 1, ACC_DATA, DESC_32));
+    set_host_entry(dpmi, LDT_CALLBACK_STACK, make_descriptor(0, 0xffff, ACC_DATA, 0));
+
+    for (uint32_t i = 0; i < 256; i++) {
+        dpmi->vectors[i].selector = HOST_CODE_SEL;
+        dpmi->vectors[i].offset = HOST_INT + i;
+    }
+
+    for (uint32_t i = 0; i < EXCEPTIONS; i++) {
+        dpmi->exceptions[i].selector = HOST_CODE_SEL;
+        dpmi->exceptions[i].offset = HOST_EXCEPTION + i;
+    }
+
+    task->dpmi = dpmi;
+    dpmi_load(task);
+
+    // the client continues at its return address, with selectors for the
+    // segments it had in real mode, ES for its PSP and the environment
+    // pointer in the PSP made a selector too
+    uint16_t code = alloc_selector(dpmi, (uint32_t)cs << 4, 0xffff, ACC_CODE_RX);
+    uint16_t data = segment_selector(dpmi, regs->ds16.word.lo);
+    uint16_t stack = segment_selector(dpmi, regs->ss.word.lo);
+    uint16_t psp_selector = alloc_selector(dpmi, (uint32_t)psp << 4, 0xff, ACC_DATA);
+
+    uint16_t* environment = rm_ptr(psp, PSP_ENVIRONMENT, 2, true);
+    if (*environment) {
+        uint16_t paragraphs = *(uint16_t*)rm_ptr(*environment - 1, MCB_SIZE, 2, false);
+        dpmi->environment = *environment;
+        *environment = alloc_selector(dpmi, (uint32_t)*environment << 4, paragraphs * 16 - 1, ACC_DATA);
+    }
+
+    regs->eflags.dword &= ~(FLAG_VM8086 | FLAG_CARRY);
+    regs->cs.word.lo = code;
+    regs->ss.word.lo = stack;
+    regs->esp.dword = regs->esp.word.lo;
+    regs->ds_ = data;
+    regs->es_ = psp_selector;
+    regs->fs_ = 0;
+    regs->gs_ = 0;
+}
+
+static void
+pm_int(task_t* task, uint8_t vector);
+
+static void
+rm_return(task_t* task)
+{
+    // real mode finished something we reflected. the context on top says
+    // what, and what to go back to
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+
+    if (!dpmi->depth || dpmi->contexts[dpmi->depth - 1].kind == CONTEXT_CALLBACK) {
+        print("dpmi: stray return from real mode\n");
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    context_t* context = &dpmi->contexts[--dpmi->depth];
+    regs_t rm;
+    copy_regs(&rm, regs);
+    copy_regs(regs, &context->regs);
+
+    uint16_t flags = (rm.eflags.word.lo & ~FLAG_INTERRUPT) | (task->interrupts_enabled ? FLAG_INTERRUPT : 0);
+
+    switch (context->kind) {
+    case CONTEXT_INT:
+        regs->eax = rm.eax;
+        regs->ebx = rm.ebx;
+        regs->ecx = rm.ecx;
+        regs->edx = rm.edx;
+        regs->esi = rm.esi;
+        regs->edi = rm.edi;
+        regs->ebp = rm.ebp;
+        regs->eflags.dword = (regs->eflags.dword & ~ARITH_FLAGS) | (rm.eflags.dword & ARITH_FLAGS);
+        break;
+    case CONTEXT_IRQ:
+        break;
+    case CONTEXT_CALL: {
+        rm_call_t* call = client_ptr(context->call, sizeof(rm_call_t), true);
+        if (call) {
+            call->edi = rm.edi.dword;
+            call->esi = rm.esi.dword;
+            call->ebp = rm.ebp.dword;
+            call->ebx = rm.ebx.dword;
+            call->edx = rm.edx.dword;
+            call->ecx = rm.ecx.dword;
+            call->eax = rm.eax.dword;
+            call->flags = flags;
+            call->es = rm.es16.word.lo;
+            call->ds = rm.ds16.word.lo;
+            call->fs = rm.fs16.word.lo;
+            call->gs = rm.gs16.word.lo;
+        }
+        regs->eflags.dword &= ~FLAG_CARRY;
+        break;
+    }
+    case CONTEXT_DOS: {
+        // AX still holds the DPMI function
+        uint16_t function = regs->eax.word.lo;
+        if (rm.eflags.dword & FLAG_CARRY) {
+            fail(regs, rm.eax.word.lo);
+            regs->ebx.word.lo = rm.ebx.word.lo;
+            break;
+        }
+
+        regs->eflags.dword &= ~FLAG_CARRY;
+        uint64_t* entry = client_entry(dpmi, regs->edx.word.lo);
+
+        if (function == 0x0100) {
+            uint16_t selector = alloc_selector(dpmi, (uint32_t)rm.eax.word.lo << 4, regs->ebx.word.lo * 16 - 1, ACC_DATA);
+            if (!selector) {
+                fail(regs, ERROR_DESCRIPTOR_UNAVAILABLE);
+                break;
+            }
+            regs->eax.word.lo = rm.eax.word.lo;
+            regs->edx.word.lo = selector;
+        } else if (function == 0x0101 && entry) {
+            *entry = 0;
+            dpmi->ldt_flags[regs->edx.word.lo >> 3] = 0;
+        } else if (function == 0x0102 && entry) {
+            *entry = rebuild(*entry, descriptor_base(*entry), regs->ebx.word.lo * 16 - 1);
+        }
+        break;
+    }
+    }
+
+    if (context->iret) {
+        pm_iret(task);
+    }
+}
+
+static void
+dos_memory(task_t* task, bool chained, uint8_t function)
+{
+    // DOS memory blocks, allocated by DOS itself in real mode
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint16_t segment = 0;
+
+    if (function != DOS_ALLOCATE) {
+        uint64_t* entry = client_entry(dpmi, regs->edx.word.lo);
+        if (!entry) {
+            fail(regs, ERROR_INVALID_SELECTOR);
+            finish(task, chained);
+            return;
+        }
+        segment = descriptor_base(*entry) >> 4;
+    }
+
+    uint16_t paragraphs = regs->ebx.word.lo;
+    if (!push_context(task, CONTEXT_DOS, chained)) {
+        fail(regs, ERROR_UNSUPPORTED);
+        finish(task, chained);
+        return;
+    }
+
+    to_real_mode(task);
+    regs->eax.byte.hi = function;
+    regs->ebx.word.lo = paragraphs;
+    regs->es16.dword = segment;
+    rm_int(task, 0x21);
+}
+
+static void
+rm_call(task_t* task, bool chained)
+{
+    // 0300h simulates an interrupt, 0301h a far call, 0302h a call to an
+    // interrupt handler. CX words of the client's stack go along
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint16_t function = regs->eax.word.lo;
+    uint8_t vector = regs->ebx.byte.lo;
+    uint16_t words = regs->ecx.word.lo;
+
+    uint32_t linear = segment_base(dpmi, regs->es_) + offset(dpmi, regs->edi);
+    rm_call_t* call = client_ptr(linear, sizeof(rm_call_t), true);
+
+    uint32_t esp = segment_32(dpmi, regs->ss.word.lo) ? regs->esp.dword : regs->esp.word.lo;
+    uint16_t* args = client_ptr(segment_base(dpmi, regs->ss.word.lo) + esp, words * 2, false);
+
+    if (!call || !args) {
+        fail(regs, ERROR_INVALID_VALUE);
+        finish(task, chained);
+        return;
+    }
+
+    context_t* context = push_context(task, CONTEXT_CALL, chained);
+    if (!context) {
+        fail(regs, ERROR_UNSUPPORTED);
+        finish(task, chained);
+        return;
+    }
+    context->call = linear;
+
+    to_real_mode(task);
+    regs->edi.dword = call->edi;
+    regs->esi.dword = call->esi;
+    regs->ebp.dword = call->ebp;
+    regs->ebx.dword = call->ebx;
+    regs->edx.dword = call->edx;
+    regs->ecx.dword = call->ecx;
+    regs->eax.dword = call->eax;
+    regs->eflags.dword = (call->flags & ARITH_FLAGS) | FLAG_VM8086 | FLAG_INTERRUPT | RESERVED_FLAGS;
+    regs->es16.dword = call->es;
+    regs->ds16.dword = call->ds;
+    regs->fs16.dword = call->fs;
+    regs->gs16.dword = call->gs;
+    if (call->ss || call->sp) {
+        regs->ss.word.lo = call->ss;
+        regs->esp.dword = call->sp;
+    }
+
+    for (uint32_t i = words; i-- > 0;) {
+        rm_push16(regs, args[i]);
+    }
+
+    if (function == 0x0300) {
+        rm_int(task, vector);
+        return;
+    }
+
+    push_return(task, function == 0x0302);
+    regs->eip.dword = call->ip;
+    regs->cs.word.lo = call->cs;
+}
+
+static void
+callback(task_t* task, uint32_t index)
+{
+    // real mode called one of the client's callbacks. its protected mode
+    // handler gets the real mode registers in the client's call structure
+    // and the real mode stack through DS:(E)SI
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+
+    if (index >= MAX_CALLBACKS || !dpmi->callbacks[index].used) {
+        // freed since: return to the caller as if it had been called
+        regs->eip.dword = rm_pop16(regs);
+        regs->cs.word.lo = rm_pop16(regs);
+        return;
+    }
+
+    far_t handler = dpmi->callbacks[index].handler;
+    far_t call_ptr = dpmi->callbacks[index].call;
+    rm_call_t* call = client_ptr(segment_base(dpmi, call_ptr.selector) + call_ptr.offset, sizeof(rm_call_t), true);
+    uint32_t flags = virtual_flags(task);
+
+    if (!call || !push_context(task, CONTEXT_CALLBACK, false)) {
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    call->edi = regs->edi.dword;
+    call->esi = regs->esi.dword;
+    call->ebp = regs->ebp.dword;
+    call->ebx = regs->ebx.dword;
+    call->edx = regs->edx.dword;
+    call->ecx = regs->ecx.dword;
+    call->eax = regs->eax.dword;
+    call->flags = flags;
+    call->es = regs->es16.word.lo;
+    call->ds = regs->ds16.word.lo;
+    call->fs = regs->fs16.word.lo;
+    call->gs = regs->gs16.word.lo;
+    call->ip = regs->eip.word.lo - 2;
+    call->cs = regs->cs.word.lo;
+    call->sp = regs->esp.word.lo;
+    call->ss = regs->ss.word.lo;
+
+    uint64_t* stack = &dpmi->ldt[LDT_CALLBACK_STACK];
+    *stack = rebuild(*stack, (uint32_t)regs->ss.word.lo << 4, 0xffff);
+
+    regs->eflags.dword = (regs->eflags.dword & ARITH_FLAGS) | FLAG_INTERRUPT | RESERVED_FLAGS;
+    regs->esi.dword = regs->esp.word.lo;
+    regs->edi.dword = call_ptr.offset;
+    regs->ds_ = CALLBACK_STACK_SEL;
+    regs->es_ = call_ptr.selector;
+    regs->fs_ = 0;
+    regs->gs_ = 0;
+    host_stack(dpmi, regs);
+
+    if (!pm_push(dpmi, regs, flags) || !pm_push(dpmi, regs, HOST_CODE_SEL) || !pm_push(dpmi, regs, HOST_CALLBACK_RETURN)) {
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    regs->cs.word.lo = handler.selector;
+    regs->eip.dword = handler.offset;
+    task->interrupts_enabled = false;
+}
+
+static void
+callback_return(task_t* task)
+{
+    // the callback's handler returned with ES:(E)DI pointing to the real
+    // mode registers to continue with
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    rm_call_t* call = client_ptr(segment_base(dpmi, regs->es_) + offset(dpmi, regs->edi), sizeof(rm_call_t), false);
+
+    if (!call || !dpmi->depth || dpmi->contexts[dpmi->depth - 1].kind != CONTEXT_CALLBACK) {
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    copy_regs(regs, &dpmi->contexts[--dpmi->depth].regs);
+    regs->edi.dword = call->edi;
+    regs->esi.dword = call->esi;
+    regs->ebp.dword = call->ebp;
+    regs->ebx.dword = call->ebx;
+    regs->edx.dword = call->edx;
+    regs->ecx.dword = call->ecx;
+    regs->eax.dword = call->eax;
+    regs->eflags.dword = (call->flags & CLIENT_FLAGS) | FLAG_VM8086 | FLAG_INTERRUPT | RESERVED_FLAGS;
+    regs->es16.dword = call->es;
+    regs->ds16.dword = call->ds;
+    regs->fs16.dword = call->fs;
+    regs->gs16.dword = call->gs;
+    regs->eip.dword = call->ip;
+    regs->cs.word.lo = call->cs;
+    regs->esp.dword = call->sp;
+    regs->ss.word.lo = call->ss;
+    task->interrupts_enabled = call->flags & FLAG_INTERRUPT;
+    vm86_pending(task);
+}
+
+static void
+map_pages(uint32_t linear, uint32_t size)
+{
+    for (uint32_t page = 0; page < size; page += PAGE_SIZE) {
+        page_map((void*)(linear + page), phys_alloc(), PAGE_RW | PAGE_USER);
+    }
+}
+
+static void
+memory(task_t* task)
+{
+    // 0501h-0503h. blocks are committed up front and never paged out. each
+    // gets fresh linear space with an unmapped page after it, even when
+    // resized, so stale pointers into a moved block fault
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint16_t function = regs->eax.word.lo;
+    uint32_t size = (uint32_t)regs->ebx.word.lo << 16 | regs->ecx.word.lo;
+    uint32_t handle = (uint32_t)regs->esi.word.lo << 16 | regs->edi.word.lo;
+    uint32_t slot = handle - 1;
+
+    if (function == 0x0501) {
+        for (slot = 0; slot < MAX_BLOCKS && dpmi->blocks[slot].size; slot++) {
+        }
+        if (slot == MAX_BLOCKS) {
+            fail(regs, ERROR_HANDLE_UNAVAILABLE);
+            return;
+        }
+    } else if (slot >= MAX_BLOCKS || !dpmi->blocks[slot].size) {
+        fail(regs, ERROR_INVALID_HANDLE);
+        return;
+    }
+
+    uint32_t base = dpmi->blocks[slot].base;
+    uint32_t old_size = dpmi->blocks[slot].size;
+
+    if (function == 0x0502) {
+        for (uint32_t page = 0; page < old_size; page += PAGE_SIZE) {
+            phys_free(page_unmap((void*)(base + page)));
+        }
+        dpmi->blocks[slot].size = 0;
+        dpmi->memory_used -= old_size;
+        return;
+    }
+
+    if (!size) {
+        fail(regs, ERROR_INVALID_VALUE);
+        return;
+    }
+
+    if (size > MAX_MEMORY || (size = (size + PAGE_SIZE - 1) & PAGE_MASK) > MAX_MEMORY - dpmi->memory_used + old_size) {
+        fail(regs, ERROR_PHYSICAL_UNAVAILABLE);
+        return;
+    }
+
+    uint32_t linear = dpmi->heap_next;
+    if (size > HEAP_END - PAGE_SIZE - linear) {
+        fail(regs, ERROR_LINEAR_UNAVAILABLE);
+        return;
+    }
+
+    // a resized block takes its pages along
+    uint32_t kept = old_size < size ? old_size : size;
+    for (uint32_t page = 0; page < kept; page += PAGE_SIZE) {
+        page_map((void*)(linear + page), page_unmap((void*)(base + page)), PAGE_RW | PAGE_USER);
+    }
+    for (uint32_t page = kept; page < old_size; page += PAGE_SIZE) {
+        phys_free(page_unmap((void*)(base + page)));
+    }
+    map_pages(linear + kept, size - kept);
+
+    dpmi->heap_next = linear + size + PAGE_SIZE;
+    dpmi->memory_used += size - old_size;
+    dpmi->blocks[slot].base = linear;
+    dpmi->blocks[slot].size = size;
+
+    regs->ebx.word.lo = linear >> 16;
+    regs->ecx.word.lo = linear;
+    regs->esi.word.lo = (slot + 1) >> 16;
+    regs->edi.word.lo = slot + 1;
+}
+
+static void
+physical(task_t* task)
+{
+    // 0800h. the only physical memory a client can map is the frame buffer,
+    // once its guest has set a linear VBE mode. the whole of it is mapped on
+    // the first request, and later ones share that
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint32_t address = (uint32_t)regs->ebx.word.lo << 16 | regs->ecx.word.lo;
+    uint32_t size = (uint32_t)regs->esi.word.lo << 16 | regs->edi.word.lo;
+
+    phys_t base;
+    uint32_t limit;
+    if (!framebuffer_lfb(task, &base, &limit) || address < base || address - base >= limit || size > limit - (address - base)) {
+        fail(regs, ERROR_PHYSICAL_UNAVAILABLE);
+        return;
+    }
+
+    if (!dpmi->lfb) {
+        if (limit > HEAP_END - PAGE_SIZE - dpmi->heap_next) {
+            fail(regs, ERROR_LINEAR_UNAVAILABLE);
+            return;
+        }
+
+        page_map_range((void*)dpmi->heap_next, base, limit / PAGE_SIZE, PAGE_RW | PAGE_USER);
+        dpmi->lfb = dpmi->heap_next;
+        dpmi->lfb_size = limit;
+        dpmi->heap_next += limit + PAGE_SIZE;
+    }
+
+    uint32_t linear = dpmi->lfb + (address - base);
+    regs->ebx.word.lo = linear >> 16;
+    regs->ecx.word.lo = linear;
+}
+
+static void
+descriptors(task_t* task)
+{
+    // 0000h-000Ch
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint16_t selector = regs->ebx.word.lo;
+    uint64_t* entry = client_entry(dpmi, selector);
+    uint32_t value = (uint32_t)regs->ecx.word.lo << 16 | regs->edx.word.lo;
+
+    switch (regs->eax.word.lo) {
+    case 0x0000: {
+        uint32_t index = regs->ecx.word.lo ? alloc_entries(dpmi, regs->ecx.word.lo) : 0;
+        if (!index) {
+            fail(regs, ERROR_DESCRIPTOR_UNAVAILABLE);
+            return;
+        }
+        regs->eax.word.lo = SELECTOR(index);
+        return;
+    }
+    case 0x0001:
+        if (!entry) {
+            break;
+        }
+        *entry = 0;
+        dpmi->ldt_flags[selector >> 3] = 0;
+        return;
+    case 0x0002: {
+        uint16_t segment = segment_selector(dpmi, selector);
+        if (!segment) {
+            fail(regs, ERROR_DESCRIPTOR_UNAVAILABLE);
+            return;
+        }
+        regs->eax.word.lo = segment;
+        return;
+    }
+    case 0x0003:
+        regs->eax.word.lo = 8;
+        return;
+    case 0x0004:
+    case 0x0005:
+        // lock and unlock selector, nothing is ever paged out
+        return;
+    case 0x0006:
+        entry = ldt_entry(dpmi, selector);
+        if (!entry) {
+            break;
+        }
+        regs->ecx.word.lo = descriptor_base(*entry) >> 16;
+        regs->edx.word.lo = descriptor_base(*entry);
+        return;
+    case 0x0007:
+        if (!entry) {
+            break;
+        }
+        *entry = rebuild(*entry, value, descriptor_limit(*entry));
+        return;
+    case 0x0008:
+        if (!entry) {
+            break;
+        }
+        if (value > 0xfffff && (value & 0xfff) != 0xfff) {
+            fail(regs, ERROR_INVALID_VALUE);
+            return;
+        }
+        *entry = rebuild(*entry, descriptor_base(*entry), value);
+        return;
+    case 0x0009: {
+        // CL is the access byte, the high nibble of CH the flags. the raw
+        // limit stays, so changing granularity rescales it
+        uint8_t access = regs->ecx.byte.lo;
+        uint8_t flags = regs->ecx.byte.hi & 0xf0;
+        if (!entry) {
+            break;
+        }
+        if (!valid_access(access, flags)) {
+            fail(regs, ERROR_INVALID_VALUE);
+            return;
+        }
+        *entry = (*entry & ~(0xffULL << 40 | 0xf0ULL << 48)) | (uint64_t)access << 40 | (uint64_t)flags << 48;
+        return;
+    }
+    case 0x000a: {
+        entry = ldt_entry(dpmi, selector);
+        if (!entry || !(descriptor_access(*entry) & ACC_CODE)) {
+            break;
+        }
+        uint32_t index = alloc_entries(dpmi, 1);
+        if (!index) {
+            fail(regs, ERROR_DESCRIPTOR_UNAVAILABLE);
+            return;
+        }
+        dpmi->ldt[index] = (*entry & ~(0xffULL << 40)) | (uint64_t)ACC_DATA << 40;
+        regs->eax.word.lo = SELECTOR(index);
+        return;
+    }
+    case 0x000b:
+    case 0x000c: {
+        bool set = regs->eax.word.lo == 0x000c;
+        uint64_t* buffer = client_ptr(segment_base(dpmi, regs->es_) + offset(dpmi, regs->edi), 8, !set);
+        if (!set) {
+            entry = ldt_entry(dpmi, selector);
+        }
+        if (!entry) {
+            break;
+        }
+        if (!buffer || (set && !valid_access(descriptor_access(*buffer), descriptor_flags(*buffer)))) {
+            fail(regs, ERROR_INVALID_VALUE);
+            return;
+        }
+        if (set) {
+            *entry = *buffer;
+        } else {
+            *buffer = *entry;
+        }
+        return;
+    }
+    default:
+        fail(regs, ERROR_UNSUPPORTED);
+        return;
+    }
+
+    fail(regs, ERROR_INVALID_SELECTOR);
+}
+
+static void
+callbacks(task_t* task)
+{
+    // 0303h and 0304h. callback n is the stub's alias STUB_CALLBACK + n
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+
+    if (regs->eax.word.lo == 0x0303) {
+        for (uint32_t i = 0; i < MAX_CALLBACKS; i++) {
+            if (dpmi->callbacks[i].used) {
+                continue;
+            }
+            dpmi->callbacks[i].used = true;
+            dpmi->callbacks[i].handler.selector = regs->ds_;
+            dpmi->callbacks[i].handler.offset = offset(dpmi, regs->esi);
+            dpmi->callbacks[i].call.selector = regs->es_;
+            dpmi->callbacks[i].call.offset = offset(dpmi, regs->edi);
+            regs->ecx.word.lo = stub_segment - STUB_CALLBACK - i;
+            regs->edx.word.lo = stub_offset + 16 * (STUB_CALLBACK + i);
+            return;
+        }
+        fail(regs, ERROR_CALLBACK_UNAVAILABLE);
+        return;
+    }
+
+    uint32_t index = (uint16_t)(stub_segment - STUB_CALLBACK - regs->ecx.word.lo);
+    if (index >= MAX_CALLBACKS || regs->edx.word.lo != stub_offset + 16 * (STUB_CALLBACK + index) || !dpmi->callbacks[index].used) {
+        fail(regs, ERROR_INVALID_CALLBACK);
+        return;
+    }
+    dpmi->callbacks[index].used = false;
+}
+
+static void
+services(task_t* task, bool chained)
+{
+    // INT 31h. functions which need real mode finish when it returns,
+    // everything else right here
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint16_t function = regs->eax.word.lo;
+    uint8_t vector = regs->ebx.byte.lo;
+    regs->eflags.dword &= ~FLAG_CARRY;
+
+    switch (function) {
+    case 0x0000:
+    case 0x0001:
+    case 0x0002:
+    case 0x0003:
+    case 0x0004:
+    case 0x0005:
+    case 0x0006:
+    case 0x0007:
+    case 0x0008:
+    case 0x0009:
+    case 0x000a:
+    case 0x000b:
+    case 0x000c:
+        descriptors(task);
+        break;
+    case 0x0100:
+        dos_memory(task, chained, DOS_ALLOCATE);
+        return;
+    case 0x0101:
+        dos_memory(task, chained, DOS_FREE);
+        return;
+    case 0x0102:
+        dos_memory(task, chained, DOS_RESIZE);
+        return;
+    case 0x0200: {
+        uint16_t* ivt = rm_ptr(0, vector * 4, 4, false);
+        regs->ecx.word.lo = ivt[1];
+        regs->edx.word.lo = ivt[0];
+        break;
+    }
+    case 0x0201: {
+        uint16_t* ivt = rm_ptr(0, vector * 4, 4, true);
+        ivt[0] = regs->edx.word.lo;
+        ivt[1] = regs->ecx.word.lo;
+        break;
+    }
+    case 0x0202:
+    case 0x0204: {
+        far_t* handler = function == 0x0202 ? &dpmi->exceptions[vector] : &dpmi->vectors[vector];
+        if (function == 0x0202 && vector >= EXCEPTIONS) {
+            fail(regs, ERROR_INVALID_VALUE);
+            break;
+        }
+        regs->ecx.word.lo = handler->selector;
+        set_offset(dpmi, &regs->edx, handler->offset);
+        break;
+    }
+    case 0x0203:
+    case 0x0205: {
+        far_t* handler = function == 0x0203 ? &dpmi->exceptions[vector] : &dpmi->vectors[vector];
+        if (function == 0x0203 && vector >= EXCEPTIONS) {
+            fail(regs, ERROR_INVALID_VALUE);
+            break;
+        }
+        handler->selector = regs->ecx.word.lo;
+        handler->offset = offset(dpmi, regs->edx);
+        break;
+    }
+    case 0x0300:
+    case 0x0301:
+    case 0x0302:
+        rm_call(task, chained);
+        return;
+    case 0x0303:
+    case 0x0304:
+        callbacks(task);
+        break;
+    case 0x0400: {
+        // version 0.90, 32 bit host which doesn't switch modes with V86
+        uint32_t family = (cpuid(CPUID_FEATURES).eax >> 8) & 0xf;
+        regs->eax.word.lo = 0x005a;
+        regs->ebx.word.lo = 0x0001;
+        regs->ecx.byte.lo = family < 3 ? 3 : family > 6 ? 6 : family;
+        regs->edx.word.lo = MASTER_PIC_BASE << 8 | SLAVE_PIC_BASE;
+        break;
+    }
+    case 0x0500: {
+        uint32_t* info = client_ptr(segment_base(dpmi, regs->es_) + offset(dpmi, regs->edi), 0x30, true);
+        if (!info) {
+            fail(regs, ERROR_INVALID_VALUE);
+            break;
+        }
+        uint32_t free = MAX_MEMORY - dpmi->memory_used;
+        info[0] = free;
+        info[1] = free / PAGE_SIZE;
+        info[2] = free / PAGE_SIZE;
+        for (uint32_t i = 3; i < 0x30 / 4; i++) {
+            info[i] = 0xffffffff;
+        }
+        break;
+    }
+    case 0x0501:
+    case 0x0502:
+    case 0x0503:
+        memory(task);
+        break;
+    case 0x0600:
+    case 0x0601:
+    case 0x0602:
+    case 0x0603:
+    case 0x0702:
+    case 0x0703:
+        // locking and paging hints, nothing is ever paged out
+        break;
+    case 0x0604:
+        regs->ebx.word.lo = 0;
+        regs->ecx.word.lo = PAGE_SIZE;
+        break;
+    case 0x0800:
+        physical(task);
+        break;
+    case 0x0900:
+    case 0x0901:
+    case 0x0902:
+        // AL returns the previous state
+        regs->eax.byte.lo = task->interrupts_enabled;
+        if (function != 0x0902) {
+            task->interrupts_enabled = function == 0x0901;
+        }
+        break;
+    default:
+        // 0305h/0306h raw mode switches and 0A00h vendor extensions aren't
+        // provided
+        fail(regs, ERROR_UNSUPPORTED);
+        break;
+    }
+
+    finish(task, chained);
+
+    if (task->dpmi && function == 0x0901) {
+        vm86_pending(task);
+    }
+}
+
+static void
+default_int(task_t* task, uint8_t vector, bool chained)
+{
+    // the host's own handler for an interrupt, reached directly or by a
+    // client handler chaining to it
+    regs_t* regs = task->regs;
+
+    if (vector == 0x31) {
+        services(task, chained);
+        return;
+    }
+
+    if (vector == 0x2f && regs->eax.word.lo == 0x1686) {
+        // running in protected mode
+        regs->eax.word.lo = 0;
+        finish(task, chained);
+        return;
+    }
+
+    if (vector == 0x21 && regs->eax.byte.hi == 0x4c) {
+        terminate(task, regs->eax.word.lo);
+        return;
+    }
+
+    if (!push_context(task, CONTEXT_INT, chained)) {
+        print("dpmi: reflections nested too deeply\n");
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    to_real_mode(task);
+    rm_int(task, vector);
+}
+
+static void
+pm_int(task_t* task, uint8_t vector)
+{
+    // INT n in protected mode goes straight to the client's handler, as the
+    // CPU would have
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+
+    if (is_default(dpmi, vector)) {
+        default_int(task, vector, false);
+        return;
+    }
+
+    if (!pm_push(dpmi, regs, virtual_flags(task)) || !pm_push(dpmi, regs, regs->cs.word.lo) || !pm_push(dpmi, regs, regs->eip.dword)) {
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    regs->cs.word.lo = dpmi->vectors[vector].selector;
+    regs->eip.dword = dpmi->vectors[vector].offset;
+    regs->eflags.dword &= ~FLAG_TRAP;
+}
+
+void
+dpmi_irq(task_t* task, uint8_t vector)
+{
+    // the client's handler runs with interrupts disabled on the host stack,
+    // and returns to the host to restore the interrupted state
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint32_t flags = virtual_flags(task);
+
+    if (!push_context(task, CONTEXT_IRQ, false)) {
+        print("dpmi: IRQ lost, contexts nested too deeply\n");
+        return;
+    }
+
+    if (is_default(dpmi, vector)) {
+        to_real_mode(task);
+        rm_int(task, vector);
+        return;
+    }
+
+    host_stack(dpmi, regs);
+    if (!pm_push(dpmi, regs, flags) || !pm_push(dpmi, regs, HOST_CODE_SEL) || !pm_push(dpmi, regs, HOST_IRQ_RETURN)) {
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    regs->cs.word.lo = dpmi->vectors[vector].selector;
+    regs->eip.dword = dpmi->vectors[vector].offset;
+    regs->eflags.dword &= ~FLAG_TRAP;
+    task->interrupts_enabled = false;
+}
+
+void
+dpmi_exception(task_t* task, uint8_t vector)
+{
+    // the client's exception handler gets a DPMI 0.9 frame on the host
+    // stack. without one, the client is terminated
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+
+    if (vector >= EXCEPTIONS || (dpmi->exceptions[vector].selector == HOST_CODE_SEL && dpmi->exceptions[vector].offset == HOST_EXCEPTION + (uint32_t)vector)) {
+        print("dpmi: exception ");
+        print8(vector);
+        print(" at ");
+        print16(regs->cs.word.lo);
+        print(":");
+        print32(regs->eip.dword);
+        print("\n");
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    uint32_t frame[] = {
+        regs->ss.word.lo, regs->esp.dword, virtual_flags(task), regs->cs.word.lo, regs->eip.dword,
+        regs->error_code, HOST_CODE_SEL, HOST_EXCEPTION_RETURN,
+    };
+
+    host_stack(dpmi, regs);
+    for (uint32_t i = 0; i < sizeof(frame) / sizeof(frame[0]); i++) {
+        if (!pm_push(dpmi, regs, frame[i])) {
+            terminate(task, EXIT_FAILURE);
+            return;
+        }
+    }
+
+    regs->cs.word.lo = dpmi->exceptions[vector].selector;
+    regs->eip.dword = dpmi->exceptions[vector].offset;
+    regs->eflags.dword &= ~FLAG_TRAP;
+    task->interrupts_enabled = false;
+}
+
+static void
+exception_return(task_t* task)
+{
+    // the handler's far return popped our return address. the rest of the
+    // frame, possibly changed by the handler, is what to resume
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint32_t error, eip, cs, flags, esp, ss;
+
+    if (!pm_pop(dpmi, regs, &error) || !pm_pop(dpmi, regs, &eip) || !pm_pop(dpmi, regs, &cs)
+            || !pm_pop(dpmi, regs, &flags) || !pm_pop(dpmi, regs, &esp) || !pm_pop(dpmi, regs, &ss)) {
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    regs->eip.dword = eip;
+    regs->cs.word.lo = cs;
+    regs->eflags.dword = (flags & CLIENT_FLAGS) | FLAG_INTERRUPT | RESERVED_FLAGS;
+    regs->esp.dword = esp;
+    regs->ss.word.lo = ss;
+    task->interrupts_enabled = flags & FLAG_INTERRUPT;
+    vm86_pending(task);
+}
+
+static void
+host_trap(task_t* task, uint32_t offset)
+{
+    // the client reached a HLT in the host code page
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+
+    if (offset < HOST_EXCEPTION) {
+        default_int(task, offset, true);
+        return;
+    }
+
+    if (offset < HOST_EXCEPTION + EXCEPTIONS) {
+        // chained to the default exception handler
+        print("dpmi: unhandled exception ");
+        print8(offset - HOST_EXCEPTION);
+        print("\n");
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    switch (offset) {
+    case HOST_IRQ_RETURN:
+        if (!dpmi->depth || dpmi->contexts[dpmi->depth - 1].kind != CONTEXT_IRQ) {
+            break;
+        }
+        copy_regs(regs, &dpmi->contexts[--dpmi->depth].regs);
+        task->interrupts_enabled = true;
+        vm86_pending(task);
+        return;
+    case HOST_EXCEPTION_RETURN:
+        exception_return(task);
+        return;
+    case HOST_CALLBACK_RETURN:
+        callback_return(task);
+        return;
+    }
+
+    print("dpmi: bad jump into host code\n");
+    terminate(task, EXIT_FAILURE);
+}
+
+static bool
+fetch(dpmi_t* dpmi, regs_t* regs, uint32_t index, uint8_t* byte)
+{
+    uint32_t eip = regs->eip.dword + index;
+    if (!segment_32(dpmi, regs->cs.word.lo)) {
+        eip &= 0xffff;
+    }
+
+    uint8_t* ptr = client_ptr(segment_base(dpmi, regs->cs.word.lo) + eip, 1, false);
+    if (!ptr) {
+        return false;
+    }
+
+    *byte = *ptr;
+    return true;
+}
+
+static void
+advance(dpmi_t* dpmi, regs_t* regs, uint32_t length)
+{
+    if (segment_32(dpmi, regs->cs.word.lo)) {
+        regs->eip.dword += length;
+    } else {
+        regs->eip.word.lo += length;
+    }
+}
+
+static bool
+emulate(task_t* task)
+{
+    // CLI, STI, HLT and port I/O trap at IOPL 0, and RDTSC while replay.c
+    // has it trap. anything else that raises #GP is the client's own fault
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    bool operand32 = segment_32(dpmi, regs->cs.word.lo);
+    uint32_t length = 0;
+    uint8_t opcode;
+
+    for (;;) {
+        if (length == 4 || !fetch(dpmi, regs, length++, &opcode)) {
+            return false;
+        }
+        if (opcode == 0x66) {
+            operand32 = !operand32;
+            continue;
+        }
+        if (opcode == 0x26 || opcode == 0x2e || opcode == 0x36 || opcode == 0x3e || opcode == 0x64 || opcode == 0x65) {
+            continue;
+        }
+        break;
+    }
+
+    uint8_t size = !(opcode & 1) ? 1 : operand32 ? 4 : 2;
+    uint32_t value = size == 4 ? regs->eax.dword : size == 2 ? regs->eax.word.lo : regs->eax.byte.lo;
+    uint8_t port = 0;
+
+    switch (opcode) {
+    case 0xfa:
+        task->interrupts_enabled = false;
+        break;
+    case 0xfb:
+        task->interrupts_enabled = true;
+        break;
+    case 0xf4:
+        // with interrupts disabled, nothing would ever wake it
+        if (!task->interrupts_enabled) {
+            return false;
+        }
+        task->halted = true;
+        break;
+    case 0xe4:
+    case 0xe5:
+    case 0xe6:
+    case 0xe7:
+        if (!fetch(dpmi, regs, length++, &port)) {
+            return false;
+        }
+        // fall through
+    case 0xec:
+    case 0xed:
+    case 0xee:
+    case 0xef: {
+        uint16_t target = opcode >= 0xec ? regs->edx.word.lo : port;
+        if (opcode & 2) {
+            guest_out(task, target, size, value);
+            break;
+        }
+
+        value = guest_in(task, target, size);
+        if (size == 4) {
+            regs->eax.dword = value;
+        } else if (size == 2) {
+            regs->eax.word.lo = value;
+        } else {
+            regs->eax.byte.lo = value;
+        }
+        break;
+    }
+    case 0x0f: {
+        uint8_t second;
+        if (!fetch(dpmi, regs, length++, &second) || second != 0x31) {
+            return false;
+        }
+
+        uint64_t tsc = guest_rdtsc(task);
+        regs->eax.dword = tsc;
+        regs->edx.dword = tsc >> 32;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    advance(dpmi, regs, length);
+
+    if (opcode == 0xfb) {
+        vm86_pending(task);
+    }
+    return true;
+}
+
+void
+dpmi_gpf(task_t* task)
+{
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+    uint32_t error = regs->error_code;
+
+    if (error & 2) {
+        // INT n found a ring 0 gate in the IDT
+        uint8_t opcode;
+        if (fetch(dpmi, regs, 0, &opcode) && (opcode == 0xcd || opcode == 0xcc || opcode == 0xce)) {
+            advance(dpmi, regs, opcode == 0xcd ? 2 : 1);
+            pm_int(task, error >> 3);
+            return;
+        }
+    }
+
+    if (!error && regs->cs.word.lo == HOST_CODE_SEL) {
+        host_trap(task, regs->eip.dword);
+        return;
+    }
+
+    if (!error && emulate(task)) {
+        return;
+    }
+
+    dpmi_exception(task, GENERAL_PROTECTION_FAULT);
+}
+
+static bool
+loadable(dpmi_t* dpmi, uint16_t selector, bool code, bool stack)
+{
+    uint64_t* entry = ldt_entry(dpmi, selector);
+    if (!entry || (selector & 3) != 3) {
+        return false;
+    }
+
+    uint8_t access = descriptor_access(*entry);
+    if (!(access & ACC_PRESENT) || !(access & ACC_SEGMENT)) {
+        return false;
+    }
+
+    if (code) {
+        return (access & ACC_CODE) && ((access & ACC_CONFORMING) || (access & ACC_DPL3) == ACC_DPL3);
+    }
+
+    if (stack) {
+        return !(access & ACC_CODE) && (access & ACC_RW) && (access & ACC_DPL3) == ACC_DPL3;
+    }
+
+    // data segment registers, which the kernel loads at CPL 0
+    return (access & ACC_DPL3) == ACC_DPL3 && (!(access & ACC_CODE) || (access & ACC_RW));
+}
+
+void
+dpmi_check(task_t* task)
+{
+    dpmi_t* dpmi = task->dpmi;
+    regs_t* regs = task->regs;
+
+    if (!dpmi || !protected_mode(regs)) {
+        return;
+    }
+
+    if (!loadable(dpmi, regs->cs.word.lo, true, false) || regs->eip.dword > descriptor_limit(*ldt_entry(dpmi, regs->cs.word.lo))
+            || !loadable(dpmi, regs->ss.word.lo, false, true)) {
+        print("dpmi: client left with a bad CS:EIP or SS\n");
+        terminate(task, EXIT_FAILURE);
+        return;
+    }
+
+    // the CPU would fault when loading these, zero them instead
+    uint32_t* segments[] = { &regs->ds_, &regs->es_, &regs->fs_, &regs->gs_ };
+    for (uint32_t i = 0; i < sizeof(segments) / sizeof(segments[0]); i++) {
+        *segments[i] &= 0xffff;
+        if ((*segments[i] & ~3) && !loadable(dpmi, *segments[i], false, false)) {
+            *segments[i] = 0;
+        }
+    }
+
+    regs->eflags.dword = (regs->eflags.dword & CLIENT_FLAGS) | FLAG_INTERRUPT | RESERVED_FLAGS;
+}
+
+void
+dpmi_load(task_t* task)
+{
+    // every CPU's GDT has an entry for the LDT of the client running on it
+#ifdef HOSTED
+    // the host harness has no descriptor tables to load
+    (void)task;
+#else
+    struct {
+        uint16_t limit;
+        uint32_t base;
+    } __attribute__((packed)) gdtr;
+
+    if (!task->dpmi) {
+        __asm__ volatile("lldt %w0" :: "r"(0));
+        return;
+    }
+
+    __asm__ volatile("sgdt %0" : "=m"(gdtr));
+    uint64_t* gdt = (uint64_t*)gdtr.base;
+    gdt[SEG_LDT / 8] = make_descriptor((uint32_t)task->dpmi->ldt, LDT_ENTRIES * 8 - 1, LDT_DESCRIPTOR, 0);
+    __asm__ volatile("lldt %w0" :: "r"(SEG_LDT));
+#endif
+}
+
+void
+dpmi_stub(uint16_t segment, uint16_t offset)
+{
+    // every alias must be addressable
+    if (segment < STUB_CALLBACK + MAX_CALLBACKS || offset > 0xffff - 16 * (STUB_CALLBACK + MAX_CALLBACKS)) {
+        print("dpmi: stub can't be aliased, no DPMI host\n");
+        return;
+    }
+
+    print("dpmi: entry stub at ");
+    print16(segment);
+    print(":");
+    print16(offset);
+    print("\n");
+
+    stub_segment = segment;
+    stub_offset = offset;
+    stub_linear = ((uint32_t)segment << 4) + offset;
+}
+
+void
+dpmi_unmap_lfb(task_t* task)
+{
+    dpmi_t* dpmi = task->dpmi;
+    if (!dpmi || !dpmi->lfb) {
+        return;
+    }
+
+    // the linear range isn't reused, so stale pointers into it fault
+    page_unmap_range((void*)dpmi->lfb, dpmi->lfb_size / PAGE_SIZE);
+    dpmi->lfb = 0;
+}
+
+uint32_t
+dpmi_lfb(task_t* task)
+{
+    dpmi_t* dpmi = task->dpmi;
+    return dpmi ? dpmi->lfb : 0;
+}
+
+bool
+dpmi_int(task_t* task, uint8_t vector)
+{
+    regs_t* regs = task->regs;
+
+    if (!stub_linear) {
+        return false;
+    }
+
+    if (vector == 0x2f && regs->eax.word.lo == 0x1687) {
+        // DPMI installation check. the entry point is the stub itself
+        uint32_t family = (cpuid(CPUID_FEATURES).eax >> 8) & 0xf;
+        regs->eax.word.lo = 0;
+        regs->ebx.word.lo = 0x0001;
+        regs->ecx.byte.lo = family < 3 ? 3 : family > 6 ? 6 : family;
+        regs->edx.word.lo = 0x005a;
+        regs->esi.word.lo = PRIVATE_PARAS;
+        regs->es16.word.lo = stub_segment - STUB_ENTRY;
+        regs->edi.word.lo = stub_offset + 16 * STUB_ENTRY;
+        return true;
+    }
+
+    if (vector == 0x21 && regs->eax.byte.hi == 0x4c && task->dpmi && console_psp() == task->dpmi->psp) {
+        // the client exited from real mode, in a callback or the like
+        print("dpmi: client exited from real mode\n");
+        release(task);
+        return false;
+    }
+
+    uint32_t linear = ((uint32_t)regs->cs.word.lo << 4) + regs->eip.word.lo - 2;
+    if (vector != HYPERCALL_VECTOR || linear != stub_linear) {
+        return false;
+    }
+
+    uint16_t alias = stub_segment - regs->cs.word.lo;
+
+    if (alias == STUB_ENTRY) {
+        enter(task);
+    } else if (!task->dpmi) {
+        // a return after the client is gone: nothing left to return to
+    } else if (alias == STUB_RETURN) {
+        rm_return(task);
+    } else {
+        callback(task, alias - STUB_CALLBACK);
+    }
+    return true;
+}
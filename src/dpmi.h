@@ -0,0 +1,51 @@
+#ifndef DPMI_H
+#define DPMI_H
+
+#include "types.h"
+
+struct task;
+
+// DPMI 0.9 host. clients run natively in ring 3 protected mode, with their
+// descriptors in a per-guest LDT, and drop back into the guest's VM8086 mode
+// for DOS and the BIOS. real mode reaches the host through the loader's
+// resident stub, protected mode through the faults its code raises at IOPL 0
+
+// the loader's stub, which real mode calls to enter the host
+void
+dpmi_stub(uint16_t segment, uint16_t offset);
+
+// handle a software interrupt from VM8086 mode, returns false to reflect it
+// to the guest
+bool
+dpmi_int(struct task* task, uint8_t vector);
+
+// deliver a hardware interrupt to a client in protected mode
+void
+dpmi_irq(struct task* task, uint8_t vector);
+
+void
+dpmi_gpf(struct task* task);
+
+// any other exception raised by a client
+void
+dpmi_exception(struct task* task, uint8_t vector);
+
+// vet the frame before returning to a client. iret faults in the kernel if
+// the client has broken the selectors it is about to load
+void
+dpmi_check(struct task* task);
+
+// unmap the frame buffer from the task's client, once the guest has given
+// it up
+void
+dpmi_unmap_lfb(struct task* task);
+
+// where the task's client has the frame buffer mapped, 0 if it hasn't
+uint32_t
+dpmi_lfb(struct task* task);
+
+// load the task's LDT on this CPU
+void
+dpmi_load(struct task* task);
+
+#endif
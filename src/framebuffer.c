@@ -1,14 +1,64 @@
 #include "framebuffer.h"
+#include "dpmi.h"
+#include "ioport.h"
 #include "mm.h"
 #include "debug.h"
+#include "smp.h"
+#include "stats.h"
+#include "task.h"
+#include "timer.h"
 
 #define VRAM_SIZE (8 * 1024 * 1024) // 8 MiB
 
+// a new display start takes effect at the next vertical retrace. with three
+// buffers the one being drawn was last shown two flips ago, so it's off
+// screen without having to wait for the retrace
+#define MAX_BUFFERS 3
+
+#define VBE_MODE_INFO       0x4f01
+#define VBE_SET_MODE        0x4f02
+#define VBE_WINDOW          0x4f05
+#define VBE_SET_DISPLAY_START 0x4f07
+#define VBE_SUCCESS         0x004f
+#define VBE_FAILED          0x014f
+
+// BX of VBE_SET_MODE
+#define VBE_MODE_NUMBER     0x01ff
+#define VBE_MODE_LINEAR     (1 << 14)
+#define VBE_MODE_NO_CLEAR   (1 << 15)
+
+#define VBE_MODE_INFO_SIZE  256
+
+// the guest's banked window, A in the mode information. its position and
+// granularity are 64 KiB, so a bank is 16 pages of the frame buffer
+#define WINDOW              0xa0000
+#define WINDOW_SIZE         0x10000
+#define WINDOW_SEGMENT      (WINDOW >> 4)
+#define WINDOW_ATTRIBUTES   0x07 // supported, readable, writable
+#define WINDOW_BANKS        (VRAM_SIZE / WINDOW_SIZE)
+#define WINDOW_PAGES        (WINDOW_SIZE / PAGE_SIZE)
+
+// VGA mode 13h, a byte per pixel from A0000
+#define MODE_13H            0x13
+#define MODE_13H_WIDTH      320
+#define MODE_13H_HEIGHT     200
+#define MODE_13H_SIZE       (MODE_13H_WIDTH * MODE_13H_HEIGHT)
+
+#define DAC_READ_INDEX      0x3c7
+#define DAC_WRITE_INDEX     0x3c8
+#define DAC_DATA            0x3c9
+
+#define CONVERT_INTERVAL    20000 // usecs
+
 static uint16_t*
 vga_fb;
 
 static uint16_t* const
-user_fb = (void*)0xb8000;
+user_fb = GUEST_PTR(0xb8000);
+
+// text buffer of the guest currently being displayed
+static const uint16_t*
+shown_fb = user_fb;
 
 static uint8_t
 vram[VRAM_SIZE] __attribute__ ((aligned(PAGE_SIZE), section(".unmapped")));
@@ -22,15 +72,371 @@ framebuffer_is_reset = false;
 static uint16_t
 cursor_pos;
 
+// the kernel's mode as the BIOS described it
+static vbe_mode_info_t
+vbe_mode;
+
+// the loader's resident window function, as a real mode far pointer
+static uint32_t
+window_function;
+
+// bank the owner's window is on
+static uint32_t
+window_bank;
+
 static struct {
     phys_t physbase;
     uint32_t width;
     uint32_t height;
     uint32_t pitch;
+    uint32_t buffers;
 } vga_info;
 
+// the VBE protected mode set display start, copied out of the BIOS. NULL if
+// there's none we can use, and the one buffer is drawn while visible
+static void*
+set_display_start;
+
+// buffer on screen, and the one being drawn. the others are about to be on
+// screen or were until recently
+static uint32_t
+front_buffer, back_buffer;
+
+// guest which set the kernel's mode for itself and draws straight into the
+// frame buffer, from its start. NULL if the console has it
+static task_t*
+lfb_owner;
+
+// the owner is in mode 13h instead, drawing into RAM behind its A0000 window
+// which the kernel converts into the frame buffer
+static bool
+emulated;
+
+static phys_t
+vga_ram[WINDOW_PAGES];
+
+// the owner's picture while another guest is shown, with the owner's window
+// and its client's linear mapping moved here so the console can be drawn.
+// only the owner's own CPU can move them, until then the console waits
+static uint8_t*
+shadow[VRAM_SIZE / PAGE_SIZE];
+
+static bool
+shadowed;
+
+// the whole picture has to be converted again, as the palette changed, or
+// cleared first too, as the console was drawn over it
+static bool
+repalette, repaint;
+
+// the card's DAC as guests programmed it, as the card never sees them do it.
+// entries are 6 bits of red, green and blue
+static struct {
+    uint8_t entries[256][3];
+    uint8_t write_index, write_component;
+    uint8_t read_index, read_component;
+} dac;
+
+static timer_t
+convert_timers[MAX_CPUS];
+
+static void
+pmi_init(const vbe_pmi_t* pmi)
+{
+    if (!pmi || pmi->length < 8 || pmi->length > VBE_PMI_MAX || pmi->set_display_start >= pmi->length) {
+        return;
+    }
+
+    // the code can only be called as is if it needs no memory mapped
+    // registers. the I/O list is ports up to 0xffff, then memory ranges up
+    // to another 0xffff
+    const uint8_t* table = (const uint8_t*)&pmi->set_window;
+    if (pmi->io_list) {
+        uint32_t at = pmi->io_list;
+        while (at + 2 <= pmi->length && *(const uint16_t*)(table + at) != 0xffff) {
+            at += 2;
+        }
+        at += 2;
+
+        if (at + 2 > pmi->length || *(const uint16_t*)(table + at) != 0xffff) {
+            print("framebuffer: VBE interface uses memory mapped I/O\n");
+            return;
+        }
+    }
+
+    uint8_t* code = virt_alloc();
+    for (uint32_t i = 0; i < pmi->length; i++) {
+        code[i] = table[i];
+    }
+    set_display_start = code + pmi->set_display_start;
+}
+
+static void
+display(uint32_t buffer)
+{
+    // the protected mode entry takes the display start as an address in
+    // DX:CX, in units of 4 bytes. BL=00h sets it without waiting for the
+    // retrace
+    uint32_t address = buffer * vga_info.pitch * vga_info.height / 4;
+    uint32_t eax = VBE_SET_DISPLAY_START;
+    uint32_t ebx = 0;
+    uint32_t ecx = address & 0xffff;
+    uint32_t edx = address >> 16;
+
+    __asm__ volatile("call *%4"
+        : "+a"(eax), "+b"(ebx), "+c"(ecx), "+d"(edx)
+        : "m"(set_display_start)
+        : "esi", "edi", "memory", "cc");
+
+    front_buffer = buffer;
+}
+
+static void
+flip()
+{
+    // show the buffer just drawn
+    display(back_buffer);
+    back_buffer = (back_buffer + 1) % vga_info.buffers;
+}
+
+static bool
+suspended()
+{
+    const task_t* owner = __atomic_load_n(&lfb_owner, __ATOMIC_ACQUIRE);
+    return owner && (owner->text == shown_fb || (!emulated && !__atomic_load_n(&shadowed, __ATOMIC_ACQUIRE)));
+}
+
+static uint32_t
+shadow_pages()
+{
+    // as much as the console draws into
+    return (vga_info.buffers * vga_info.pitch * vga_info.height + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static phys_t
+backing(uint32_t offset, bool in_shadow)
+{
+    if (in_shadow && offset / PAGE_SIZE < shadow_pages()) {
+        return virt_to_phys(shadow[offset / PAGE_SIZE]);
+    }
+    return vga_info.physbase + offset;
+}
+
+static uint8_t*
+picture(uint32_t offset)
+{
+    // the owner's picture at offset, wherever it is
+    if (shadowed) {
+        return shadow[offset / PAGE_SIZE] + offset % PAGE_SIZE;
+    }
+    return vram + offset;
+}
+
+static void
+map_window(bool in_shadow)
+{
+    for (uint32_t i = 0; i < WINDOW_SIZE / PAGE_SIZE; i++) {
+        lomem_map(WINDOW + i * PAGE_SIZE, backing(window_bank * WINDOW_SIZE + i * PAGE_SIZE, in_shadow), 1);
+    }
+}
+
+static void
+map_owner(task_t* task, bool in_shadow)
+{
+    // in the owner's address space, which has to be the current one
+    map_window(in_shadow);
+
+    uint32_t lfb = dpmi_lfb(task);
+    for (uint32_t i = 0; lfb && i < shadow_pages(); i++) {
+        page_map((void*)(lfb + i * PAGE_SIZE), backing(i * PAGE_SIZE, in_shadow), PAGE_RW | PAGE_USER);
+    }
+}
+
+static void
+free_shadow()
+{
+    for (uint32_t i = 0; i < VRAM_SIZE / PAGE_SIZE && shadow[i]; i++) {
+        virt_free(shadow[i]);
+        shadow[i] = NULL;
+    }
+    __atomic_store_n(&shadowed, false, __ATOMIC_RELEASE);
+}
+
+static void
+release(task_t* task)
+{
+    // the guest set some other mode, the console can have the frame buffer
+    // back from the next refresh
+    task_t* owner = task;
+    if (!__atomic_compare_exchange_n(&lfb_owner, &owner, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    print("framebuffer: console has the frame buffer\n");
+    emulated = false;
+    dpmi_unmap_lfb(task);
+    lomem_map(WINDOW, WINDOW, WINDOW_PAGES);
+    free_shadow();
+}
+
+static void
+emulate(task_t* task)
+{
+    // mode 13h is drawn by the kernel, if nobody else has the frame buffer.
+    // the BIOS still sets the mode, clearing the RAM and loading the DAC
+    task_t* owner = NULL;
+    if (!__atomic_compare_exchange_n(&lfb_owner, &owner, task, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    print("framebuffer: guest in mode 13h\n");
+    emulated = true;
+
+    for (uint32_t i = 0; i < WINDOW_PAGES; i++) {
+        if (!vga_ram[i]) {
+            vga_ram[i] = phys_alloc();
+        }
+        lomem_map(WINDOW + i * PAGE_SIZE, vga_ram[i], 1);
+    }
+
+    __atomic_store_n(&repaint, true, __ATOMIC_RELEASE);
+}
+
+static void
+vga_mode(task_t* task, uint8_t mode)
+{
+    release(task);
+    if (mode == MODE_13H) {
+        emulate(task);
+    }
+}
+
+static void
+convert_page(uint32_t page, uint8_t (*palette)[3])
+{
+    // each pixel as a square of scale pixels a side, the picture centred
+    uint32_t scale_x = vga_info.width / MODE_13H_WIDTH;
+    uint32_t scale_y = vga_info.height / MODE_13H_HEIGHT;
+    uint32_t scale = scale_x < scale_y ? scale_x : scale_y;
+    uint32_t left = (vga_info.width - MODE_13H_WIDTH * scale) / 2;
+    uint32_t top = (vga_info.height - MODE_13H_HEIGHT * scale) / 2;
+
+    const uint8_t* pixels = GUEST_PTR(WINDOW + page * PAGE_SIZE);
+    uint32_t start = page * PAGE_SIZE;
+    uint32_t end = start + PAGE_SIZE < MODE_13H_SIZE ? start + PAGE_SIZE : MODE_13H_SIZE;
+
+    for (uint32_t offset = start; offset < end; offset++) {
+        const uint8_t* color = palette[pixels[offset - start]];
+        uint32_t x = left + offset % MODE_13H_WIDTH * scale;
+        uint32_t y = top + offset / MODE_13H_WIDTH * scale;
+
+        for (uint32_t sy = 0; sy < scale; sy++) {
+            uint8_t* out = vram + (y + sy) * vga_info.pitch + x * 3;
+            for (uint32_t sx = 0; sx < scale; sx++) {
+                out[sx * 3 + 0] = color[2];
+                out[sx * 3 + 1] = color[1];
+                out[sx * 3 + 2] = color[0];
+            }
+        }
+    }
+}
+
+static void
+convert_timer(timer_t* timer)
+{
+    framebuffer_follow();
+    framebuffer_convert();
+    timer_arm(timer, CONVERT_INTERVAL);
+}
+
+static void
+mode_info(task_t* task)
+{
+    // the BIOS's own, with window A at A0000 on the frame buffer, switched
+    // by the kernel however the guest asks
+    regs_t* regs = task->regs;
+    uint32_t addr = ((uint32_t)regs->es16.word.lo << 4) + regs->edi.word.lo;
+    if (!user_access(addr, VBE_MODE_INFO_SIZE, true)) {
+        regs->eax.word.lo = VBE_FAILED;
+        return;
+    }
+
+    vbe_mode_info_t info = vbe_mode;
+    info.win_a = WINDOW_ATTRIBUTES;
+    info.win_b = 0;
+    info.granularity = WINDOW_SIZE / 1024;
+    info.winsize = WINDOW_SIZE / 1024;
+    info.segment_a = WINDOW_SEGMENT;
+    info.segment_b = 0;
+    info.unused_real_fct_ptr = window_function;
+
+    uint8_t* out = GUEST_PTR(addr);
+    for (uint32_t i = 0; i < VBE_MODE_INFO_SIZE; i++) {
+        out[i] = i < sizeof(info) ? ((const uint8_t*)&info)[i] : 0;
+    }
+    regs->eax.word.lo = VBE_SUCCESS;
+}
+
+static void
+window(task_t* task)
+{
+    // BH=00h sets window BL to position DX, BH=01h returns it in DX. only
+    // window A exists
+    regs_t* regs = task->regs;
+    if (regs->ebx.byte.lo != 0 || regs->ebx.byte.hi > 0x01) {
+        regs->eax.word.lo = VBE_FAILED;
+        return;
+    }
+
+    if (regs->ebx.byte.hi == 0x01) {
+        regs->edx.word.lo = window_bank;
+        regs->eax.word.lo = VBE_SUCCESS;
+        return;
+    }
+
+    if (regs->edx.word.lo >= WINDOW_BANKS) {
+        regs->eax.word.lo = VBE_FAILED;
+        return;
+    }
+
+    window_bank = regs->edx.word.lo;
+    map_window(shadowed);
+    regs->eax.word.lo = VBE_SUCCESS;
+}
+
+static bool
+vga_in(task_t* task, uint16_t port, uint8_t size, uint32_t* value)
+{
+    // the DAC reads back what it was given. the rest comes from the card
+    if (!task->has_reset || port != DAC_DATA || size != 1) {
+        return false;
+    }
+
+    *value = dac.entries[dac.read_index][dac.read_component];
+    if (++dac.read_component == 3) {
+        dac.read_component = 0;
+        dac.read_index++;
+    }
+    return true;
+}
+
+static bool
+vga_out(task_t* task, uint16_t port, uint8_t size, uint32_t value)
+{
+    // the loader's output goes to the real card. wider writes are the
+    // bytes to consecutive ports, eg. index and data at once
+    if (!task->has_reset) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < size; i++) {
+        framebuffer_outb(port + i, value >> (i * 8));
+    }
+    return true;
+}
+
 void
-framebuffer_init(const vbe_mode_info_t* mode_info, const uint8_t* font)
+framebuffer_init(const vbe_mode_info_t* mode_info, const uint8_t* font, const vbe_pmi_t* pmi)
 {
     // obtain a unique virtual page by allocating one and then immediately
     // freeing the underlying physical page:
@@ -43,6 +449,9 @@ framebuffer_init(const vbe_mode_info_t* mode_info, const uint8_t* font)
     // remap 0xb8000 to fresh page in user space:
     page_map(user_fb, phys_alloc(), PAGE_RW | PAGE_USER);
 
+    static const io_handler_t vga_handler = { vga_in, vga_out };
+    io_register(IO_VGA_LO, IO_VGA_HI, &vga_handler);
+
     // copy existing framebuffer to new one:
     for (uint32_t i = 0; i < 80 * 25; i++) {
         user_fb[i] = vga_fb[i];
@@ -57,10 +466,113 @@ framebuffer_init(const vbe_mode_info_t* mode_info, const uint8_t* font)
     }
 
     // copy mode info
+    vbe_mode = *mode_info;
     vga_info.physbase = mode_info->physbase;
     vga_info.width = mode_info->x_res;
     vga_info.height = mode_info->y_res;
     vga_info.pitch = mode_info->pitch;
+
+    // draw off screen and flip when the BIOS lets us, in as many buffers as
+    // fit both the mode and the VRAM window
+    pmi_init(pmi);
+    vga_info.buffers = 1;
+    if (set_display_start) {
+        uint32_t fit = VRAM_SIZE / (vga_info.pitch * vga_info.height);
+        vga_info.buffers = mode_info->image_pages + 1;
+        if (vga_info.buffers > fit) {
+            vga_info.buffers = fit;
+        }
+        if (vga_info.buffers > MAX_BUFFERS) {
+            vga_info.buffers = MAX_BUFFERS;
+        }
+    }
+
+    print("framebuffer: ");
+    print8(vga_info.buffers);
+    print(" buffer(s)\n");
+}
+
+bool
+framebuffer_int(task_t* task, uint8_t vector)
+{
+    // the loader sets the kernel's mode through here before reset
+    regs_t* regs = task->regs;
+    if (vector != 0x10 || !task->has_reset) {
+        return false;
+    }
+
+    if (regs->eax.byte.hi == 0x00) {
+        // a VGA mode, which the BIOS sets as before
+        vga_mode(task, regs->eax.byte.lo & 0x7f);
+        return false;
+    }
+
+    if (regs->eax.word.lo == VBE_MODE_INFO && (regs->ecx.word.lo & VBE_MODE_NUMBER) == VBE_MODE) {
+        mode_info(task);
+        return true;
+    }
+
+    if (regs->eax.word.lo == VBE_WINDOW) {
+        // anyone else's goes to the BIOS as before
+        if (__atomic_load_n(&lfb_owner, __ATOMIC_ACQUIRE) != task || emulated) {
+            return false;
+        }
+        window(task);
+        return true;
+    }
+
+    if (regs->eax.word.lo != VBE_SET_MODE) {
+        return false;
+    }
+
+    uint16_t mode = regs->ebx.word.lo & VBE_MODE_NUMBER;
+    if (mode < 0x100) {
+        vga_mode(task, mode);
+        return false;
+    }
+
+    // the card stays in the kernel's mode, so that's the only one a guest
+    // can have, banked or linear. one guest at a time
+    task_t* owner = NULL;
+    if (mode != VBE_MODE || (!__atomic_compare_exchange_n(&lfb_owner, &owner, task, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && owner != task)) {
+        regs->eax.word.lo = VBE_FAILED;
+        return true;
+    }
+
+    print("framebuffer: guest has the frame buffer\n");
+
+    if (!(regs->ebx.word.lo & VBE_MODE_NO_CLEAR)) {
+        for (uint32_t i = 0; i < vga_info.pitch * vga_info.height; i++) {
+            *picture(i) = 0;
+        }
+    }
+
+    window_bank = 0;
+    map_window(shadowed);
+
+    framebuffer_refresh();
+    regs->eax.word.lo = VBE_SUCCESS;
+    return true;
+}
+
+void
+framebuffer_window(uint16_t segment, uint16_t offset)
+{
+    window_function = (uint32_t)segment << 16 | offset;
+}
+
+bool
+framebuffer_lfb(task_t* task, phys_t* base, uint32_t* size)
+{
+    // a client mapping it while its guest isn't shown would get the frame
+    // buffer rather than the shadow
+    if (__atomic_load_n(&lfb_owner, __ATOMIC_ACQUIRE) != task || emulated || __atomic_load_n(&shadowed, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    *base = vga_info.physbase;
+    *size = VRAM_SIZE;
+    return true;
 }
 
 void
@@ -91,25 +603,131 @@ framebuffer_outb(uint16_t port, uint8_t value)
             print16(cursor_pos);
             print("\n");
             break;
+        case DAC_READ_INDEX:
+            dac.read_index = value;
+            dac.read_component = 0;
+            break;
+        case DAC_WRITE_INDEX:
+            dac.write_index = value;
+            dac.write_component = 0;
+            break;
+        case DAC_DATA:
+            dac.entries[dac.write_index][dac.write_component] = value & 0x3f;
+            if (++dac.write_component == 3) {
+                dac.write_component = 0;
+                dac.write_index++;
+                __atomic_store_n(&repalette, true, __ATOMIC_RELEASE);
+            }
+            break;
         // ignore other VGA I/O ports
     }
 }
 
+void
+framebuffer_init_cpu()
+{
+    if (!timer_available()) {
+        return;
+    }
+
+    timer_t* timer = &convert_timers[this_cpu()->index];
+    timer->callback = convert_timer;
+    timer_arm(timer, CONVERT_INTERVAL);
+}
+
+void
+framebuffer_convert()
+{
+    // the owner's dirty bits are in its own page tables, so it's up to its
+    // own CPU while it's the task there. only the pages it wrote since are
+    // converted, unless the whole picture has to be
+    task_t* task = current_task;
+    if (!task || task != __atomic_load_n(&lfb_owner, __ATOMIC_ACQUIRE) || !emulated || !suspended()) {
+        return;
+    }
+
+    uint32_t dirty = lomem_dirty(WINDOW, WINDOW_PAGES);
+
+    if (__atomic_exchange_n(&repaint, false, __ATOMIC_ACQ_REL)) {
+        for (uint32_t i = 0; i < vga_info.pitch * vga_info.height; i++) {
+            vram[i] = 0;
+        }
+        __atomic_store_n(&repalette, true, __ATOMIC_RELEASE);
+    }
+
+    if (__atomic_exchange_n(&repalette, false, __ATOMIC_ACQ_REL)) {
+        dirty = (1 << WINDOW_PAGES) - 1;
+    }
+
+    // 6 bits per component in the DAC, 8 in the frame buffer
+    static uint8_t palette[256][3];
+    for (uint32_t i = 0; dirty && i < 256; i++) {
+        for (uint32_t c = 0; c < 3; c++) {
+            palette[i][c] = dac.entries[i][c] << 2 | dac.entries[i][c] >> 4;
+        }
+    }
+
+    for (uint32_t page = 0; page < WINDOW_PAGES; page++) {
+        if (dirty & (1 << page)) {
+            convert_page(page, palette);
+        }
+    }
+}
+
+void
+framebuffer_follow()
+{
+    // the owner's mappings are in its own page tables too, so it's up to its
+    // own CPU to move them once the focus has
+    task_t* task = current_task;
+    if (!task || task != __atomic_load_n(&lfb_owner, __ATOMIC_ACQUIRE) || emulated) {
+        return;
+    }
+
+    bool shown = task->text == shown_fb;
+    if (shown != __atomic_load_n(&shadowed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    uint32_t count = shadow_pages();
+    if (!shown) {
+        print("framebuffer: owner moved to its shadow\n");
+        for (uint32_t i = 0; i < count; i++) {
+            shadow[i] = virt_alloc();
+        }
+        for (uint32_t i = 0; i < count * PAGE_SIZE; i++) {
+            shadow[i / PAGE_SIZE][i % PAGE_SIZE] = vram[i];
+        }
+        map_owner(task, true);
+        __atomic_store_n(&shadowed, true, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // the console drew over the frame buffer, the owner's picture goes back
+    print("framebuffer: owner back on the frame buffer\n");
+    for (uint32_t i = 0; i < count * PAGE_SIZE; i++) {
+        vram[i] = shadow[i / PAGE_SIZE][i % PAGE_SIZE];
+    }
+    map_owner(task, false);
+    free_shadow();
+}
+
 void
 framebuffer_reset()
 {
     print("framebuffer_reset\n");
 
     // map vram to VRAM in phys memory
-    for (uint32_t offset = 0; offset < VRAM_SIZE; offset += PAGE_SIZE) {
-        page_map(vram + offset, vga_info.physbase + offset, PAGE_RW);
-    }
-
-    for (uint32_t y = 0; y < vga_info.height; y++) {
-        for (uint32_t x = 0; x < vga_info.width; x++) {
-            vram[y * vga_info.pitch + x * 3 + 0] = (y * 256) / vga_info.height;
-            vram[y * vga_info.pitch + x * 3 + 1] = 0;
-            vram[y * vga_info.pitch + x * 3 + 2] = (x * 256) / vga_info.width;
+    page_map_range(vram, vga_info.physbase, VRAM_SIZE / PAGE_SIZE, PAGE_RW);
+
+    for (uint32_t i = 0; i < vga_info.buffers; i++) {
+        uint8_t* buffer = vram + i * vga_info.pitch * vga_info.height;
+        for (uint32_t y = 0; y < vga_info.height; y++) {
+            for (uint32_t x = 0; x < vga_info.width; x++) {
+                buffer[y * vga_info.pitch + x * 3 + 0] = (y * 256) / vga_info.height;
+                buffer[y * vga_info.pitch + x * 3 + 1] = 0;
+                buffer[y * vga_info.pitch + x * 3 + 2] = (x * 256) / vga_info.width;
+            }
         }
     }
 
@@ -118,6 +736,14 @@ framebuffer_reset()
     framebuffer_is_reset = true;
 }
 
+void
+framebuffer_show(const uint16_t* text)
+{
+    shown_fb = text;
+    __atomic_store_n(&repaint, true, __ATOMIC_RELEASE);
+    framebuffer_refresh();
+}
+
 void
 framebuffer_refresh()
 {
@@ -150,14 +776,25 @@ framebuffer_refresh()
         return;
     }
 
+    // a guest shown drawing for itself is left to it, with its first buffer
+    // on screen
+    if (suspended()) {
+        if (vga_info.buffers > 1 && front_buffer != 0) {
+            display(0);
+            back_buffer = 1;
+        }
+        return;
+    }
+
     uint32_t console_w = 80 * 8;
     uint32_t console_h = 26 * 16;
     uint32_t console_x = (vga_info.width - console_w) / 2;
     uint32_t console_y = (vga_info.height - console_h) / 2;
 
-    uint32_t tsc_lo;
-    uint32_t tsc_hi;
-    __asm__("rdtsc" : "=eax"(tsc_lo), "=edx"(tsc_hi));
+    uint16_t status[80];
+    stats_status(status, 80);
+
+    uint8_t* buffer = vram + back_buffer * vga_info.pitch * vga_info.height;
 
     for (uint32_t cy = 0; cy < 26; cy++) {
         for (uint32_t cx = 0; cx < 80; cx++) {
@@ -166,23 +803,9 @@ framebuffer_refresh()
             uint16_t c_attr;
 
             if (cy < 25) {
-                c_attr = user_fb[pos];
+                c_attr = shown_fb[pos];
             } else {
-                static const char hexmap[] = "0123456789abcdef";
-                static const uint16_t attr = 0x8f00;
-                if (cx == 0) {
-                    c_attr = '[' | attr;
-                } else if (cx >= 1 && cx < 5) {
-                    uint8_t dig = tsc_hi >> (28 - (cx - 1) * 4);
-                    c_attr = hexmap[dig & 0xf] | attr;
-                } else if (cx >= 5 && cx < 9) {
-                    uint8_t dig = tsc_lo >> (28 - (cx - 5) * 4);
-                    c_attr = hexmap[dig & 0xf] | attr;
-                } else if (cx == 9) {
-                    c_attr = ']' | attr;
-                } else {
-                    c_attr = ' ' | attr;
-                }
+                c_attr = status[cx];
             }
 
             uint8_t char_ = c_attr & 0xff;
@@ -204,11 +827,15 @@ framebuffer_refresh()
                     struct rgb color = colors[pix_set ? (attr & 0x0f) : ((attr >> 4) & 0x0f)];
 
                     uint32_t base = (console_y + y) * vga_info.pitch + (console_x + x) * 3;
-                    vram[base + 0] = color.b;
-                    vram[base + 1] = color.g;
-                    vram[base + 2] = color.r;
+                    buffer[base + 0] = color.b;
+                    buffer[base + 1] = color.g;
+                    buffer[base + 2] = color.r;
                 }
             }
         }
     }
+
+    if (vga_info.buffers > 1) {
+        flip();
+    }
 }
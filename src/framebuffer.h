@@ -3,6 +3,12 @@
 
 #include "types.h"
 
+struct task;
+
+// the kernel's own display mode, which the loader sets. must match
+// consts.asm
+#define VBE_MODE 0x0118
+
 typedef struct {
   uint16_t attributes;
   uint8_t win_a, win_b;
@@ -29,8 +35,22 @@ typedef struct {
 } __attribute__((packed))
 vbe_mode_info_t;
 
+// the VBE 2.0 protected mode interface table as the loader copied it, after
+// its length. offsets in the table are from its start. must match consts.asm
+#define VBE_PMI_MAX 1022
+
+typedef struct {
+  uint16_t length;
+  uint16_t set_window;
+  uint16_t set_display_start;
+  uint16_t set_palette;
+  uint16_t io_list;
+  uint8_t code[VBE_PMI_MAX - 8];
+} __attribute__((packed))
+vbe_pmi_t;
+
 void
-framebuffer_init(const vbe_mode_info_t* mode_info, const uint8_t* font);
+framebuffer_init(const vbe_mode_info_t* mode_info, const uint8_t* font, const vbe_pmi_t* pmi);
 
 #define IO_VGA_LO 0x3b0
 #define IO_VGA_HI 0x3df
@@ -38,10 +58,47 @@ framebuffer_init(const vbe_mode_info_t* mode_info, const uint8_t* font);
 void
 framebuffer_outb(uint16_t port, uint8_t value);
 
+// on every CPU, which then converts at the refresh rate
+void
+framebuffer_init_cpu();
+
+// move the owner's mappings of the frame buffer onto a copy of its picture
+// once another guest is shown, and back with the picture once it is again.
+// on every CPU, as only the owner's own can
+void
+framebuffer_follow();
+
+// convert what a guest in mode 13h drew since the last call into the frame
+// buffer
+void
+framebuffer_convert();
+
+// INT 10h mode switches, returns false to reflect it to the guest. a guest
+// setting the kernel's own mode gets the frame buffer to itself, linear and
+// through a window at A0000 which the kernel switches banks of, and the
+// console isn't drawn while that guest is shown. setting mode 13h hands it
+// over too, with the kernel drawing the guest's picture, and any other VGA
+// mode gives it back. the console is drawn while another guest is shown, once
+// the owner is drawing into a copy of its picture
+bool
+framebuffer_int(struct task* task, uint8_t vector);
+
+// the loader's resident window function, which real mode far calls to
+// switch banks as INT 10h AX=4F05h does
+void
+framebuffer_window(uint16_t segment, uint16_t offset);
+
+// the physical frame buffer, if the task has it
+bool
+framebuffer_lfb(struct task* task, phys_t* base, uint32_t* size);
+
 void
 framebuffer_reset();
 
 void
 framebuffer_refresh();
 
+void
+framebuffer_show(const uint16_t* text);
+
 #endif
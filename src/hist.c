@@ -0,0 +1,71 @@
+#include "hist.h"
+#include "debug.h"
+#include "log.h"
+
+#ifdef HIST
+
+static uint32_t
+histograms[HIST_KINDS][256][HIST_BUCKETS];
+
+static const char* const
+kind_names[HIST_KINDS] = {
+    [HIST_VECTOR] = "vector",
+    [HIST_OPCODE] = "opcode",
+};
+
+void
+hist_record(enum hist_kind kind, uint8_t index, uint64_t start)
+{
+    uint64_t cycles = rdtsc() - start;
+    uint32_t bucket = cycles >> 32 ? HIST_BUCKETS - 1 : 32 - __builtin_clz((uint32_t)cycles | 1) - 1;
+
+    __atomic_fetch_add(&histograms[kind][index][bucket], 1, __ATOMIC_RELAXED);
+}
+
+void
+hist_dump()
+{
+    print("hist: cycles by log2 bucket\n");
+
+    for (uint32_t kind = 0; kind < HIST_KINDS; kind++) {
+        for (uint32_t index = 0; index < 256; index++) {
+            uint32_t* buckets = histograms[kind][index];
+            bool header = false;
+
+            for (uint32_t bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+                // reading and clearing each bucket atomically means samples
+                // taken on other CPUs during the dump aren't lost
+                uint32_t count = __atomic_exchange_n(&buckets[bucket], 0, __ATOMIC_RELAXED);
+                if (!count) {
+                    continue;
+                }
+
+                log_throttle();
+                if (!header) {
+                    print("hist: ");
+                    print(kind_names[kind]);
+                    print(" ");
+                    print8(index);
+                    print("\n");
+                    header = true;
+                }
+
+                print("  2^");
+                print8(bucket);
+                print(": ");
+                print32(count);
+                print("\n");
+            }
+        }
+    }
+}
+
+#else
+
+void
+hist_dump()
+{
+    print("hist: not built with HIST=1\n");
+}
+
+#endif
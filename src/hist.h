@@ -0,0 +1,54 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include "types.h"
+
+// log2 cycle histograms for interrupt latency and #GP emulation cost. only
+// built with `make HIST=1` (after `make clean`), otherwise everything here
+// compiles to nothing
+
+#define HIST_BUCKETS 32
+
+enum hist_kind {
+    // cycles from interrupt_common to the return into the VM8086 guest
+    HIST_VECTOR,
+    // cycles spent emulating a trapped instruction, by opcode
+    HIST_OPCODE,
+    HIST_KINDS,
+};
+
+#ifdef HIST
+
+#include "x86.h"
+
+static inline uint64_t
+hist_begin()
+{
+    return rdtsc();
+}
+
+void
+hist_record(enum hist_kind kind, uint8_t index, uint64_t start);
+
+#else
+
+static inline uint64_t
+hist_begin()
+{
+    return 0;
+}
+
+static inline void
+hist_record(enum hist_kind kind, uint8_t index, uint64_t start)
+{
+    (void)kind;
+    (void)index;
+    (void)start;
+}
+
+#endif
+
+void
+hist_dump();
+
+#endif
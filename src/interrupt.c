@@ -1,18 +1,59 @@
+#include "apic.h"
 #include "debug.h"
+#include "dpmi.h"
 #include "interrupt.h"
+#include "io.h"
+#include "ioport.h"
+#include "log.h"
+#include "replay.h"
 #include "task.h"
 #include "kernel.h"
 #include "framebuffer.h"
+#include "hist.h"
 #include "mm.h"
+#include "sched.h"
+#include "smp.h"
+#include "stats.h"
+#include "timer.h"
+#include "x86.h"
+
+#define KEYBOARD_DATA 0x60
+
+// devices which raise IRQs in response to commands are routed to the guest
+// that most recently sent them a command
+static const struct {
+    uint16_t lo, hi;
+    uint8_t irq;
+} device_ports[] = {
+    { 0x1f0, 0x1f7, 14 }, // primary ATA
+    { 0x3f6, 0x3f6, 14 },
+    { 0x170, 0x177, 15 }, // secondary ATA
+    { 0x376, 0x376, 15 },
+    { 0x3f0, 0x3f5, 6 },  // floppy
+    { 0x3f7, 0x3f7, 6 },
+    { 0x3f8, 0x3ff, 4 },  // COM1
+    { 0x2f8, 0x2ff, 3 },  // COM2
+};
+
+static task_t*
+irq_owner[IRQ_COUNT];
 
 static void
 gpf(task_t* task)
 {
-    if (!(task->regs->eflags.dword & FLAG_VM8086)) {
-        panic("GPF raised external to VM8086 guest");
+    replay_trap(task);
+
+    if (task->regs->eflags.dword & FLAG_VM8086) {
+        vm86_gpf(task);
+        return;
     }
 
-    vm86_gpf(task);
+    if (task->dpmi && (task->regs->cs.word.lo & 3)) {
+        dpmi_gpf(task);
+        return;
+    }
+
+    panic("GPF raised external to guest");
 }
 
 static void
@@ -24,25 +65,21 @@ page_fault(task_t* task)
     if (addr < LOW_MEM_MAX && (addr & PAGE_MASK) != 0xb8000) {
         // CoW:
         if (task->regs->error_code & PAGE_FAULT_WRITE) {
-            uint32_t page = addr & PAGE_MASK;
             print("demand mapping ");
-            print32(page);
+            print32(addr & PAGE_MASK);
             print("\n");
 
-            phys_t new_phys = phys_alloc();
-            uint32_t* new_phys_map = temp_map(new_phys);
-
-            for (uint32_t i = 0; i < 1024; i++) {
-                new_phys_map[i] = ((uint32_t*)page)[i];
-            }
-
-            temp_unmap();
-
-            page_map((void*)page, new_phys, PAGE_RW | PAGE_USER);
+            lomem_private(addr);
+            STATS_INC(cow_faults);
             return;
         }
     }
 
+    if (task->dpmi && guest_frame(task->regs) && !(task->regs->eflags.dword & FLAG_VM8086)) {
+        dpmi_exception(task, PAGE_FAULT);
+        return;
+    }
+
     print("\n");
     print("*** PAGE FAULT\n");
     print("Addr: ");
@@ -71,47 +108,171 @@ unhandled_interrupt(task_t* task)
     panic("Unhandled interrupt");
 }
 
+void
+pic_eoi(uint8_t irq)
+{
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+static bool
+pic_out(task_t* task, uint16_t port, uint8_t size, uint32_t value)
+{
+    (void)task;
+
+    if (size != 1) {
+        return false;
+    }
+
+    if ((port == PIC1_COMMAND || port == PIC2_COMMAND) && (value & PIC_OCW2_EOI_MASK) == PIC_EOI) {
+        // the kernel acknowledges IRQs itself before reflecting them, so
+        // guest EOIs must not reach the PICs
+        return true;
+    }
+
+    // the PICs are masked for good once IRQs come through the IOAPIC.
+    // guest masks aren't honoured; IRQs are still only reflected while the
+    // guest has interrupts enabled
+    return ioapic_enabled();
+}
+
+void
+pic_init()
+{
+    static const io_handler_t handler = { NULL, pic_out };
+    io_register(PIC1_COMMAND, PIC1_DATA, &handler);
+    io_register(PIC2_COMMAND, PIC2_DATA, &handler);
+}
+
+void
+irq_claim(task_t* task, uint16_t port)
+{
+    for (uint32_t i = 0; i < sizeof(device_ports) / sizeof(device_ports[0]); i++) {
+        if (device_ports[i].lo <= port && port <= device_ports[i].hi) {
+            irq_owner[device_ports[i].irq] = task;
+            return;
+        }
+    }
+}
+
+static void
+hardware_irq(uint8_t irq)
+{
+    // before anything prints, or draining the log would generate more
+    if (log_irq_mask() & (1 << irq)) {
+        log_interrupt();
+        return;
+    }
+
+    print("IRQ ");
+    print8(irq);
+    print("\n");
+
+    if (irq == 0) {
+        // round robin between guests on timer interrupt. without a local
+        // APIC timer, the framebuffer is refreshed here too
+        smp_tick();
+        sched_tick();
+        if (!timer_available()) {
+            framebuffer_refresh();
+        }
+    }
+
+    if (irq == 1) {
+        // keyboard input belongs to the guest being displayed, unless it's a
+        // hotkey for the kernel itself
+        if (sched_hotkey(inb(KEYBOARD_DATA))) {
+            return;
+        }
+
+        vm86_irq(foreground_task, irq);
+        return;
+    }
+
+    if (irq_owner[irq]) {
+        vm86_irq(irq_owner[irq], irq);
+        return;
+    }
+
+    // everything else goes to the running guest - in the case of the timer,
+    // that's the guest which was just scheduled
+    vm86_irq(current_task, irq);
+}
+
 static void
-dispatch_interrupt(task_t* task)
+apic_interrupt(uint8_t vector)
 {
-    // refresh framebuffer on timer interrupt
-    if (task->regs->interrupt == 0x20) {
-        framebuffer_refresh();
+    lapic_eoi();
+
+    if (vector == APIC_TIMER) {
+        timer_interrupt();
+        return;
+    }
+
+    if (vector == IPI_SHOOTDOWN) {
+        smp_flush();
+        return;
+    }
+
+    if (vector == IPI_TICK) {
+        // forwarded timer interrupt from the boot CPU
+        sched_tick();
+        vm86_irq(current_task, 0);
+        return;
     }
 
+    // IPI_WAKE: another CPU pended an IRQ on one of our tasks
+    vm86_pending(current_task);
+}
+
+static void
+dispatch_interrupt(task_t* task, uint8_t vector)
+{
     // handle interrrupts on PICs 1 and 2
-    // translates interrupt vectors accordingly
-    if (task->regs->interrupt >= 0x20 && task->regs->interrupt < 0x28) {
-        // PIC 1
-        print("PIC 1 IRQ ");
-        print16(task->regs->interrupt - 0x20);
-        print("\n");
-        vm86_interrupt(task, task->regs->interrupt - 0x20 + 0x08);
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT) {
+        pic_eoi(vector - IRQ_BASE);
+        hardware_irq(vector - IRQ_BASE);
         return;
     }
 
-    if (task->regs->interrupt >= 0x28 && task->regs->interrupt < 0x30) {
-        // PIC 2
-        print("PIC 2 IRQ ");
-        print16(task->regs->interrupt - 0x20);
-        print("\n");
-        vm86_interrupt(task, task->regs->interrupt - 0x28 + 0x70);
+    // the same IRQs when routed through the IOAPIC
+    if (vector >= IOAPIC_BASE && vector < IOAPIC_BASE + IRQ_COUNT) {
+        lapic_eoi();
+        hardware_irq(vector - IOAPIC_BASE);
         return;
     }
 
-    if (task->regs->interrupt == GENERAL_PROTECTION_FAULT) {
+    if (vector == IPI_WAKE || vector == IPI_TICK || vector == APIC_TIMER || vector == IPI_SHOOTDOWN) {
+        apic_interrupt(vector);
+        return;
+    }
+
+    if (vector == GENERAL_PROTECTION_FAULT) {
         gpf(task);
         return;
     }
 
-    if (task->regs->interrupt == INVALID_OPCODE) {
+    if (vector == DEBUG_EXCEPTION && replay_step(task)) {
+        return;
+    }
+
+    // whatever else a DPMI client raises is its own to handle
+    if (vector < IRQ_BASE && vector != PAGE_FAULT && task->dpmi && guest_frame(task->regs)
+            && !(task->regs->eflags.dword & FLAG_VM8086)) {
+        dpmi_exception(task, vector);
+        return;
+    }
+
+    if (vector == INVALID_OPCODE) {
         print("*** invalid opcode ");
         print_csip(task->regs);
         panic("Invalid opcode");
         return;
     }
 
-    if (task->regs->interrupt == PAGE_FAULT) {
+    if (vector == PAGE_FAULT) {
         page_fault(task);
         return;
     }
@@ -122,7 +283,74 @@ dispatch_interrupt(task_t* task)
 void
 interrupt(regs_t* regs)
 {
-    current_task->regs = regs;
-    dispatch_interrupt(current_task);
+    // copied before anything nested can overwrite them. a task switch also
+    // replaces the frame's contents
+    uint64_t entry = this_cpu()->entry_tsc;
+    uint8_t vector = regs->interrupt;
+
+    // time since the last return to a guest was spent in the guest. nested
+    // interrupts in the kernel are already being counted as kernel time
+    cpu_t* cpu = this_cpu();
+    bool from_guest = guest_frame(regs);
+    uint64_t now = rdtsc();
+    if (from_guest && cpu->exit_tsc) {
+        cpu->guest_cycles += now - cpu->exit_tsc;
+    }
+
+    if (!current_task) {
+        // CPU is idle waiting for a task. only IPIs and kernel timers are
+        // expected here
+        if (regs->interrupt == APIC_TIMER) {
+            lapic_eoi();
+            timer_interrupt();
+            return;
+        }
+        if (regs->interrupt == IPI_SHOOTDOWN) {
+            lapic_eoi();
+            smp_flush();
+            return;
+        }
+        if (regs->interrupt != IPI_WAKE && regs->interrupt != IPI_TICK) {
+            panic("Unexpected interrupt on idle CPU");
+        }
+        lapic_eoi();
+        return;
+    }
+
+    // interrupts which wake a CPU in sched_halt are for the halted guest,
+    // whose frame is further up the stack
+    regs_t* frame = regs;
+    if (!from_guest && cpu->halted_frame) {
+        if (vector < IRQ_BASE) {
+            panic("CPU exception while halted");
+        }
+        frame = cpu->halted_frame;
+    }
+
+    uint64_t idle = cpu->idle_cycles;
+    current_task->regs = frame;
+    dispatch_interrupt(current_task, vector);
+
+    if (from_guest) {
+        hist_record(HIST_VECTOR, vector, entry);
+
+        // a replayed IRQ may be due now that the guest has moved on
+        if (replay_poll(current_task)) {
+            vm86_pending(current_task);
+        }
+
+        // the guest is waiting for an interrupt, so it can't be resumed yet
+        if (current_task->halted) {
+            sched_halt();
+        }
+
+        dpmi_check(current_task);
+    }
+
     current_task->regs = NULL;
+
+    if (from_guest) {
+        cpu->exit_tsc = rdtsc();
+        cpu->kernel_cycles += cpu->exit_tsc - now - (cpu->idle_cycles - idle);
+    }
 }
@@ -3,10 +3,22 @@
 
 #include "types.h"
 
+#define DEBUG_EXCEPTION             0x01
 #define INVALID_OPCODE              0x06
 #define GENERAL_PROTECTION_FAULT    0x0d
 #define PAGE_FAULT                  0x0e
 
+#define IRQ_BASE                    0x20
+#define IOAPIC_BASE                 0x30
+#define IRQ_COUNT                   16
+
+#define PIC1_COMMAND                0x20
+#define PIC2_COMMAND                0xa0
+#define PIC1_DATA                   0x21
+#define PIC2_DATA                   0xa1
+#define PIC_EOI                     0x20
+#define PIC_OCW2_EOI_MASK           0x38
+
 typedef union {
     uint32_t dword;
     struct {
@@ -22,7 +34,7 @@ typedef union {
 }
 reg32_t;
 
-typedef struct {
+typedef struct regs {
     // general purpose registers (PUSHA)
     reg32_t edi;
     reg32_t esi;
@@ -35,6 +47,8 @@ typedef struct {
     // segment registers
     uint32_t es_;
     uint32_t ds_;
+    uint32_t gs_;
+    uint32_t fs_;
     // interrupt details:
     uint32_t interrupt;
     uint32_t error_code;
@@ -44,7 +58,8 @@ typedef struct {
     reg32_t eflags;
     reg32_t esp;
     reg32_t ss;
-    // only present if interrupt from VM8086
+    // only present if interrupt from VM8086. interrupts from protected mode
+    // guests leave them in the FRAME_PAD above the frame
     reg32_t es16;
     reg32_t ds16;
     reg32_t fs16;
@@ -55,4 +70,17 @@ regs_t;
 void
 interrupt(regs_t* regs);
 
+void
+pic_eoi(uint8_t irq);
+
+// keeps guests' EOIs, and everything once the IOAPIC is in use, away from
+// the PICs
+void
+pic_init();
+
+struct task;
+
+void
+irq_claim(struct task* task, uint16_t port);
+
 #endif
@@ -3,6 +3,32 @@
 
 #include "types.h"
 
+#ifdef HOSTED
+
+// the host harness fakes port I/O, see host/stubs.c
+void
+outb(uint16_t port, uint8_t value);
+
+uint8_t
+inb(uint16_t port);
+
+void
+outw(uint16_t port, uint16_t value);
+
+uint16_t
+inw(uint16_t port);
+
+void
+outd(uint16_t port, uint32_t value);
+
+uint32_t
+ind(uint16_t port);
+
+void
+outsb(uint16_t port, const void* buf, uint32_t len);
+
+#else
+
 static inline void
 outb(uint16_t port, uint8_t value)
 {
@@ -45,4 +71,12 @@ ind(uint16_t port)
     return value;
 }
 
+static inline void
+outsb(uint16_t port, const void* buf, uint32_t len)
+{
+    __asm__ volatile("rep outsb" : "+S"(buf), "+c"(len) : "d"(port) : "memory");
+}
+
+#endif
+
 #endif
@@ -0,0 +1,38 @@
+#include "ioport.h"
+#include "kernel.h"
+#include "mm.h"
+
+// ports are looked up in blocks of 256, allocated as devices claim them.
+// most of the 64 KiB port space is never claimed at all
+#define BLOCK_BITS  8
+#define BLOCK_PORTS (1 << BLOCK_BITS)
+#define BLOCKS      (0x10000 / BLOCK_PORTS)
+
+STATIC_ASSERT(io_block_fits_in_single_page, BLOCK_PORTS * sizeof(const io_handler_t*) <= PAGE_SIZE);
+
+static const io_handler_t**
+blocks[BLOCKS];
+
+void
+io_register(uint16_t lo, uint16_t hi, const io_handler_t* handler)
+{
+    // only called while setting up, before any guest I/O
+    for (uint32_t port = lo; port <= hi; port++) {
+        const io_handler_t*** block = &blocks[port >> BLOCK_BITS];
+        if (!*block) {
+            *block = virt_alloc();
+        }
+
+        if ((*block)[port & (BLOCK_PORTS - 1)]) {
+            panic("io_register: port already claimed");
+        }
+        (*block)[port & (BLOCK_PORTS - 1)] = handler;
+    }
+}
+
+const io_handler_t*
+io_handler(uint16_t port)
+{
+    const io_handler_t** block = blocks[port >> BLOCK_BITS];
+    return block ? block[port & (BLOCK_PORTS - 1)] : NULL;
+}
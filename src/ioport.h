@@ -0,0 +1,30 @@
+#ifndef IOPORT_H
+#define IOPORT_H
+
+#include "types.h"
+
+struct task;
+
+// guest port I/O virtualisation. a virtual device claims a range of ports
+// with its handler, found with two table lookups whatever the number of
+// devices. accesses to unclaimed ports, or which the handler declines, reach
+// the hardware
+
+typedef struct io_handler {
+    // size is 1, 2 or 4 bytes. return false to pass the access on. either
+    // may be NULL
+    bool (*in)(struct task* task, uint16_t port, uint8_t size, uint32_t* value);
+    bool (*out)(struct task* task, uint16_t port, uint8_t size, uint32_t value);
+}
+io_handler_t;
+
+// claim ports lo to hi inclusive
+void
+io_register(uint16_t lo, uint16_t hi, const io_handler_t* handler);
+
+// NULL for unclaimed ports. an I/O permission bitmap letting guests at
+// ports directly must keep every claimed port trapping
+const io_handler_t*
+io_handler(uint16_t port);
+
+#endif
@@ -1,8 +1,15 @@
 use32
 global interrupt_init
+global interrupt_init_ap
+global task_resume
 extern panic
 extern interrupt
 extern lowmem
+extern lapic_eoi_register
+extern stats
+%ifdef PROFILE
+extern profile_nmi
+%endif
 
 %include "consts.asm"
 
@@ -82,51 +89,256 @@ interrupt_init:
     ENTRY 0x2d, irq13,                      SEG_KCODE, IDT_PRESENT | IDT_INT32
     ENTRY 0x2e, irq14,                      SEG_KCODE, IDT_PRESENT | IDT_INT32
     ENTRY 0x2f, irq15,                      SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x30, ioapic_irq0,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x31, ioapic_irq1,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x32, ioapic_irq2,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x33, ioapic_irq3,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x34, ioapic_irq4,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x35, ioapic_irq5,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x36, ioapic_irq6,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x37, ioapic_irq7,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x38, ioapic_irq8,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x39, ioapic_irq9,                SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x3a, ioapic_irq10,               SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x3b, ioapic_irq11,               SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x3c, ioapic_irq12,               SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x3d, ioapic_irq13,               SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x3e, ioapic_irq14,               SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY 0x3f, ioapic_irq15,               SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY IPI_WAKE, ipi_wake,               SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY IPI_TICK, ipi_tick,               SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY APIC_TIMER, apic_timer,           SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY IPI_SHOOTDOWN, ipi_shootdown,     SEG_KCODE, IDT_PRESENT | IDT_INT32
+    ENTRY APIC_SPURIOUS, apic_spurious,     SEG_KCODE, IDT_PRESENT | IDT_INT32
 
     ; load IDT
     lidt [idtr]
     ret
 
+; application processors share the boot CPU's IDT
+interrupt_init_ap:
+    lidt [idtr]
+    ret
+
+; exceptions a protected mode guest can raise. the kernel's own still panic
+DISPATCH_0 0x00, divide_by_zero
+DISPATCH_0 0x01, debug
+DISPATCH_0 0x05, bound_range_exceeded
 DISPATCH_0 0x06, invalid_opcode
+DISPATCH_E 0x0b, segment_not_present
+DISPATCH_E 0x0c, stack_segment_fault
 DISPATCH_E 0x0d, general_protection_fault
 DISPATCH_E 0x0e, page_fault
+DISPATCH_0 0x10, x87_exception
+DISPATCH_E 0x11, alignment_check
+DISPATCH_0 0x13, simd_exception
+
+; FAST_IRQ(vector, name) - dispatch IRQ, trying irq_fast first
+%macro FAST_IRQ 2
+    %2:
+        push dword 0
+        push dword %1
+        jmp irq_fast
+%endmacro
 
 ; IRQ dispatchers
 ; note: IRQ7 and IRQ15 handlers require special handling due to spurious
 ; interrupts
-DISPATCH_0 0x20, irq0
-DISPATCH_0 0x21, irq1
-DISPATCH_0 0x22, irq2
-DISPATCH_0 0x23, irq3
-DISPATCH_0 0x24, irq4
-DISPATCH_0 0x25, irq5
-DISPATCH_0 0x26, irq6
-; DISPATCH_0 0x27, irq7
-DISPATCH_0 0x28, irq8
-DISPATCH_0 0x29, irq9
-DISPATCH_0 0x2a, irq10
-DISPATCH_0 0x2b, irq11
-DISPATCH_0 0x2c, irq12
-DISPATCH_0 0x2d, irq13
-DISPATCH_0 0x2e, irq14
-; DISPATCH_0 0x2f, irq15
+FAST_IRQ 0x20, irq0
+FAST_IRQ 0x21, irq1
+FAST_IRQ 0x22, irq2
+FAST_IRQ 0x23, irq3
+FAST_IRQ 0x24, irq4
+FAST_IRQ 0x25, irq5
+FAST_IRQ 0x26, irq6
+; FAST_IRQ 0x27, irq7
+FAST_IRQ 0x28, irq8
+FAST_IRQ 0x29, irq9
+FAST_IRQ 0x2a, irq10
+FAST_IRQ 0x2b, irq11
+FAST_IRQ 0x2c, irq12
+FAST_IRQ 0x2d, irq13
+FAST_IRQ 0x2e, irq14
+; FAST_IRQ 0x2f, irq15
+
+; IRQs routed through the IOAPIC. these are never spurious, as the PICs are
+; fully masked when the IOAPIC is in use
+FAST_IRQ 0x30, ioapic_irq0
+FAST_IRQ 0x31, ioapic_irq1
+FAST_IRQ 0x32, ioapic_irq2
+FAST_IRQ 0x33, ioapic_irq3
+FAST_IRQ 0x34, ioapic_irq4
+FAST_IRQ 0x35, ioapic_irq5
+FAST_IRQ 0x36, ioapic_irq6
+FAST_IRQ 0x37, ioapic_irq7
+FAST_IRQ 0x38, ioapic_irq8
+FAST_IRQ 0x39, ioapic_irq9
+FAST_IRQ 0x3a, ioapic_irq10
+FAST_IRQ 0x3b, ioapic_irq11
+FAST_IRQ 0x3c, ioapic_irq12
+FAST_IRQ 0x3d, ioapic_irq13
+FAST_IRQ 0x3e, ioapic_irq14
+FAST_IRQ 0x3f, ioapic_irq15
+
+; inter-processor interrupts and local APIC timer
+DISPATCH_0 IPI_WAKE, ipi_wake
+DISPATCH_0 IPI_TICK, ipi_tick
+DISPATCH_0 APIC_TIMER, apic_timer
+DISPATCH_0 IPI_SHOOTDOWN, ipi_shootdown
+
+; reflect an IRQ straight into the running VM8086 guest, without going through
+; the C dispatcher. only taken when the guest has interrupts enabled, has no
+; IRQs pending and the IRQ needs no attention from the kernel itself (see
+; sched_start). the keyboard always does, as the profile and other dumps are
+; hotkeys read there. anything else goes through interrupt_common
+irq_fast:
+%ifdef HIST
+    ; histograms measure every IRQ through the C path
+    jmp interrupt_common
+%endif
+    ; stack: vector, error code, eip, cs, eflags, esp, ss, es, ds, fs, gs
+    test dword [esp + 16], FLAG_VM8086
+    jz interrupt_common
+    push ds
+    push eax
+    push ebx
+    push ecx
+    push edx
+    %define FAST_VECTOR (esp + 20)
+    %define FAST_EIP    (esp + 28)
+    %define FAST_CS     (esp + 32)
+    %define FAST_EFLAGS (esp + 36)
+    %define FAST_ESP    (esp + 40)
+    %define FAST_SS     (esp + 44)
+    mov ax, SEG_KDATA
+    mov ds, ax
+    mov ax, SEG_CPU
+    mov gs, ax
+
+    mov ebx, [gs:CPU_TASK]
+    test ebx, ebx
+    jz .slow
+    ; IRQ number, for both PIC and IOAPIC vectors
+    mov ecx, [FAST_VECTOR]
+    and ecx, 0x0f
+    movzx edx, word [gs:CPU_FAST_IRQS]
+    bt edx, ecx
+    jnc .slow
+    cmp byte [ebx + TASK_INTERRUPTS_ENABLED], 0
+    je .slow
+    cmp word [ebx + TASK_PENDING_IRQS], 0
+    jne .slow
+    ; leave guest stack wrap-around to the C path
+    cmp word [FAST_ESP], 6
+    jb .slow
+    ; CR0.WP is clear, so a stack page still copy-on-write has to be made
+    ; private by the C path before the frame is pushed
+    movzx edx, word [FAST_SS]
+    shl edx, 4
+    movzx eax, word [FAST_ESP]
+    add edx, eax
+    lea eax, [edx - 6]
+    shr eax, 12
+    test dword [PAGE_TABLE + eax * 4], PAGE_RW
+    jz .slow
+    lea eax, [edx - 1]
+    shr eax, 12
+    test dword [PAGE_TABLE + eax * 4], PAGE_RW
+    jz .slow
+
+    ; acknowledge IRQ
+    cmp dword [FAST_VECTOR], IOAPIC_BASE
+    jae .lapic_eoi
+    mov al, PIC_EOI
+    cmp ecx, 8
+    jb .pic1_eoi
+    out PIC2 + COMMAND, al
+.pic1_eoi:
+    out PIC1 + COMMAND, al
+    jmp .reflect
+.lapic_eoi:
+    mov eax, [lapic_eoi_register]
+    mov dword [eax], 0
+
+.reflect:
+    ; push FLAGS, CS and IP on to the guest stack like do_int. IF is always
+    ; set in the real flags, which matches the guest's view here
+    sub word [FAST_ESP], 6
+    movzx edx, word [FAST_SS]
+    shl edx, 4
+    movzx eax, word [FAST_ESP]
+    add edx, eax
+    mov ax, [FAST_EIP]
+    mov [edx + 0], ax
+    mov ax, [FAST_CS]
+    mov [edx + 2], ax
+    mov ax, [FAST_EFLAGS]
+    mov [edx + 4], ax
+    ; guest vector for the IRQ, as in irq_vector
+    lea eax, [ecx + 0x08]
+    cmp ecx, 8
+    jb .vector
+    lea eax, [ecx + 0x70 - 8]
+.vector:
+    ; load CS:IP from the guest's IVT
+    movzx edx, word [eax * 4 + 0]
+    mov [FAST_EIP], edx
+    mov dx, [eax * 4 + 2]
+    mov [FAST_CS], dx
+    lock inc dword [stats + STATS_IRQS_REFLECTED]
+
+    pop edx
+    pop ecx
+    pop ebx
+    pop eax
+    pop ds
+    add esp, 8
+    iret
+
+.slow:
+    pop edx
+    pop ecx
+    pop ebx
+    pop eax
+    pop ds
+    jmp interrupt_common
 
 interrupt_common:
+    ; fs and gs only matter for protected mode guests, VM8086 ones have them
+    ; saved in the interrupt frame
+    push fs
+    push gs
     push ds
     push es
     pusha
     mov ax, SEG_KDATA
     mov ds, ax
     mov es, ax
+    mov ax, SEG_CPU
+    mov gs, ax
+%ifdef HIST
+    rdtsc
+    mov [gs:CPU_ENTRY_TSC], eax
+    mov [gs:CPU_ENTRY_TSC + 4], edx
+%endif
     push esp
     call interrupt
     add esp, 4
+interrupt_return:
     popa
     pop es
     pop ds
+    pop gs
+    pop fs
     add esp, 8
     iret
 
+; task_resume(regs_t* frame) - enter a task by returning through an interrupt
+; frame built at the top of the kernel stack
+task_resume:
+    mov esp, [esp + 4]
+    jmp interrupt_return
+
 pic_init:
     ; save pic masks, PIC1 in BL and PIC2 in BH
     in al, PIC2 + DATA
@@ -170,14 +382,29 @@ pic_init:
     .msg db "Unhandled CPU exception: ", %1, 0
 %endmacro
 
-divide_by_zero:
-    DISPATCH_PANIC "divide by zero"
-
-debug:
-    DISPATCH_PANIC "debug"
-
 nmi:
+%ifdef PROFILE
+    ; profiler samples. NMIs can land anywhere in the kernel, including in
+    ; the middle of interrupt(), so they bypass it and never touch the task
+    push dword 0
+    push dword 0x02
+    push fs
+    push gs
+    push ds
+    push es
+    pusha
+    mov ax, SEG_KDATA
+    mov ds, ax
+    mov es, ax
+    mov ax, SEG_CPU
+    mov gs, ax
+    push esp
+    call profile_nmi
+    add esp, 4
+    jmp interrupt_return
+%else
     DISPATCH_PANIC "non-maskable interrupt"
+%endif
 
 breakpoint:
     DISPATCH_PANIC "breakpoint"
@@ -185,9 +412,6 @@ breakpoint:
 overflow:
     DISPATCH_PANIC "overflow"
 
-bound_range_exceeded:
-    DISPATCH_PANIC "bound range exceeded"
-
 device_not_available:
     DISPATCH_PANIC "device not available"
 
@@ -197,24 +421,9 @@ double_fault:
 invalid_tss:
     DISPATCH_PANIC "invalid tss"
 
-segment_not_present:
-    DISPATCH_PANIC "segment not present"
-
-stack_segment_fault:
-    DISPATCH_PANIC "stack segment fault"
-
-x87_exception:
-    DISPATCH_PANIC "x87 exception"
-
-alignment_check:
-    DISPATCH_PANIC "alignment check"
-
 machine_check:
     DISPATCH_PANIC "machine check"
 
-simd_exception:
-    DISPATCH_PANIC "simd exception"
-
 virtualization_exception:
     DISPATCH_PANIC "virtualization exception"
 
@@ -223,6 +432,10 @@ security_exception:
 
 ; IRQ 2 is missing - it never happens in practise
 
+; spurious interrupts from the local APIC must not be acknowledged
+apic_spurious:
+    iret
+
 ; LPT1/spurious
 irq7:
     ; we need to test whether this was a genuine IRQ or spurious
@@ -237,7 +450,7 @@ irq7:
     pop ax
     push 0      ; error code - unused
     push 0x27   ; interrupt number
-    jmp interrupt_common
+    jmp irq_fast
 .spurious:
     ; ignore it otherwise
     pop ax
@@ -257,7 +470,7 @@ irq15:
     pop ax
     push 0      ; error code - unused
     push 0x2f   ; interrupt number
-    jmp interrupt_common
+    jmp irq_fast
 .spurious:
     ; ignore it otherwise
     pop ax
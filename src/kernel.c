@@ -1,6 +1,18 @@
 #include "kernel.h"
+#include "a20.h"
+#include "apic.h"
 #include "mm.h"
 #include "framebuffer.h"
+#include "interrupt.h"
+#include "log.h"
+#include "profile.h"
+#include "sched.h"
+#include "smp.h"
+#include "tables.h"
+#include "timer.h"
+#include "wset.h"
+
+#define REFRESH_INTERVAL 20000 // usecs
 
 static void
 unmap_stack_guard()
@@ -12,10 +24,38 @@ unmap_stack_guard()
 
 void interrupt_init();
 
+static void
+refresh(timer_t* timer)
+{
+    framebuffer_refresh();
+    timer_arm(timer, REFRESH_INTERVAL);
+}
+
 void
 setup()
 {
+    mm_init();
+    sched_init();
     unmap_stack_guard();
     interrupt_init();
     lomem_reset();
+    tables_init();
+    lapic_init();
+    timer_init();
+    ioapic_init();
+    pic_init();
+    a20_init();
+    log_init();
+    smp_init();
+
+    // with a local APIC timer available, the display refreshes at its own
+    // rate instead of whatever rate the guest programs the PIT to
+    if (timer_available()) {
+        static timer_t refresh_timer = { .callback = refresh };
+        timer_arm(&refresh_timer, REFRESH_INTERVAL);
+    }
+
+    profile_init();
+    wset_init();
+    framebuffer_init_cpu();
 }
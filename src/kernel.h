@@ -5,6 +5,8 @@
 
 extern uint8_t end[];
 
+typedef volatile uint32_t spinlock_t;
+
 void
 panic(const char* msg) __attribute__((noreturn));
 
@@ -20,6 +22,12 @@ critical_end(bool prev);
 bool
 critical();
 
+void
+spin_lock(spinlock_t* lock);
+
+void
+spin_unlock(spinlock_t* lock);
+
 void
 setup();
 
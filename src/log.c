@@ -0,0 +1,312 @@
+#include "log.h"
+#include "apic.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "io.h"
+#include "ioport.h"
+#include "kernel.h"
+#include "timer.h"
+#include "x86.h"
+
+#define LOG_SIZE            0x4000 // bytes, power of two
+#define LOG_DRAIN_INTERVAL  10000  // usecs
+
+#define DEBUG_PORT          0xe9
+
+#define COM1                0x3f8
+#define COM1_IRQ            4
+#define UART_PORTS          8
+#define UART_DATA           0
+#define UART_IER            1
+#define UART_FCR            2
+#define UART_IIR            2
+#define UART_LCR            3
+#define UART_MCR            4
+#define UART_LSR            5
+#define UART_SCRATCH        7
+#define UART_DIVISOR_LO     0
+#define UART_DIVISOR_HI     1
+
+#define IER_THRE            0x02
+#define FCR_ENABLE_CLEAR    0x07
+#define FCR_TRIGGER_14      0xc0
+#define IIR_FIFO_ENABLED    0xc0
+#define LCR_8N1             0x03
+#define LCR_DLAB            0x80
+#define MCR_DTR_RTS_OUT2    0x0b
+#define LSR_THRE            0x20
+#define UART_FIFO_SIZE      16
+#define UART_DIVISOR_115200 1
+
+typedef struct {
+    const char* name;
+    // write up to len bytes without waiting, returns how many were taken
+    uint32_t (*write)(const uint8_t* buf, uint32_t len);
+    // called with the ring empty or not, to start or stop interrupt driven
+    // draining
+    void (*pending)(bool pending);
+    uint16_t irq_mask;
+}
+sink_t;
+
+static uint8_t
+ring[LOG_SIZE];
+
+// free running, wrapped on access
+static uint32_t
+head, tail;
+
+static uint32_t
+dropped;
+
+static spinlock_t
+log_lock;
+
+// until the drain timer is running every print goes straight out
+static bool
+buffered;
+
+static uint32_t
+debug_port_write(const uint8_t* buf, uint32_t len)
+{
+    // a single string instruction is a single exit under most hypervisors
+    outsb(DEBUG_PORT, buf, len);
+    return len;
+}
+
+static const sink_t
+debug_port_sink = { "port e9", debug_port_write, NULL, 0 };
+
+static uint32_t
+uart_write(const uint8_t* buf, uint32_t len)
+{
+    if (!(inb(COM1 + UART_LSR) & LSR_THRE)) {
+        return 0;
+    }
+
+    // transmitter is empty, so the whole FIFO is free
+    if (len > UART_FIFO_SIZE) {
+        len = UART_FIFO_SIZE;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        outb(COM1 + UART_DATA, buf[i]);
+    }
+    return len;
+}
+
+static void
+uart_pending(bool pending)
+{
+    // the UART interrupts whenever its FIFO empties while this is set
+    static bool enabled = false;
+
+    if (pending != enabled) {
+        outb(COM1 + UART_IER, pending ? IER_THRE : 0);
+        enabled = pending;
+    }
+}
+
+static const sink_t
+uart_sink = { "COM1", uart_write, uart_pending, 1 << COM1_IRQ };
+
+static const sink_t*
+sink = &debug_port_sink;
+
+// called with log_lock held. returns true once the ring is empty
+static bool
+drain()
+{
+    while (tail != head) {
+        uint32_t start = tail & (LOG_SIZE - 1);
+        uint32_t len = head - tail;
+        if (len > LOG_SIZE - start) {
+            len = LOG_SIZE - start;
+        }
+
+        uint32_t written = sink->write(&ring[start], len);
+        tail += written;
+        if (written < len) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+append(const char* msg, uint32_t len)
+{
+    if (len > LOG_SIZE - (head - tail)) {
+        // never wait for the console, the output is lost instead
+        dropped += len;
+        return;
+    }
+
+    for (uint32_t i = 0; i < len; i++) {
+        ring[(head + i) & (LOG_SIZE - 1)] = msg[i];
+    }
+    head += len;
+}
+
+static void
+drain_async()
+{
+    // called with log_lock held
+    if (dropped) {
+        static const char lost[] = "\nlog: output dropped\n";
+        dropped = 0;
+        append(lost, sizeof(lost) - 1);
+    }
+
+    bool empty = drain();
+    if (sink->pending) {
+        sink->pending(!empty);
+    }
+}
+
+void
+log_write(const char* msg, uint32_t len)
+{
+    bool crit = critical_begin();
+    spin_lock(&log_lock);
+
+    append(msg, len);
+
+    if (!buffered) {
+        while (!drain()) {
+            pause();
+        }
+    } else if (sink->pending) {
+        sink->pending(true);
+    }
+
+    spin_unlock(&log_lock);
+    critical_end(crit);
+}
+
+void
+log_flush()
+{
+    bool crit = critical_begin();
+    spin_lock(&log_lock);
+
+    while (!drain()) {
+        pause();
+    }
+
+    spin_unlock(&log_lock);
+    critical_end(crit);
+}
+
+void
+log_throttle()
+{
+    bool crit = critical_begin();
+    spin_lock(&log_lock);
+
+    while (head - tail > LOG_SIZE / 2 && !drain()) {
+        pause();
+    }
+
+    spin_unlock(&log_lock);
+    critical_end(crit);
+}
+
+static void
+drain_timer(timer_t* timer)
+{
+    // backstop for sinks without interrupts, or whose IRQ a guest masked
+    spin_lock(&log_lock);
+    drain_async();
+    spin_unlock(&log_lock);
+
+    timer_arm(timer, LOG_DRAIN_INTERVAL);
+}
+
+static bool
+uart_init()
+{
+    outb(COM1 + UART_SCRATCH, 0x5a);
+    if (inb(COM1 + UART_SCRATCH) != 0x5a) {
+        return false;
+    }
+
+    outb(COM1 + UART_FCR, FCR_ENABLE_CLEAR | FCR_TRIGGER_14);
+    if ((inb(COM1 + UART_IIR) & IIR_FIFO_ENABLED) != IIR_FIFO_ENABLED) {
+        // an 8250 or 16450 without a FIFO isn't worth it
+        return false;
+    }
+
+    outb(COM1 + UART_LCR, LCR_DLAB);
+    outb(COM1 + UART_DIVISOR_LO, UART_DIVISOR_115200);
+    outb(COM1 + UART_DIVISOR_HI, 0);
+    outb(COM1 + UART_LCR, LCR_8N1);
+    outb(COM1 + UART_MCR, MCR_DTR_RTS_OUT2);
+    outb(COM1 + UART_IER, 0);
+    return true;
+}
+
+static bool
+uart_in(struct task* task, uint16_t port, uint8_t size, uint32_t* value)
+{
+    // reads like a missing device
+    (void)task;
+    (void)port;
+    *value = 0xffffffff >> (32 - size * 8);
+    return true;
+}
+
+static bool
+uart_out(struct task* task, uint16_t port, uint8_t size, uint32_t value)
+{
+    (void)task;
+    (void)port;
+    (void)size;
+    (void)value;
+    return true;
+}
+
+void
+log_init()
+{
+    // Bochs and QEMU's debug port reads back as its own port number
+    if (inb(DEBUG_PORT) != DEBUG_PORT && uart_init()) {
+        log_flush();
+        sink = &uart_sink;
+
+        // guest I/O to the UART is dropped while the log owns it
+        static const io_handler_t handler = { uart_in, uart_out };
+        io_register(COM1, COM1 + UART_PORTS - 1, &handler);
+
+        if (!ioapic_enabled()) {
+            outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << COM1_IRQ));
+        }
+    }
+
+    print("log: using ");
+    print(sink->name);
+    print("\n");
+
+    if (timer_available()) {
+        static timer_t timer = { .callback = drain_timer };
+        timer_arm(&timer, LOG_DRAIN_INTERVAL);
+        buffered = true;
+    }
+}
+
+uint16_t
+log_irq_mask()
+{
+    return sink->irq_mask;
+}
+
+void
+log_interrupt()
+{
+    // reading IIR acknowledges the THRE interrupt
+    inb(COM1 + UART_IIR);
+
+    spin_lock(&log_lock);
+    drain_async();
+    spin_unlock(&log_lock);
+}
@@ -0,0 +1,31 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "types.h"
+
+// debug console transport. print() appends to an in-memory ring without
+// waiting on the console, and the ring is drained in batches to a sink: the
+// 0xe9 debug port under emulators, or COM1 on machines without one
+
+void
+log_write(const char* msg, uint32_t len);
+
+void
+log_flush();
+
+// for dumps printing more than the ring holds, which would otherwise lose
+// the rest: waits for the console until the ring is at most half full
+void
+log_throttle();
+
+void
+log_init();
+
+// IRQs the log sink takes for itself, never reflected to guests
+uint16_t
+log_irq_mask();
+
+void
+log_interrupt();
+
+#endif
@@ -1,7 +1,9 @@
 #include "debug.h"
 #include "kernel.h"
 #include "mm.h"
+#include "smp.h"
 #include "types.h"
+#include "x86.h"
 
 static uint32_t* const
 PAGE_DIRECTORY = (uint32_t*)0xfffff000;
@@ -16,12 +18,86 @@ PAGE_TABLE = (uint32_t*)0xffc00000;
 #define PAGE_FLAGS      0xfff
 #define PAGE_PRESENT    0x001
 
+#define RECURSIVE_PDE   1023
+#define MAX_ADDRESS_SPACES 16
+
+#define HMA_BASE        0x100000
+#define HMA_SIZE        0x10000
+
+// adapter ROMs start on 2 KiB boundaries with a signature and their size in
+// 512 byte units
+#define ROM_BASE        0xc0000
+#define ROM_ALIGN       0x800
+#define ROM_SIGNATURE   0xaa55
+#define ROM_UNIT        512
+#define UMB_PAGES       ((UMB_END - UMB_BASE) / PAGE_SIZE)
+
+// past this many pages, refilling the whole TLB is cheaper than invalidating
+// each page
+#define TLB_FLUSH_PAGES 32
+
 extern uint8_t _temp_page[];
 
+// PAGE_GLOBAL when the CPU supports it. kernel mappings are identical in
+// every address space, so they can survive CR3 reloads. the recursive
+// mapping is per address space and must never be global
+static uint32_t
+kernel_page_flags;
+
+// every address space shares the kernel half of the page directory. kernel
+// page tables are created lazily by page_map, so their PDEs must be copied in
+// to every address space as they appear:
+static phys_t
+address_spaces[MAX_ADDRESS_SPACES];
+
+static uint32_t
+address_space_count;
+
+// virtual A20 state of each address space. while A20 is off, the HMA's PTEs
+// alias the first 64 KiB and its own mappings are set aside here
+typedef struct {
+    bool hidden;
+    uint32_t ptes[HMA_SIZE / PAGE_SIZE];
+}
+hma_t;
+
+static hma_t
+hmas[MAX_ADDRESS_SPACES];
+
+// see lomem_umbs, found by the first lomem_reset
+static uint64_t
+umb_pages;
+
+static bool
+umb_scanned;
+
+// protects address_spaces and creation of kernel page tables
+static spinlock_t
+page_directory_lock;
+
+static spinlock_t
+phys_lock;
+
+// tells other CPUs to flush kernel mappings changed by a range operation
+static void
+(*shootdown)(void* virt, uint32_t count);
+
+static spinlock_t
+virt_lock;
+
 phys_t
 phys_next_free,
 phys_free_list;
 
+// free pages already zeroed by idle CPUs, see phys_prezero
+static phys_t
+phys_zero_list;
+
+// for stats, protected by phys_lock
+static uint32_t
+phys_free_count,
+phys_used_count;
+
 uint32_t
 virt_next_free = (uint32_t)end,
 virt_free_list;
@@ -39,9 +115,11 @@ temp_map(phys_t phys)
         panic("temp_map called while not in critical section");
     }
 
-    PAGE_TABLE[PTE(_temp_page)] = phys | PAGE_PRESENT | PAGE_RW;
-    invlpg(_temp_page);
-    return (void*)_temp_page;
+    // each CPU has its own temp page, so no locking is necessary here
+    void* temp_page = this_cpu()->temp_page;
+    PAGE_TABLE[PTE(temp_page)] = phys | PAGE_PRESENT | PAGE_RW;
+    invlpg(temp_page);
+    return temp_page;
 }
 
 void
@@ -51,19 +129,38 @@ temp_unmap()
         panic("temp_unmap called while not in critical section");
     }
 
-    PAGE_TABLE[PTE(_temp_page)] = 0;
-    invlpg(_temp_page);
+    void* temp_page = this_cpu()->temp_page;
+    PAGE_TABLE[PTE(temp_page)] = 0;
+    invlpg(temp_page);
 }
 
 phys_t
 phys_alloc()
 {
     bool crit = critical_begin();
+    spin_lock(&phys_lock);
+
+    if (phys_zero_list) {
+        phys_t page = phys_zero_list;
+        phys_t* mapped_page = temp_map(page);
+        phys_zero_list = *mapped_page;
+        phys_free_count--;
+        phys_used_count++;
+        spin_unlock(&phys_lock);
+        // only the link needs clearing
+        *mapped_page = 0;
+        temp_unmap();
+        critical_end(crit);
+        return page;
+    }
 
     if (phys_free_list) {
         phys_t page = phys_free_list;
         phys_t* mapped_page = temp_map(page);
         phys_free_list = *mapped_page;
+        phys_free_count--;
+        phys_used_count++;
+        spin_unlock(&phys_lock);
         zero_page(mapped_page);
         temp_unmap();
         critical_end(crit);
@@ -72,6 +169,8 @@ phys_alloc()
 
     phys_t page = phys_next_free;
     phys_next_free += PAGE_SIZE;
+    phys_used_count++;
+    spin_unlock(&phys_lock);
     void* mapped_page = temp_map(page);
     zero_page(mapped_page);
     temp_unmap();
@@ -84,31 +183,243 @@ phys_free(phys_t phys)
 {
     bool crit = critical_begin();
     phys_t* mapped = temp_map(phys);
+    spin_lock(&phys_lock);
     *mapped = phys_free_list;
-    temp_unmap();
     phys_free_list = phys;
+    phys_free_count++;
+    phys_used_count--;
+    spin_unlock(&phys_lock);
+    temp_unmap();
     critical_end(crit);
 }
 
+bool
+phys_prezero()
+{
+    // zero one page from the free list and move it to the zeroed list, so
+    // allocation doesn't have to. returns false once there are none left
+    bool crit = critical_begin();
+    spin_lock(&phys_lock);
+
+    phys_t page = phys_free_list;
+    if (!page) {
+        spin_unlock(&phys_lock);
+        critical_end(crit);
+        return false;
+    }
+
+    phys_t* mapped = temp_map(page);
+    phys_free_list = *mapped;
+    spin_unlock(&phys_lock);
+
+    zero_page(mapped);
+
+    spin_lock(&phys_lock);
+    *mapped = phys_zero_list;
+    phys_zero_list = page;
+    spin_unlock(&phys_lock);
+    temp_unmap();
+    critical_end(crit);
+    return true;
+}
+
 void
-page_map(void* virt, phys_t phys, uint16_t flags)
+phys_stats(uint32_t* free_pages, uint32_t* used_pages)
+{
+    // pages above phys_next_free have never been handed out and aren't
+    // counted as free
+    *free_pages = phys_free_count;
+    *used_pages = phys_used_count;
+}
+
+void
+phys_read(void* dst, phys_t src, uint32_t len)
+{
+    uint8_t* out = dst;
+    bool crit = critical_begin();
+
+    while (len) {
+        uint32_t offset = src & ~PAGE_MASK;
+        uint32_t chunk = PAGE_SIZE - offset;
+        if (chunk > len) {
+            chunk = len;
+        }
+
+        const uint8_t* mapped = temp_map(src & PAGE_MASK);
+        for (uint32_t i = 0; i < chunk; i++) {
+            out[i] = mapped[offset + i];
+        }
+        temp_unmap();
+
+        out += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+
+    critical_end(crit);
+}
+
+void
+phys_write(phys_t dst, const void* src, uint32_t len)
+{
+    const uint8_t* in = src;
+    bool crit = critical_begin();
+
+    while (len) {
+        uint32_t offset = dst & ~PAGE_MASK;
+        uint32_t chunk = PAGE_SIZE - offset;
+        if (chunk > len) {
+            chunk = len;
+        }
+
+        uint8_t* mapped = temp_map(dst & PAGE_MASK);
+        for (uint32_t i = 0; i < chunk; i++) {
+            mapped[offset + i] = in[i];
+        }
+        temp_unmap();
+
+        in += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+
+    critical_end(crit);
+}
+
+static void
+share_kernel_pde(uint32_t pde)
 {
+    // caller holds page_directory_lock
+    bool crit = critical_begin();
+    phys_t current = mm_current();
+
+    for (uint32_t i = 0; i < address_space_count; i++) {
+        if (address_spaces[i] == current) {
+            continue;
+        }
+
+        uint32_t* page_directory = temp_map(address_spaces[i]);
+        page_directory[pde] = PAGE_DIRECTORY[pde];
+        temp_unmap();
+    }
+
+    critical_end(crit);
+}
+
+static void
+page_table(void* virt)
+{
+    if (PAGE_DIRECTORY[PDE(virt)]) {
+        return;
+    }
+
+    bool crit = critical_begin();
+    spin_lock(&page_directory_lock);
+
+    // another CPU may have created this kernel page table while we were
+    // waiting for the lock:
     if (!PAGE_DIRECTORY[PDE(virt)]) {
         PAGE_DIRECTORY[PDE(virt)] = phys_alloc() | PAGE_PRESENT | PAGE_RW | PAGE_USER;
         invlpg(&PAGE_TABLE[PTE(virt)]);
+
+        if ((uint32_t)virt >= KERNEL_BASE) {
+            share_kernel_pde(PDE(virt));
+        }
+    }
+
+    spin_unlock(&page_directory_lock);
+    critical_end(crit);
+}
+
+void
+mm_flush(void* virt, uint32_t count)
+{
+    bool kernel = (uint32_t)virt >= KERNEL_BASE;
+
+    if (count <= TLB_FLUSH_PAGES) {
+        for (uint32_t i = 0; i < count; i++) {
+            invlpg((uint8_t*)virt + i * PAGE_SIZE);
+        }
+    } else if (kernel && (kernel_page_flags & PAGE_GLOBAL)) {
+        // reloading CR3 keeps global entries, toggling PGE drops them too
+        uint32_t cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        __asm__ volatile("mov %0, %%cr3" :: "r"(mm_current()) : "memory");
+    }
+}
+
+static void
+tlb_flush(void* virt, uint32_t count)
+{
+    bool kernel = (uint32_t)virt >= KERNEL_BASE;
+    mm_flush(virt, count);
+
+    // low memory belongs to the address space of a task running here, but
+    // kernel mappings may be cached by every CPU
+    if (kernel && shootdown) {
+        shootdown(virt, count);
+    }
+}
+
+void
+page_map(void* virt, phys_t phys, uint16_t flags)
+{
+    page_table(virt);
+
+    if ((uint32_t)virt >= KERNEL_BASE) {
+        flags |= kernel_page_flags;
     }
+
     PAGE_TABLE[PTE(virt)] = phys | PAGE_PRESENT | (flags & PAGE_FLAGS);
     invlpg(virt);
 }
 
+void
+page_map_range(void* virt, phys_t phys, uint32_t count, uint16_t flags)
+{
+    // map count consecutive pages, flushing once at the end
+    if ((uint32_t)virt >= KERNEL_BASE) {
+        flags |= kernel_page_flags;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* page = (uint8_t*)virt + i * PAGE_SIZE;
+        page_table(page);
+        PAGE_TABLE[PTE(page)] = (phys + i * PAGE_SIZE) | PAGE_PRESENT | (flags & PAGE_FLAGS);
+    }
+
+    tlb_flush(virt, count);
+}
+
 phys_t
 page_unmap(void* virt)
 {
     phys_t phys = PAGE_TABLE[PTE(virt)] & ~PAGE_FLAGS;
     PAGE_TABLE[PTE(virt)] = 0;
+    // global entries aren't dropped by the next address space switch
+    invlpg(virt);
     return phys;
 }
 
+void
+page_unmap_range(void* virt, uint32_t count)
+{
+    // the pages mapped there are left to the caller, look them up first
+    for (uint32_t i = 0; i < count; i++) {
+        PAGE_TABLE[PTE((uint8_t*)virt + i * PAGE_SIZE)] = 0;
+    }
+
+    tlb_flush(virt, count);
+}
+
+void
+mm_set_shootdown(void (*hook)(void* virt, uint32_t count))
+{
+    shootdown = hook;
+}
+
 phys_t
 virt_to_phys(void* virt)
 {
@@ -119,16 +430,19 @@ void*
 virt_alloc()
 {
     bool crit = critical_begin();
+    spin_lock(&virt_lock);
 
     if (virt_free_list) {
         uint32_t* page = (uint32_t*)virt_free_list;
         virt_free_list = *page;
+        spin_unlock(&virt_lock);
         critical_end(crit);
         return page;
     }
 
     void* page = (void*)virt_next_free;
     virt_next_free += PAGE_SIZE;
+    spin_unlock(&virt_lock);
     critical_end(crit);
     page_map(page, phys_alloc(), PAGE_RW);
     return page;
@@ -138,34 +452,402 @@ void
 virt_free(void* virt)
 {
     bool crit = critical_begin();
+    spin_lock(&virt_lock);
     *(uint32_t*)virt = virt_free_list;
     virt_free_list = (uint32_t)virt;
+    spin_unlock(&virt_lock);
+    critical_end(crit);
+}
+
+void*
+mmio_map(phys_t phys)
+{
+    // obtain a unique virtual page by allocating one and then immediately
+    // freeing the underlying physical page:
+    void* virt = virt_alloc();
+    phys_free(virt_to_phys(virt));
+
+    page_map(virt, phys & PAGE_MASK, PAGE_RW | PAGE_PCD | PAGE_PWT);
+    return (uint8_t*)virt + (phys & ~PAGE_MASK);
+}
+
+static hma_t*
+current_hma()
+{
+    phys_t page_directory = mm_current();
+
+    for (uint32_t i = 0; i < address_space_count; i++) {
+        if (address_spaces[i] == page_directory) {
+            return &hmas[i];
+        }
+    }
+
+    panic("unknown address space");
+}
+
+static bool
+hma_alias(uint32_t page, uint32_t* alias)
+{
+    // the other half of an aliased pair while A20 is off
+    if (!current_hma()->hidden) {
+        return false;
+    }
+
+    if (page < HMA_SIZE) {
+        *alias = page + HMA_BASE;
+        return true;
+    }
+
+    if (page >= HMA_BASE && page < HMA_BASE + HMA_SIZE) {
+        *alias = page - HMA_BASE;
+        return true;
+    }
+
+    return false;
+}
+
+void
+lomem_private(uint32_t addr)
+{
+    // give the current address space its own copy of a copy-on-write low
+    // memory page. the kernel must do this itself before writing to guest
+    // memory that the guest may not have written yet, as CR0.WP is clear
+    uint32_t page = addr & PAGE_MASK;
+    if (PAGE_TABLE[PTE(page)] & PAGE_RW) {
+        return;
+    }
+
+    bool crit = critical_begin();
+    phys_t new_phys = phys_alloc();
+    uint32_t* new_phys_map = temp_map(new_phys);
+
+    for (uint32_t i = 0; i < 1024; i++) {
+        new_phys_map[i] = ((uint32_t*)page)[i];
+    }
+
+    temp_unmap();
     critical_end(crit);
+
+    page_map((void*)page, new_phys, PAGE_RW | PAGE_USER);
+
+    uint32_t alias;
+    if (hma_alias(page, &alias)) {
+        page_map((void*)alias, new_phys, PAGE_RW | PAGE_USER);
+    }
+}
+
+bool
+user_access(uint32_t addr, uint32_t len, bool write)
+{
+    // whether the current guest could make this access itself. checked
+    // before the kernel touches memory on behalf of a protected mode guest,
+    // which may hand it any address. copy-on-write pages about to be written
+    // are made private
+    if (!len) {
+        return true;
+    }
+
+    if (addr + len < addr || addr + len > KERNEL_BASE) {
+        return false;
+    }
+
+    for (uint32_t page = addr & PAGE_MASK; page < addr + len; page += PAGE_SIZE) {
+        uint32_t pde = PAGE_DIRECTORY[PDE(page)];
+        if (!(pde & PAGE_PRESENT) || !(pde & PAGE_USER)) {
+            return false;
+        }
+
+        uint32_t pte = PAGE_TABLE[PTE(page)];
+        if (!(pte & PAGE_PRESENT) || !(pte & PAGE_USER)) {
+            return false;
+        }
+
+        if (write && !(pte & PAGE_RW)) {
+            if (page >= LOW_MEM_MAX) {
+                return false;
+            }
+            lomem_private(page);
+        }
+    }
+
+    return true;
+}
+
+void
+lomem_a20(bool enabled)
+{
+    // swap the HMA between its own pages and the wrapped view of the first
+    // 64 KiB. nothing is copied, so guests toggling A20 only pay for this
+    hma_t* hma = current_hma();
+    if (hma->hidden == !enabled) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < HMA_SIZE / PAGE_SIZE; i++) {
+        uint32_t page = HMA_BASE + i * PAGE_SIZE;
+
+        if (enabled) {
+            PAGE_TABLE[PTE(page)] = hma->ptes[i];
+        } else {
+            hma->ptes[i] = PAGE_TABLE[PTE(page)];
+            PAGE_TABLE[PTE(page)] = PAGE_TABLE[PTE(i * PAGE_SIZE)];
+        }
+
+        invlpg((void*)page);
+    }
+
+    hma->hidden = !enabled;
+}
+
+bool
+lomem_a20_enabled()
+{
+    return !current_hma()->hidden;
+}
+
+static bool
+unused(phys_t page)
+{
+    // nothing answers reads there, so they come back as all ones
+    uint32_t chunk[16];
+
+    for (uint32_t offset = 0; offset < PAGE_SIZE; offset += sizeof(chunk)) {
+        phys_read(chunk, page + offset, sizeof(chunk));
+        for (uint32_t i = 0; i < sizeof(chunk) / 4; i++) {
+            if (chunk[i] != 0xffffffff) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void
+umb_scan()
+{
+    // upper memory pages which no adapter ROM covers and nothing else
+    // answers in
+    uint64_t rom = 0;
+
+    for (phys_t addr = ROM_BASE; addr < UMB_END; addr += ROM_ALIGN) {
+        uint8_t header[3];
+        phys_read(header, addr, sizeof(header));
+        if ((header[0] | header[1] << 8) != ROM_SIGNATURE) {
+            continue;
+        }
+
+        phys_t end = addr + header[2] * ROM_UNIT;
+        for (phys_t page = addr & PAGE_MASK; page < end && page < UMB_END; page += PAGE_SIZE) {
+            if (page >= UMB_BASE) {
+                rom |= 1ULL << ((page - UMB_BASE) / PAGE_SIZE);
+            }
+        }
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < UMB_PAGES; i++) {
+        if (!(rom & (1ULL << i)) && unused(UMB_BASE + i * PAGE_SIZE)) {
+            umb_pages |= 1ULL << i;
+            count++;
+        }
+    }
+
+    print("mm: ");
+    print8(count);
+    print(" pages of upper memory for UMBs\n");
+    umb_scanned = true;
+}
+
+uint64_t
+lomem_umbs()
+{
+    return umb_pages;
 }
 
 void
 lomem_reset()
 {
-    // set up 1 MiB of memory for VM86 task
-    // just identity map to low memory for now
+    // set up 1 MiB of memory for VM86 task, plus the HMA. everything is
+    // identity mapped to the machine's memory as the loader left it, which
+    // had A20 on
+    hma_t* hma = current_hma();
+
     for (uint32_t page = 0; page < LOW_MEM_MAX; page += PAGE_SIZE) {
         if (page == 0xb8000) {
             continue;
         }
 
-        // free existing mapping if it exists
+        // free existing mapping if it exists. a hidden HMA's PTEs only
+        // alias pages below
         phys_t pte = PAGE_TABLE[PTE(page)];
-        if (pte & PAGE_RW) {
+        if ((pte & (PAGE_RW | PAGE_DEVICE)) == PAGE_RW && !(hma->hidden && page >= HMA_BASE)) {
             print("CoW: rolling back ");
             print32(page);
             print("\n");
             phys_free(pte & PAGE_MASK);
         }
+    }
 
-        // emulate A20 line:
-        phys_t phys = page & 0xfffff;
+    // pages are not mapped RW - they're CoW. the text page at 0xb8000 keeps
+    // its mapping
+    page_map_range((void*)0, 0, 0xb8000 / PAGE_SIZE, PAGE_USER);
+    page_map_range((void*)0xb9000, 0xb9000, (LOW_MEM_MAX - 0xb9000) / PAGE_SIZE, PAGE_USER);
 
-        // page is not mapped RW - it's CoW
-        page_map((void*)page, phys, PAGE_USER);
+    // unused upper memory gets RAM of the guest's own, private from the
+    // start
+    if (!umb_scanned) {
+        umb_scan();
     }
+    for (uint32_t i = 0; i < UMB_PAGES; i++) {
+        if (umb_pages & (1ULL << i)) {
+            page_map((void*)(UMB_BASE + i * PAGE_SIZE), phys_alloc(), PAGE_RW | PAGE_USER);
+        }
+    }
+
+    if (hma->hidden) {
+        for (uint32_t i = 0; i < HMA_SIZE / PAGE_SIZE; i++) {
+            if (hma->ptes[i] & PAGE_RW) {
+                phys_free(hma->ptes[i] & PAGE_MASK);
+            }
+        }
+        hma->hidden = false;
+    }
+}
+
+void
+lomem_map(uint32_t addr, phys_t phys, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t pte = PAGE_TABLE[PTE(addr) + i];
+        if ((pte & (PAGE_RW | PAGE_DEVICE)) == PAGE_RW) {
+            phys_free(pte & PAGE_MASK);
+        }
+    }
+
+    if (phys == addr) {
+        page_map_range((void*)addr, addr, count, PAGE_USER);
+    } else {
+        page_map_range((void*)addr, phys, count, PAGE_RW | PAGE_USER | PAGE_DEVICE);
+    }
+}
+
+void
+lomem_sample(uint8_t* pages)
+{
+    // the CPU only sets the bits again for pages it has to walk the tables
+    // for, so the TLB has to forget them
+    for (uint32_t i = 0; i < LOW_MEM_PAGES; i++) {
+        uint32_t pte = PAGE_TABLE[i];
+        pages[i] = pte & (PAGE_RW | PAGE_ACCESSED | PAGE_DIRTY);
+        if (!(pte & PAGE_DEVICE)) {
+            PAGE_TABLE[i] = pte & ~(PAGE_ACCESSED | PAGE_DIRTY);
+        }
+    }
+
+    tlb_flush((void*)0, LOW_MEM_PAGES);
+}
+
+uint32_t
+lomem_dirty(uint32_t addr, uint32_t count)
+{
+    // a page whose dirty bit is cleared must leave the TLB too, or the CPU
+    // wouldn't set the bit again
+    uint32_t dirty = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t* pte = &PAGE_TABLE[PTE(addr) + i];
+        if (*pte & PAGE_DIRTY) {
+            *pte &= ~PAGE_DIRTY;
+            invlpg((void*)(addr + i * PAGE_SIZE));
+            dirty |= 1 << i;
+        }
+    }
+
+    return dirty;
+}
+
+void
+mm_init()
+{
+    this_cpu()->temp_page = _temp_page;
+
+    address_spaces[0] = mm_current();
+    address_space_count = 1;
+
+    if (!(cpuid(CPUID_FEATURES).edx & CPUID_FEATURE_EDX_PGE)) {
+        return;
+    }
+
+    // start.asm mapped the kernel before we knew about global pages, so
+    // mark its mappings global now. page_map takes care of the rest
+    for (uint32_t pde = PDE(KERNEL_BASE); pde < RECURSIVE_PDE; pde++) {
+        if (!(PAGE_DIRECTORY[pde] & PAGE_PRESENT)) {
+            continue;
+        }
+
+        for (uint32_t pte = pde * 1024; pte < (pde + 1) * 1024; pte++) {
+            if (PAGE_TABLE[pte] & PAGE_PRESENT) {
+                PAGE_TABLE[pte] |= PAGE_GLOBAL;
+            }
+        }
+    }
+
+    kernel_page_flags = PAGE_GLOBAL;
+    mm_init_ap();
+}
+
+void
+mm_init_ap()
+{
+    // CR4 is per CPU, so each AP enables global pages for itself
+    if (kernel_page_flags & PAGE_GLOBAL) {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
+}
+
+phys_t
+mm_create()
+{
+    bool crit = critical_begin();
+    spin_lock(&page_directory_lock);
+
+    if (address_space_count == MAX_ADDRESS_SPACES) {
+        panic("too many address spaces");
+    }
+
+    // new address space starts with no user mappings and shares all kernel
+    // page tables with the current one:
+    phys_t page_directory = phys_alloc();
+    uint32_t* mapped = temp_map(page_directory);
+
+    for (uint32_t pde = PDE(KERNEL_BASE); pde < RECURSIVE_PDE; pde++) {
+        mapped[pde] = PAGE_DIRECTORY[pde];
+    }
+
+    mapped[RECURSIVE_PDE] = page_directory | PAGE_PRESENT | PAGE_RW;
+    temp_unmap();
+
+    address_spaces[address_space_count++] = page_directory;
+    spin_unlock(&page_directory_lock);
+    critical_end(crit);
+    return page_directory;
+}
+
+phys_t
+mm_current()
+{
+    phys_t page_directory;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(page_directory));
+    return page_directory & PAGE_MASK;
+}
+
+void
+mm_switch(phys_t page_directory)
+{
+    if (page_directory == mm_current()) {
+        return;
+    }
+
+    __asm__ volatile("mov %0, %%cr3" :: "r"(page_directory) : "memory");
 }
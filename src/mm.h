@@ -8,6 +8,14 @@
 
 #define PAGE_RW   0x002
 #define PAGE_USER 0x004
+#define PAGE_PWT  0x008
+#define PAGE_PCD  0x010
+#define PAGE_ACCESSED 0x020
+#define PAGE_DIRTY 0x040
+#define PAGE_GLOBAL 0x100
+// available to software: low memory mapped onto device memory, or onto pages
+// some other part of the kernel owns. lomem never frees them
+#define PAGE_DEVICE 0x200
 
 #define PAGE_FAULT_PRESENT  (1 << 0)
 #define PAGE_FAULT_WRITE    (1 << 1)
@@ -16,6 +24,52 @@
 #define PAGE_FAULT_IFETCH   (1 << 4)
 
 #define LOW_MEM_MAX 0x00110000
+#define LOW_MEM_PAGES (LOW_MEM_MAX / PAGE_SIZE)
+
+// where guests may get upper memory blocks, past the video BIOS and up to
+// the system BIOS
+#define UMB_BASE 0xc8000
+#define UMB_END 0xf0000
+
+#define KERNEL_BASE 0xc0000000
+
+#ifdef HOSTED
+// the host harness backs guest low memory with an ordinary array
+extern uint8_t guest_memory[];
+#define GUEST_PTR(linear) ((void*)(guest_memory + (linear)))
+#else
+// guest low memory is mapped at the bottom of every address space
+#define GUEST_PTR(linear) ((void*)(linear))
+#endif
+
+static inline uint32_t
+seg_off(uint16_t segment, uint16_t offset)
+{
+    return ((uint32_t)segment << 4) + offset;
+}
+
+// the kernel's reads and writes of guest memory. the address is hidden from
+// GCC, which takes constant addresses in the first page, such as the BDA's,
+// for null pointer dereferences
+static inline void*
+guest_ptr(uint32_t linear)
+{
+    void* ptr = GUEST_PTR(linear);
+    __asm__("" : "+r"(ptr));
+    return ptr;
+}
+
+static inline uint8_t
+peek8(uint32_t linear)
+{
+    return *(uint8_t*)guest_ptr(linear);
+}
+
+static inline uint16_t
+peek16(uint32_t linear)
+{
+    return *(uint16_t*)guest_ptr(linear);
+}
 
 void
 invlpg(void* virt);
@@ -32,12 +86,40 @@ phys_alloc();
 void
 phys_free(phys_t phys);
 
+bool
+phys_prezero();
+
+void
+phys_stats(uint32_t* free_pages, uint32_t* used_pages);
+
+void
+phys_read(void* dst, phys_t src, uint32_t len);
+
+void
+phys_write(phys_t dst, const void* src, uint32_t len);
+
 void
 page_map(void* virt, phys_t phys, uint16_t flags);
 
+// map or unmap count consecutive pages with a single TLB flush
+void
+page_map_range(void* virt, phys_t phys, uint32_t count, uint16_t flags);
+
 phys_t
 page_unmap(void* virt);
 
+void
+page_unmap_range(void* virt, uint32_t count);
+
+// called after kernel mappings change, to flush them on other CPUs
+void
+mm_set_shootdown(void (*hook)(void* virt, uint32_t count));
+
+// flush count pages at virt from this CPU's TLB only, as other CPUs do when
+// the shootdown hook asks them to
+void
+mm_flush(void* virt, uint32_t count);
+
 phys_t
 virt_to_phys(void* virt);
 
@@ -47,7 +129,69 @@ virt_alloc();
 void
 virt_free(void* virt);
 
+void*
+mmio_map(phys_t phys);
+
+void
+lomem_private(uint32_t addr);
+
+// for the kernel's writes on the guest's behalf. CR0.WP is clear, so pages
+// still copy-on-write are made private first
+static inline void*
+guest_writable(uint32_t linear, uint32_t len)
+{
+    lomem_private(linear);
+    lomem_private(linear + len - 1);
+    return guest_ptr(linear);
+}
+
+bool
+user_access(uint32_t addr, uint32_t len, bool write);
+
+void
+lomem_a20(bool enabled);
+
+bool
+lomem_a20_enabled();
+
 void
 lomem_reset();
 
+// pages of unused upper memory which lomem_reset backs with private RAM. bit
+// n is the page at UMB_BASE + n * PAGE_SIZE
+uint64_t
+lomem_umbs();
+
+// map count pages of low memory from addr onto device memory at phys, or
+// back onto the machine's own memory copy on write if phys is addr. private
+// copies of the pages are dropped
+void
+lomem_map(uint32_t addr, phys_t phys, uint32_t count);
+
+// PAGE_RW, PAGE_ACCESSED and PAGE_DIRTY of each low memory page in the
+// current address space, clearing the last two. PAGE_DEVICE pages keep
+// theirs for whoever mapped them
+void
+lomem_sample(uint8_t* pages);
+
+// bit n set if page n of count low memory pages from addr was written since
+// the last call, clearing their dirty bits. count is at most 32
+uint32_t
+lomem_dirty(uint32_t addr, uint32_t count);
+
+void
+mm_init();
+
+void
+mm_init_ap();
+
+phys_t
+mm_create();
+
+phys_t
+mm_current();
+
+void
+mm_switch(phys_t page_directory);
+
 #endif
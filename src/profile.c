@@ -0,0 +1,202 @@
+#include "profile.h"
+#include "apic.h"
+#include "debug.h"
+#include "kernel.h"
+#include "log.h"
+#include "mm.h"
+#include "smp.h"
+#include "task.h"
+#include "timer.h"
+#include "x86.h"
+
+#ifdef PROFILE
+
+#define SAMPLE_SLOT_BITS    12
+#define SAMPLE_SLOTS        (1 << SAMPLE_SLOT_BITS)
+#define SAMPLE_PROBES       16
+
+#define SAMPLE_CYCLES       1000000 // unhalted cycles between NMI samples
+#define SAMPLE_USECS        1000    // timer interval without a usable PMU
+
+#define PERFMON_VERSION_MASK            0xff
+#define PERFMON_COUNTERS_SHIFT          8
+#define PERFMON_NO_UNHALTED_CYCLES      (1 << 0)
+
+#define PERFEVTSEL_UNHALTED_CYCLES      0x3c
+#define PERFEVTSEL_USR                  (1 << 16)
+#define PERFEVTSEL_OS                   (1 << 17)
+#define PERFEVTSEL_INT                  (1 << 20)
+#define PERFEVTSEL_EN                   (1 << 22)
+
+// open addressed on the sampled address. guest samples are linear addresses
+// below LOW_MEM_MAX and kernel samples are above KERNEL_BASE, so both share
+// one table. address 0 marks an empty slot
+static struct {
+    uint32_t addr;
+    uint32_t count;
+} samples[SAMPLE_SLOTS];
+
+static uint32_t
+dropped;
+
+// architectural performance monitoring version, zero when sampling from the
+// timer instead
+static uint32_t
+pmu_version;
+
+static timer_t
+sample_timers[MAX_CPUS];
+
+static void
+record(const regs_t* regs)
+{
+    uint32_t addr = regs->eip.dword;
+    if (regs->eflags.dword & FLAG_VM8086) {
+        addr = ((uint32_t)regs->cs.word.lo << 4) + regs->eip.word.lo;
+    }
+
+    uint32_t hash = (addr * 2654435761u) >> (32 - SAMPLE_SLOT_BITS);
+
+    // lock free, samples may arrive in NMI context on every CPU at once
+    for (uint32_t probe = 0; probe < SAMPLE_PROBES; probe++) {
+        uint32_t slot = (hash + probe) & (SAMPLE_SLOTS - 1);
+        uint32_t found = 0;
+        __atomic_compare_exchange_n(&samples[slot].addr, &found, addr, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+        if (!found || found == addr) {
+            __atomic_fetch_add(&samples[slot].count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void
+sample_timer(timer_t* timer)
+{
+    // the timer only gets through while a guest runs. idle CPUs have no
+    // task and aren't sampled
+    task_t* task = current_task;
+    if (task && task->regs) {
+        record(task->regs);
+    }
+
+    timer_arm(timer, SAMPLE_USECS);
+}
+
+void
+profile_nmi(regs_t* regs)
+{
+    // anything other than a counter overflow is as fatal as it always was.
+    // the counter counts up from -SAMPLE_CYCLES, so it is negative until it
+    // overflows
+    if (!pmu_version || (uint32_t)rdmsr(MSR_PMC0) & 0x80000000) {
+        panic("Unhandled CPU exception: non-maskable interrupt");
+    }
+
+    record(regs);
+
+    wrmsr(MSR_PMC0, -(uint64_t)SAMPLE_CYCLES);
+    if (pmu_version >= 2) {
+        wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, 1);
+    }
+    lapic_perf_nmi();
+}
+
+static uint32_t
+perfmon_version()
+{
+    if (!lapic_present() || cpuid(CPUID_BASIC).eax < CPUID_PERFMON) {
+        return 0;
+    }
+
+    cpuid_t perfmon = cpuid(CPUID_PERFMON);
+    if (!(perfmon.eax >> PERFMON_COUNTERS_SHIFT & 0xff) || perfmon.ebx & PERFMON_NO_UNHALTED_CYCLES) {
+        return 0;
+    }
+
+    return perfmon.eax & PERFMON_VERSION_MASK;
+}
+
+void
+profile_init()
+{
+    // called on every CPU
+    cpu_t* cpu = this_cpu();
+    pmu_version = perfmon_version();
+
+    if (pmu_version) {
+        // counts unhalted cycles in both kernel and guest, so NMIs sample
+        // the kernel even where it runs with interrupts disabled
+        wrmsr(MSR_PERFEVTSEL0, 0);
+        wrmsr(MSR_PMC0, -(uint64_t)SAMPLE_CYCLES);
+        lapic_perf_nmi();
+        if (pmu_version >= 2) {
+            wrmsr(MSR_PERF_GLOBAL_CTRL, rdmsr(MSR_PERF_GLOBAL_CTRL) | 1);
+        }
+        wrmsr(MSR_PERFEVTSEL0, PERFEVTSEL_UNHALTED_CYCLES | PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_INT | PERFEVTSEL_EN);
+
+        if (cpu->index == 0) {
+            print("profile: sampling every ");
+            print32(SAMPLE_CYCLES);
+            print(" cycles\n");
+        }
+        return;
+    }
+
+    if (timer_available()) {
+        sample_timers[cpu->index].callback = sample_timer;
+        timer_arm(&sample_timers[cpu->index], SAMPLE_USECS);
+
+        if (cpu->index == 0) {
+            print("profile: no PMU, sampling guests every ");
+            print32(SAMPLE_USECS);
+            print(" usecs\n");
+        }
+        return;
+    }
+
+    print("profile: no PMU or local APIC timer, not sampling\n");
+}
+
+void
+profile_dump()
+{
+    print("profile: samples by address, g = guest linear CS:IP, k = kernel EIP\n");
+
+    for (uint32_t slot = 0; slot < SAMPLE_SLOTS; slot++) {
+        // clearing counts as they're read starts the next profile from
+        // scratch without losing samples taken during the dump
+        uint32_t count = __atomic_exchange_n(&samples[slot].count, 0, __ATOMIC_RELAXED);
+        if (!count) {
+            continue;
+        }
+
+        // nothing drains the log while interrupts are off, and a count
+        // that's been cleared has to make it out
+        log_throttle();
+        print(samples[slot].addr >= KERNEL_BASE ? "profile: k " : "profile: g ");
+        print32(samples[slot].addr);
+        print(" ");
+        print32(count);
+        print("\n");
+    }
+
+    uint32_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost) {
+        print("profile: dropped ");
+        print32(lost);
+        print("\n");
+    }
+}
+
+#else
+
+void
+profile_dump()
+{
+    print("profile: not built with PROFILE=1\n");
+}
+
+#endif
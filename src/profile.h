@@ -0,0 +1,31 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "types.h"
+#include "interrupt.h"
+
+// statistical profiler, sampling guest CS:IP and kernel EIP into a fixed
+// size table. only built with `make PROFILE=1` (after `make clean`),
+// otherwise everything here compiles to nothing
+
+#ifdef PROFILE
+
+void
+profile_init();
+
+void
+profile_nmi(regs_t* regs);
+
+#else
+
+static inline void
+profile_init()
+{
+}
+
+#endif
+
+void
+profile_dump();
+
+#endif
@@ -0,0 +1,369 @@
+#include "replay.h"
+#include "debug.h"
+#include "mm.h"
+#include "smp.h"
+#include "task.h"
+#include "x86.h"
+
+#define LOG_PAGES   1024 // 4 MiB
+#define LOG_SIZE    (LOG_PAGES * PAGE_SIZE)
+
+// log entries start with a tag. port reads are tagged with their size (1, 2
+// or 4) and followed by the port and value, IRQs by the IRQ, trap count, CS
+// and EIP, TSC reads by the TSC
+#define TAG_IRQ     8
+#define TAG_TSC     9
+
+#define IRQ_ENTRY   12
+
+enum replay_mode {
+    REPLAY_OFF,
+    REPLAY_RECORD,
+    REPLAY_PLAY,
+};
+
+// only ever touched from the guest being recorded or replayed, which stays
+// on one CPU
+static struct {
+    enum replay_mode mode;
+    task_t* task;
+    // allocated as the log grows, and kept for the next run
+    uint8_t* pages[LOG_PAGES];
+    uint32_t length;
+    uint32_t pos;
+    uint32_t traps;
+    // single stepping towards the next IRQ
+    bool stepping;
+    // the CPU's own, restored on stop
+    uint16_t fast_irqs;
+} replay;
+
+static uint8_t*
+log_at(uint32_t offset)
+{
+    uint8_t** page = &replay.pages[offset / PAGE_SIZE];
+    if (!*page) {
+        *page = virt_alloc();
+    }
+    return *page + offset % PAGE_SIZE;
+}
+
+static bool
+active(task_t* task)
+{
+    return replay.mode != REPLAY_OFF && task == replay.task;
+}
+
+static void
+start(task_t* task, enum replay_mode mode)
+{
+    cpu_t* cpu = this_cpu();
+
+    replay.mode = mode;
+    replay.task = task;
+    replay.pos = 0;
+    replay.traps = 0;
+    replay.stepping = false;
+    if (mode == REPLAY_RECORD) {
+        replay.length = 0;
+    }
+
+    // every IRQ has to pass through vm86_irq and every RDTSC has to trap.
+    // IRQs pended before now are part of neither run
+    replay.fast_irqs = cpu->fast_irqs;
+    cpu->fast_irqs = 0;
+    write_cr4(read_cr4() | CR4_TSD);
+    __atomic_store_n(&task->pending_irqs, 0, __ATOMIC_RELEASE);
+}
+
+static void
+stop(const char* why)
+{
+    task_t* task = replay.task;
+
+    print("replay: ");
+    print(why);
+    print(" after ");
+    print32(replay.traps);
+    print(" traps ");
+    print_csip(task->regs);
+
+    task->regs->eflags.dword &= ~FLAG_TRAP;
+    this_cpu()->fast_irqs = replay.fast_irqs;
+    write_cr4(read_cr4() & ~CR4_TSD);
+    replay.mode = REPLAY_OFF;
+    replay.task = NULL;
+}
+
+static void
+record(const uint8_t* entry, uint32_t len)
+{
+    if (len > LOG_SIZE - replay.pos) {
+        stop("log full");
+        return;
+    }
+
+    for (uint32_t i = 0; i < len; i++) {
+        *log_at(replay.pos++) = entry[i];
+    }
+    replay.length = replay.pos;
+}
+
+static void
+load(void* out, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        ((uint8_t*)out)[i] = *log_at(replay.pos++);
+    }
+}
+
+static bool
+expect(uint8_t tag, uint32_t len)
+{
+    // the next entry should be the one the guest is asking for. anything
+    // else and it has gone its own way, so leave it to run live
+    if (replay.length - replay.pos < 1 + len) {
+        stop("end of log");
+        return false;
+    }
+
+    if (*log_at(replay.pos) != tag) {
+        stop("diverged");
+        return false;
+    }
+
+    replay.pos++;
+    return true;
+}
+
+uint32_t
+replay_in(task_t* task, uint16_t port, uint8_t size, uint32_t value)
+{
+    if (!active(task)) {
+        return value;
+    }
+
+    if (replay.mode == REPLAY_RECORD) {
+        uint8_t entry[7] = { size, port, port >> 8 };
+        for (uint8_t i = 0; i < size; i++) {
+            entry[3 + i] = value >> (i * 8);
+        }
+        record(entry, 3 + size);
+        return value;
+    }
+
+    if (!expect(size, 2 + size)) {
+        return value;
+    }
+
+    uint16_t logged_port;
+    uint32_t logged = 0;
+    load(&logged_port, 2);
+    load(&logged, size);
+
+    if (logged_port != port) {
+        stop("diverged");
+        return value;
+    }
+
+    return logged;
+}
+
+uint64_t
+replay_tsc(task_t* task, uint64_t tsc)
+{
+    if (!active(task)) {
+        return tsc;
+    }
+
+    if (replay.mode == REPLAY_RECORD) {
+        uint8_t entry[9] = { TAG_TSC };
+        for (uint8_t i = 0; i < 8; i++) {
+            entry[1 + i] = tsc >> (i * 8);
+        }
+        record(entry, sizeof(entry));
+        return tsc;
+    }
+
+    if (!expect(TAG_TSC, 8)) {
+        return tsc;
+    }
+
+    load(&tsc, 8);
+    return tsc;
+}
+
+void
+replay_irq(task_t* task, uint8_t irq)
+{
+    if (!active(task) || replay.mode != REPLAY_RECORD) {
+        return;
+    }
+
+    regs_t* regs = task->regs;
+    uint8_t entry[IRQ_ENTRY] = {
+        TAG_IRQ, irq,
+        replay.traps, replay.traps >> 8, replay.traps >> 16, replay.traps >> 24,
+        regs->cs.byte.lo, regs->cs.byte.hi,
+        regs->eip.byte.lo, regs->eip.byte.hi, regs->eip.byte.res1, regs->eip.byte.res2,
+    };
+    record(entry, sizeof(entry));
+}
+
+bool
+replay_live_irq(task_t* task)
+{
+    return !active(task) || replay.mode != REPLAY_PLAY;
+}
+
+void
+replay_trap(task_t* task)
+{
+    if (active(task)) {
+        replay.traps++;
+    }
+}
+
+bool
+replay_poll(task_t* task)
+{
+    if (!active(task) || replay.mode != REPLAY_PLAY) {
+        return false;
+    }
+
+    if (replay.pos == replay.length) {
+        stop("end of log");
+        return false;
+    }
+
+    // a halted guest can only be waiting for the next IRQ
+    if (*log_at(replay.pos) != TAG_IRQ) {
+        if (task->halted) {
+            stop("diverged");
+        }
+        return false;
+    }
+
+    if (replay.length - replay.pos < IRQ_ENTRY) {
+        stop("end of log");
+        return false;
+    }
+
+    uint32_t entry = replay.pos;
+    uint8_t irq;
+    uint32_t traps;
+    uint16_t cs;
+    uint32_t eip;
+    replay.pos++;
+    load(&irq, 1);
+    load(&traps, 4);
+    load(&cs, 2);
+    load(&eip, 4);
+
+    regs_t* regs = task->regs;
+    bool reached = regs->cs.word.lo == cs && regs->eip.dword == eip && task->interrupts_enabled;
+
+    if (replay.traps > traps || (task->halted && (replay.traps != traps || !reached))) {
+        stop("diverged");
+        return false;
+    }
+
+    if (replay.traps < traps || !reached) {
+        // the IRQ arrived while the guest was running natively, so step
+        // from its last trap up to where it was
+        if (replay.traps == traps) {
+            regs->eflags.dword |= FLAG_TRAP;
+            replay.stepping = true;
+        }
+        replay.pos = entry;
+        return false;
+    }
+
+    regs->eflags.dword &= ~FLAG_TRAP;
+    replay.stepping = false;
+    __atomic_fetch_or(&task->pending_irqs, 1 << irq, __ATOMIC_ACQ_REL);
+    return true;
+}
+
+bool
+replay_step(task_t* task)
+{
+    if (!active(task)) {
+        return false;
+    }
+
+    // flags the guest pushed while stepping can bring TF back later
+    if (!replay.stepping) {
+        task->regs->eflags.dword &= ~FLAG_TRAP;
+    }
+    return true;
+}
+
+static uint16_t
+copy(task_t* task, bool to_guest)
+{
+    // between ES:DI and the log at ESI, up to CX bytes
+    regs_t* regs = task->regs;
+    uint32_t offset = regs->esi.dword;
+    uint32_t len = regs->ecx.word.lo;
+    uint32_t limit = to_guest ? replay.length : LOG_SIZE;
+
+    if (offset > limit) {
+        return 0;
+    }
+    if (len > limit - offset) {
+        len = limit - offset;
+    }
+
+    uint32_t addr = ((uint32_t)regs->es16.word.lo << 4) + regs->edi.word.lo;
+    if (!user_access(addr, len, to_guest)) {
+        return 0;
+    }
+
+    uint8_t* guest = GUEST_PTR(addr);
+    for (uint32_t i = 0; i < len; i++) {
+        if (to_guest) {
+            guest[i] = *log_at(offset + i);
+        } else {
+            *log_at(offset + i) = guest[i];
+        }
+    }
+
+    if (!to_guest) {
+        replay.length = offset + len;
+    }
+    return len;
+}
+
+void
+replay_hypercall(task_t* task)
+{
+    regs_t* regs = task->regs;
+
+    // one guest at a time
+    if (replay.mode != REPLAY_OFF && task != replay.task) {
+        return;
+    }
+
+    switch (regs->eax.byte.lo) {
+    case 0x00:
+        if (replay.mode != REPLAY_OFF) {
+            stop("stopped");
+        }
+        regs->ecx.dword = replay.length;
+        break;
+    case 0x01:
+    case 0x02:
+        if (replay.mode != REPLAY_OFF) {
+            stop("restarted");
+        }
+        start(task, regs->eax.byte.lo == 0x01 ? REPLAY_RECORD : REPLAY_PLAY);
+        break;
+    case 0x03:
+        regs->ecx.word.lo = copy(task, true);
+        break;
+    case 0x04:
+        regs->ecx.word.lo = replay.mode == REPLAY_OFF ? copy(task, false) : 0;
+        break;
+    }
+}
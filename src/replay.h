@@ -0,0 +1,57 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "types.h"
+
+struct task;
+
+// deterministic record and replay of one guest. while recording, everything
+// the guest sees from outside its own execution - port reads, TSC reads and
+// IRQ deliveries - goes to a log in kernel memory. replaying feeds the same
+// values back and delivers IRQs where they were delivered before, ignoring
+// real ones, so the same run can be timed against different kernels.
+//
+// IRQ delivery points are the number of trapped instructions since the start
+// plus CS:EIP. IRQs which arrived while the guest ran natively are reached
+// by single stepping from the last trap to the recorded CS:EIP
+
+// HYPERCALL_REPLAY, AL selects the function:
+//   00h  stop, returns the log length in ECX
+//   01h  start recording into an empty log
+//   02h  start replaying from the start of the log
+//   03h  copy CX bytes from log offset ESI to ES:DI, returns the count in CX
+//   04h  copy CX bytes from ES:DI to log offset ESI, returns the count in CX.
+//        the log ends after them
+void
+replay_hypercall(struct task* task);
+
+// the value a port read returns to the guest, given what the device returned
+uint32_t
+replay_in(struct task* task, uint16_t port, uint8_t size, uint32_t value);
+
+// likewise for the TSC
+uint64_t
+replay_tsc(struct task* task, uint64_t tsc);
+
+// an IRQ is about to be delivered to the guest
+void
+replay_irq(struct task* task, uint8_t irq);
+
+// returns false if a real IRQ must not reach the guest, as it's replaying
+bool
+replay_live_irq(struct task* task);
+
+// count an instruction trapped from the guest, before it's emulated
+void
+replay_trap(struct task* task);
+
+// pend the next logged IRQ once the guest has reached the point it was
+// delivered at. returns true if one was pended
+bool
+replay_poll(struct task* task);
+
+// single step trap, returns false if it isn't replay's
+bool
+replay_step(struct task* task);
+
+#endif
@@ -0,0 +1,304 @@
+#include "sched.h"
+#include "debug.h"
+#include "dpmi.h"
+#include "framebuffer.h"
+#include "hist.h"
+#include "kernel.h"
+#include "log.h"
+#include "mm.h"
+#include "profile.h"
+#include "smp.h"
+#include "timer.h"
+#include "wset.h"
+#include "x86.h"
+
+#define SCANCODE_RELEASE    0x80
+#define SCANCODE_ALT        0x38
+#define SCANCODE_F1         0x3b
+#define SCANCODE_F10        0x44
+#define SCANCODE_F11        0x57
+#define SCANCODE_F12        0x58
+
+static uint16_t* const
+user_fb = GUEST_PTR(0xb8000);
+
+static task_t
+tasks[MAX_TASKS];
+
+static uint32_t
+task_count = 1;
+
+task_t* foreground_task = &tasks[0];
+
+void task_resume(regs_t* frame) __attribute__((noreturn));
+
+static void
+copy_regs(regs_t* dst, const regs_t* src)
+{
+    uint32_t* dst32 = (uint32_t*)dst;
+    const uint32_t* src32 = (const uint32_t*)src;
+
+    for (uint32_t i = 0; i < sizeof(regs_t) / 4; i++) {
+        dst32[i] = src32[i];
+    }
+}
+
+static uint16_t*
+text_alias()
+{
+    // obtain a unique virtual page by allocating one and then immediately
+    // freeing the underlying physical page:
+    uint16_t* text = virt_alloc();
+    phys_free(virt_to_phys(text));
+
+    page_map(text, virt_to_phys(user_fb), PAGE_RW);
+    return text;
+}
+
+static void
+clone_task(task_t* task, const task_t* parent)
+{
+    print("sched: starting guest ");
+    print8(task - tasks);
+    print("\n");
+
+    copy_regs(&task->saved_regs, parent->regs);
+    task->has_reset = true;
+    task->interrupts_enabled = parent->interrupts_enabled;
+    task->pending_irqs = 0;
+    task->halted = false;
+    __asm__ volatile("fnsave %0\n\tfrstor %0" : "+m"(task->fpu_state));
+
+    task->text = virt_alloc();
+    for (uint32_t i = 0; i < PAGE_SIZE / 2; i++) {
+        task->text[i] = parent->text[i];
+    }
+
+    // low memory is built from scratch in the new address space, so the
+    // guest starts from the same snapshot the parent was just reset to:
+    task->page_directory = mm_create();
+    mm_switch(task->page_directory);
+    page_map(user_fb, virt_to_phys(task->text), PAGE_RW | PAGE_USER);
+    lomem_reset();
+    mm_switch(parent->page_directory);
+}
+
+static void
+switch_to(task_t* next)
+{
+    task_t* prev = current_task;
+    regs_t* frame = prev->regs;
+
+    if (!guest_frame(frame)) {
+        panic("task switch outside of guest");
+    }
+
+    copy_regs(&prev->saved_regs, frame);
+    __asm__ volatile("fnsave %0" : "=m"(prev->fpu_state));
+    prev->regs = NULL;
+
+    mm_switch(next->page_directory);
+    dpmi_load(next);
+    copy_regs(frame, &next->saved_regs);
+    __asm__ volatile("frstor %0" :: "m"(next->fpu_state));
+    next->regs = frame;
+
+    current_task = next;
+}
+
+void
+sched_enter()
+{
+    // called by idle CPUs to pick up their first task
+    cpu_t* cpu = this_cpu();
+
+    for (uint32_t i = 0; i < task_count; i++) {
+        task_t* task = &tasks[i];
+        if (__atomic_load_n(&task->cpu, __ATOMIC_ACQUIRE) != cpu) {
+            continue;
+        }
+
+        cpu->task = task;
+        mm_switch(task->page_directory);
+        dpmi_load(task);
+        __asm__ volatile("frstor %0" :: "m"(task->fpu_state));
+
+        regs_t* frame = (regs_t*)((uint8_t*)cpu->stack_top - FRAME_PAD) - 1;
+        copy_regs(frame, &task->saved_regs);
+        cpu->exit_tsc = rdtsc();
+        task_resume(frame);
+    }
+}
+
+static void
+focus(task_t* task)
+{
+    print("sched: focus guest ");
+    print8(task - tasks);
+    print("\n");
+
+    foreground_task = task;
+    framebuffer_show(task->text);
+    framebuffer_follow();
+}
+
+void
+sched_init()
+{
+    tasks[0].cpu = this_cpu();
+    this_cpu()->task = &tasks[0];
+}
+
+void
+sched_start(uint32_t count)
+{
+    task_t* task0 = current_task;
+
+    if (count < 1) {
+        count = 1;
+    }
+
+    if (count > MAX_TASKS) {
+        count = MAX_TASKS;
+    }
+
+    task0->page_directory = mm_current();
+    task0->text = text_alias();
+
+    for (task_count = 1; task_count < count; task_count++) {
+        clone_task(&tasks[task_count], task0);
+    }
+
+    // spread guests over CPUs. a task becomes visible to its CPU only once
+    // it is fully set up:
+    for (uint32_t i = 1; i < task_count; i++) {
+        __atomic_store_n(&tasks[i].cpu, &cpus[i % cpu_count], __ATOMIC_RELEASE);
+    }
+
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        smp_wake(&cpus[i]);
+    }
+
+    // a lone guest owns every IRQ, so most can be reflected without the C
+    // dispatcher. the keyboard still needs it for the dump hotkeys, the timer
+    // while it drives the display refresh, and the log sink's IRQ
+    if (task_count == 1) {
+        task0->cpu->fast_irqs = (timer_available() ? 0xffff : 0xfffe) & ~(1 << 1) & ~log_irq_mask();
+    }
+
+    focus(task0);
+}
+
+void
+sched_tick()
+{
+    // while the frame buffer owner is still this CPU's task
+    framebuffer_follow();
+
+    // round robin between the tasks belonging to this CPU
+    task_t* current = current_task;
+    uint32_t index = current - tasks;
+
+    for (uint32_t i = 1; i < task_count; i++) {
+        task_t* next = &tasks[(index + i) % task_count];
+        if (next->cpu == current->cpu) {
+            switch_to(next);
+            return;
+        }
+    }
+}
+
+static task_t*
+runnable(task_t* current)
+{
+    // another task on this CPU with something to do. halted tasks only
+    // have interrupts enabled, so a pending IRQ is enough to wake one
+    uint32_t index = current - tasks;
+
+    for (uint32_t i = 1; i < task_count; i++) {
+        task_t* task = &tasks[(index + i) % task_count];
+        if (task->cpu != current->cpu) {
+            continue;
+        }
+        if (!task->halted || __atomic_load_n(&task->pending_irqs, __ATOMIC_ACQUIRE)) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+void
+sched_halt()
+{
+    // the current task is waiting for an interrupt. run another task in
+    // the meantime if one is ready, otherwise zero free pages and sleep.
+    // interrupts taken while asleep find the task's frame in halted_frame
+    cpu_t* cpu = this_cpu();
+    regs_t* frame = current_task->regs;
+    uint64_t start = rdtsc();
+    cpu->halted_frame = frame;
+
+    for (;;) {
+        task_t* task = current_task;
+        task->regs = frame;
+
+        vm86_pending(task);
+        if (!task->halted) {
+            break;
+        }
+
+        task_t* next = runnable(task);
+        if (next) {
+            switch_to(next);
+            continue;
+        }
+
+        // a page at a time, with a window for the IRQ that wakes the task
+        // after each. sti holds interrupts off for one more instruction
+        if (phys_prezero()) {
+            __asm__ volatile("sti\n\tnop\n\tcli");
+        } else {
+            __asm__ volatile("sti\n\thlt\n\tcli");
+        }
+    }
+
+    cpu->halted_frame = NULL;
+    cpu->idle_cycles += rdtsc() - start;
+}
+
+bool
+sched_hotkey(uint8_t scancode)
+{
+    // Alt+F1 .. Alt+F9 bring the corresponding guest to the foreground,
+    // Alt+F10 dumps the working set, Alt+F11 dumps profiler samples,
+    // Alt+F12 dumps interrupt histograms
+    static bool alt_held = false;
+
+    if ((scancode & ~SCANCODE_RELEASE) == SCANCODE_ALT) {
+        alt_held = !(scancode & SCANCODE_RELEASE);
+        return false;
+    }
+
+    if (alt_held && scancode == SCANCODE_F10) {
+        wset_dump();
+        return true;
+    }
+
+    if (alt_held && scancode == SCANCODE_F11) {
+        profile_dump();
+        return true;
+    }
+
+    if (alt_held && scancode == SCANCODE_F12) {
+        hist_dump();
+        return true;
+    }
+
+    if (!alt_held || scancode < SCANCODE_F1 || scancode >= SCANCODE_F1 + task_count) {
+        return false;
+    }
+
+    focus(&tasks[scancode - SCANCODE_F1]);
+    return true;
+}
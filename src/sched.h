@@ -0,0 +1,29 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "task.h"
+
+#define MAX_TASKS 9
+
+extern task_t*
+foreground_task;
+
+void
+sched_init();
+
+void
+sched_start(uint32_t count);
+
+void
+sched_enter();
+
+void
+sched_tick();
+
+void
+sched_halt();
+
+bool
+sched_hotkey(uint8_t scancode);
+
+#endif
@@ -0,0 +1,260 @@
+#include "smp.h"
+#include "apic.h"
+#include "debug.h"
+#include "framebuffer.h"
+#include "kernel.h"
+#include "mm.h"
+#include "profile.h"
+#include "sched.h"
+#include "timer.h"
+#include "wset.h"
+#include "x86.h"
+
+// physical page below 1 MiB borrowed for the AP trampoline. must match
+// AP_TRAMPOLINE in smpboot.asm
+#define AP_TRAMPOLINE       0x8000
+#define AP_START_TIMEOUT    100000 // usecs
+
+#define GDT_TSS_AVAILABLE   0x89
+
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_gdtr[];
+extern uint8_t ap_cr3[];
+extern uint8_t ap_stack[];
+extern uint8_t ap_cpu[];
+
+extern uint64_t gdt[];
+
+void interrupt_init_ap();
+
+cpu_t cpus[MAX_CPUS];
+
+uint32_t cpu_count = 1;
+
+static volatile bool
+ap_started;
+
+// the kernel mappings being shot down. bit n of targets stays set until
+// cpus[n] has flushed them
+static struct {
+    spinlock_t lock;
+    void* volatile virt;
+    volatile uint32_t count;
+    uint32_t targets;
+} shootdown;
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed))
+gdtr_t;
+
+static phys_t
+phys_addr(void* virt)
+{
+    return virt_to_phys(virt) | ((uint32_t)virt & ~PAGE_MASK);
+}
+
+static void
+set_descriptor_base(uint64_t* descriptor, uint32_t base)
+{
+    uint8_t* bytes = (uint8_t*)descriptor;
+    bytes[2] = base;
+    bytes[3] = base >> 8;
+    bytes[4] = base >> 16;
+    bytes[7] = base >> 24;
+}
+
+static void
+setup_cpu(cpu_t* cpu, uint8_t apic_id)
+{
+    cpu->self = cpu;
+    cpu->task = NULL;
+    cpu->timers = NULL;
+    cpu->halted_frame = NULL;
+    cpu->index = cpu - cpus;
+    cpu->apic_id = apic_id;
+
+    // every CPU has its own GDT, differing only in the TSS and per-CPU
+    // segment bases
+    for (uint32_t i = 0; i < GDT_ENTRIES; i++) {
+        cpu->gdt[i] = gdt[i];
+    }
+    set_descriptor_base(&cpu->gdt[SEG_TSS / 8], (uint32_t)cpu->tss);
+    ((uint8_t*)&cpu->gdt[SEG_TSS / 8])[5] = GDT_TSS_AVAILABLE;
+    set_descriptor_base(&cpu->gdt[SEG_CPU / 8], (uint32_t)cpu);
+
+    cpu->stack_top = (uint8_t*)virt_alloc() + PAGE_SIZE;
+    *(uint32_t*)&cpu->tss[TSS_ESP0] = (uint32_t)cpu->stack_top - FRAME_PAD;
+    *(uint32_t*)&cpu->tss[TSS_SS0] = SEG_KDATA;
+    *(uint16_t*)&cpu->tss[TSS_IOPB] = TSS_SIZE;
+
+    // unique virtual page for temp_map, with nothing mapped in it yet:
+    cpu->temp_page = virt_alloc();
+    phys_free(page_unmap(cpu->temp_page));
+}
+
+static bool
+start_ap(cpu_t* cpu, uint8_t* trampoline)
+{
+    uint32_t len = ap_trampoline_end - ap_trampoline;
+
+    gdtr_t* gdtr = (gdtr_t*)(trampoline + (ap_gdtr - ap_trampoline));
+    gdtr->limit = sizeof(cpu->gdt) - 1;
+    gdtr->base = phys_addr(cpu->gdt);
+    *(uint32_t*)(trampoline + (ap_cr3 - ap_trampoline)) = mm_current();
+    *(uint32_t*)(trampoline + (ap_stack - ap_trampoline)) = (uint32_t)cpu->stack_top;
+    *(uint32_t*)(trampoline + (ap_cpu - ap_trampoline)) = (uint32_t)cpu;
+    phys_write(AP_TRAMPOLINE, trampoline, len);
+
+    ap_started = false;
+    lapic_start_ap(cpu->apic_id, AP_TRAMPOLINE);
+
+    for (uint32_t waited = 0; !ap_started; waited += 10) {
+        if (waited >= AP_START_TIMEOUT) {
+            return false;
+        }
+        udelay(10);
+    }
+
+    return true;
+}
+
+static void
+shootdown_others(void* virt, uint32_t count)
+{
+    // wait for every other CPU to flush. a CPU waiting for its own turn
+    // takes requests aimed at it meanwhile, so two can't deadlock
+    bool crit = critical_begin();
+    while (__atomic_exchange_n(&shootdown.lock, 1, __ATOMIC_ACQUIRE)) {
+        smp_flush();
+        pause();
+    }
+
+    uint32_t self = this_cpu()->index;
+    shootdown.virt = virt;
+    shootdown.count = count;
+    __atomic_store_n(&shootdown.targets, ((1 << cpu_count) - 1) & ~(1 << self), __ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (i != self) {
+            lapic_ipi(cpus[i].apic_id, IPI_SHOOTDOWN);
+        }
+    }
+
+    while (__atomic_load_n(&shootdown.targets, __ATOMIC_ACQUIRE)) {
+        pause();
+    }
+
+    spin_unlock(&shootdown.lock);
+    critical_end(crit);
+}
+
+void
+smp_init()
+{
+    if (!lapic_present()) {
+        print("smp: no local APIC, running on boot CPU only\n");
+        return;
+    }
+
+    // the boot CPU keeps the GDT, TSS and stack set up in start.asm
+    cpus[0].index = 0;
+    cpus[0].apic_id = lapic_id();
+
+    if (tables.cpu_count < 2) {
+        return;
+    }
+
+    // the trampoline must live below 1 MiB, so borrow a page of low memory
+    // for it and put it back when we're done
+    uint8_t* saved = virt_alloc();
+    uint8_t* trampoline = virt_alloc();
+    phys_read(saved, AP_TRAMPOLINE, PAGE_SIZE);
+
+    for (uint32_t i = 0; i < (uint32_t)(ap_trampoline_end - ap_trampoline); i++) {
+        trampoline[i] = ap_trampoline[i];
+    }
+
+    for (uint32_t i = 0; i < tables.cpu_count; i++) {
+        uint8_t apic_id = tables.cpu_apic_ids[i];
+        if (apic_id == cpus[0].apic_id) {
+            continue;
+        }
+
+        cpu_t* cpu = &cpus[cpu_count];
+        setup_cpu(cpu, apic_id);
+
+        print("smp: starting CPU with APIC ID ");
+        print8(apic_id);
+        print("\n");
+
+        if (start_ap(cpu, trampoline)) {
+            cpu_count++;
+        } else {
+            print("smp: CPU did not start\n");
+        }
+    }
+
+    phys_write(AP_TRAMPOLINE, saved, PAGE_SIZE);
+    virt_free(saved);
+    virt_free(trampoline);
+
+    if (cpu_count > 1) {
+        mm_set_shootdown(shootdown_others);
+    }
+}
+
+void
+smp_wake(cpu_t* cpu)
+{
+    lapic_ipi(cpu->apic_id, IPI_WAKE);
+}
+
+void
+smp_tick()
+{
+    // only the boot CPU receives the PIT interrupt, so it passes ticks on
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        lapic_ipi(cpus[i].apic_id, IPI_TICK);
+    }
+}
+
+void
+smp_flush()
+{
+    uint32_t bit = 1 << this_cpu()->index;
+
+    if (__atomic_load_n(&shootdown.targets, __ATOMIC_ACQUIRE) & bit) {
+        mm_flush(shootdown.virt, shootdown.count);
+        __atomic_fetch_and(&shootdown.targets, ~bit, __ATOMIC_RELEASE);
+    }
+}
+
+void
+smp_ap_main(cpu_t* cpu)
+{
+    gdtr_t gdtr = { sizeof(cpu->gdt) - 1, (uint32_t)cpu->gdt };
+    __asm__ volatile("lgdt %0" :: "m"(gdtr));
+    __asm__ volatile("ltr %w0" :: "r"(SEG_TSS));
+    __asm__ volatile("mov %w0, %%gs" :: "r"(SEG_CPU));
+    mm_init_ap();
+    interrupt_init_ap();
+    lapic_init();
+    profile_init();
+    wset_init();
+    framebuffer_init_cpu();
+
+    ap_started = true;
+
+    print("smp: CPU ");
+    print8(cpu->index);
+    print(" online\n");
+
+    // wait with interrupts enabled until the scheduler hands us a task
+    for (;;) {
+        sched_enter();
+        __asm__ volatile("sti\n\thlt\n\tcli");
+    }
+}
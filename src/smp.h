@@ -0,0 +1,98 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "types.h"
+#include "tables.h"
+
+#define SEG_KDATA       0x10
+#define SEG_TSS         0x28
+#define SEG_CPU         0x30
+#define SEG_LDT         0x38
+#define GDT_ENTRIES     8
+
+#define TSS_ESP0        0x04
+#define TSS_SS0         0x08
+#define TSS_IOPB        0x66
+#define TSS_SIZE        104
+
+// interrupts from protected mode guests don't push the VM8086 segment
+// registers, so regs_t runs this far past their frame. keeping it free at the
+// top of each kernel stack lets every frame be handled as a whole regs_t
+#define FRAME_PAD       16
+
+#define IPI_WAKE        0xf0
+#define IPI_TICK        0xf1
+#define APIC_TIMER      0xf2
+#define IPI_SHOOTDOWN   0xf3
+#define APIC_SPURIOUS   0xff
+
+struct regs;
+struct task;
+struct timer;
+
+typedef struct cpu {
+    // must come first, this_cpu() reads it through %gs
+    struct cpu* self;
+    struct task* task;
+    // IRQs which isrs.asm may reflect straight into the running task
+    uint16_t fast_irqs;
+    // TSC at the last entry to interrupt_common, in HIST builds
+    uint64_t entry_tsc;
+    // pending kernel timers, soonest first
+    struct timer* timers;
+    uint32_t index;
+    uint8_t apic_id;
+    void* temp_page;
+    void* stack_top;
+    // cycle accounting for stats. exit_tsc is zero while idle
+    uint64_t exit_tsc;
+    uint64_t kernel_cycles;
+    uint64_t guest_cycles;
+    uint64_t idle_cycles;
+    // frame of the halted guest while sched_halt sleeps, otherwise NULL
+    struct regs* halted_frame;
+    uint64_t gdt[GDT_ENTRIES];
+    uint8_t tss[TSS_SIZE];
+}
+cpu_t;
+
+// must match consts.asm:
+STATIC_ASSERT(cpu_task_offset, __builtin_offsetof(cpu_t, task) == 4);
+STATIC_ASSERT(cpu_fast_irqs_offset, __builtin_offsetof(cpu_t, fast_irqs) == 8);
+STATIC_ASSERT(cpu_entry_tsc_offset, __builtin_offsetof(cpu_t, entry_tsc) == 12);
+
+extern cpu_t
+cpus[MAX_CPUS];
+
+extern uint32_t
+cpu_count;
+
+static inline cpu_t*
+this_cpu()
+{
+#ifdef HOSTED
+    return &cpus[0];
+#else
+    cpu_t* cpu;
+    __asm__("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+#endif
+}
+
+void
+smp_init();
+
+void
+smp_wake(cpu_t* cpu);
+
+void
+smp_tick();
+
+// IPI_SHOOTDOWN: flush the kernel mappings another CPU changed
+void
+smp_flush();
+
+void
+smp_ap_main(cpu_t* cpu) __attribute__((noreturn));
+
+#endif
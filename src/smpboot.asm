@@ -0,0 +1,61 @@
+use16
+global ap_trampoline
+global ap_trampoline_end
+global ap_gdtr
+global ap_cr3
+global ap_stack
+global ap_cpu
+extern smp_ap_main
+
+%include "consts.asm"
+
+; physical address the trampoline is copied to before starting each AP
+%define AP_TRAMPOLINE 0x8000
+%define TRAMPOLINE(addr) ((addr) - ap_trampoline + AP_TRAMPOLINE)
+
+; application processors start executing here in real mode, with CS:IP set to
+; AP_TRAMPOLINE:0000 by the startup IPI
+ap_trampoline:
+    cli
+    ; trampoline data is addressed relative to CS
+    mov ax, cs
+    mov ds, ax
+    o32 lgdt [ap_gdtr - ap_trampoline]
+    ; enable protected mode
+    mov eax, cr0
+    or al, 1
+    mov cr0, eax
+    jmp dword SEG_KCODE:TRAMPOLINE(ap_pmode)
+
+use32
+ap_pmode:
+    mov ax, SEG_KDATA
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    ; enable paging with the page directory smp_init gave us. the trampoline
+    ; is identity mapped in it, so we can keep running from here
+    mov eax, [TRAMPOLINE(ap_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000 ; PG flag
+    mov cr0, eax
+    ; set up kernel stack and call into C with our cpu_t
+    mov esp, [TRAMPOLINE(ap_stack)]
+    push dword [TRAMPOLINE(ap_cpu)]
+    push dword 0 ; smp_ap_main never returns
+    mov eax, smp_ap_main
+    jmp eax
+
+; trampoline data, filled in by smp_init for each AP:
+align 4
+ap_gdtr:
+    dw 0 ; limit
+    dd 0 ; physical address of AP's GDT
+ap_cr3:
+    dd 0
+ap_stack:
+    dd 0
+ap_cpu:
+    dd 0
+ap_trampoline_end:
@@ -1,5 +1,6 @@
 use32
 extern bssend
+extern cpus
 extern interrupt_init
 extern page_map
 extern phys_alloc
@@ -13,6 +14,7 @@ extern virt_free
 extern virt_to_phys
 extern setup
 extern print
+extern log_flush
 extern framebuffer_init
 
 %include "consts.asm"
@@ -119,7 +121,8 @@ kernel:
     mov esp, stackend
 
     ; initialize TSS
-    mov [tss + TSS_ESP0], esp
+    lea eax, [esp - FRAME_PAD]
+    mov [tss + TSS_ESP0], eax
     mov ax, ss
     mov [tss + TSS_SS0], ax
     mov word [tss + TSS_IOPB], TSS_SIZE
@@ -133,6 +136,17 @@ kernel:
     mov ax, SEG_TSS
     ltr ax
 
+    ; the boot CPU's per-CPU data is cpus[0], which begins with a pointer to
+    ; itself. point the per-CPU segment at it and load it in gs
+    mov edx, cpus
+    mov [edx], edx
+    mov [gdt.cpu_base_0_15], dx
+    shr edx, 16
+    mov [gdt.cpu_base_16_23], dl
+    mov [gdt.cpu_base_24_31], dh
+    mov ax, SEG_CPU
+    mov gs, ax
+
     ; call into C kernel for setup
     call setup
 
@@ -141,13 +155,16 @@ kernel:
 
     ; init framebuffer
     mov ebx, [realdata_phys]
+    add ebx, REALDATA_VBE_PMI
+    push ebx
+    mov ebx, [realdata_phys]
     add ebx, REALDATA_FONT
     push ebx
     mov ebx, [realdata_phys]
     add ebx, REALDATA_VBE_INFO
     push ebx
     call framebuffer_init
-    add esp, 8
+    add esp, 12
 
     ; load task data
     mov ebx, [realdata_phys]
@@ -214,6 +231,9 @@ panic:
     call print
     add esp, 4
 
+    ; the log may be buffered, get it all out before stopping
+    call log_flush
+
     cli
     hlt
 .msg db "*** PANIC: ", 0
@@ -245,6 +265,29 @@ critical_end:
 .return:
     ret
 
+global spin_lock
+spin_lock:
+    mov edx, [esp + 4]
+.retry:
+    mov eax, 1
+    xchg eax, [edx]
+    test eax, eax
+    jz .return ; lock was free and is now ours
+.wait:
+    ; spin without locked bus cycles until the lock looks free
+    pause
+    cmp dword [edx], 0
+    jne .wait
+    jmp .retry
+.return:
+    ret
+
+global spin_unlock
+spin_unlock:
+    mov edx, [esp + 4]
+    mov dword [edx], 0
+    ret
+
 initpdent   equ physpd + (KERNEL_PHYS_BASE >> 22) * 4
 initptent   equ physpd + PAGE_SIZE + (KERNEL_PHYS_BASE >> 12) * 4
 initlen     equ kernel - init
@@ -255,6 +298,7 @@ gdtr:
 .offset:
     dd gdt
 
+global gdt
 gdt:
     ; entry 0x00 : null
     dq 0
@@ -296,6 +340,18 @@ gdt:
     db 0x40 | ((TSS_SIZE >> 16) & 0x0f) ; 32 bit, 1 byte granularity, limit 16:19
 .tss_base_24_31:
     db 0 ; base 24:31
+    ; entry 0x30 : per-CPU data
+    dw 0xffff ; limit 0xffff, 0:15
+.cpu_base_0_15:
+    dw 0 ; base 0:15
+.cpu_base_16_23:
+    db 0 ; base 16:23
+    db GDT_PRESENT | GDT_DATA | GDT_WX
+    db 0x40   ; 32 bit, 1 byte granularity, limit 16:19
+.cpu_base_24_31:
+    db 0 ; base 24:31
+    ; entry 0x38 : LDT of the running DPMI client, filled in by dpmi_load
+    dq 0
 .end:
 
 section .bss
@@ -0,0 +1,135 @@
+#include "stats.h"
+#include "mm.h"
+#include "smp.h"
+#include "x86.h"
+
+#define STATUS_ATTR 0x8f00
+
+stats_t
+stats;
+
+void
+stats_io(uint16_t port)
+{
+    uint32_t range = port < 0x400 ? port >> 4 : STATS_IO_RANGES - 1;
+    STATS_INC(io_ranges[range]);
+}
+
+static void
+cycles(uint64_t* kernel, uint64_t* guest, uint64_t* idle)
+{
+    *kernel = 0;
+    *guest = 0;
+    *idle = 0;
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        *kernel += cpus[i].kernel_cycles;
+        *guest += cpus[i].guest_cycles;
+        *idle += cpus[i].idle_cycles;
+    }
+}
+
+void
+stats_snapshot(stats_t* out)
+{
+    const uint32_t* src = (const uint32_t*)&stats;
+    uint32_t* dst = (uint32_t*)out;
+
+    for (uint32_t i = 0; i < sizeof(stats_t) / 4; i++) {
+        dst[i] = src[i];
+    }
+
+    out->size = sizeof(stats_t);
+    phys_stats(&out->pages_free, &out->pages_used);
+    cycles(&out->kernel_cycles, &out->guest_cycles, &out->idle_cycles);
+}
+
+static void
+put_str(uint16_t* row, uint32_t width, uint32_t* pos, const char* str)
+{
+    for (; *str && *pos < width; str++) {
+        row[(*pos)++] = (uint8_t)*str | STATUS_ATTR;
+    }
+}
+
+static void
+put_hex(uint16_t* row, uint32_t width, uint32_t* pos, uint32_t value)
+{
+    static const char hexmap[] = "0123456789abcdef";
+
+    for (uint32_t i = 0; i < 8 && *pos < width; i++) {
+        row[(*pos)++] = hexmap[(value >> (28 - i * 4)) & 0xf] | STATUS_ATTR;
+    }
+}
+
+static void
+put_percent(uint16_t* row, uint32_t width, uint32_t* pos, uint32_t percent)
+{
+    char digits[] = "   %";
+    uint32_t i = 3;
+    do {
+        digits[--i] = '0' + percent % 10;
+        percent /= 10;
+    } while (percent && i);
+    put_str(row, width, pos, digits);
+}
+
+static uint32_t
+kernel_percent()
+{
+    // share of cycles spent in the kernel since the last status update
+    static uint64_t last_kernel, last_guest;
+
+    uint64_t kernel, guest, idle;
+    cycles(&kernel, &guest, &idle);
+
+    uint64_t kernel_delta = kernel - last_kernel;
+    uint64_t guest_delta = guest - last_guest;
+    last_kernel = kernel;
+    last_guest = guest;
+
+    // scale down until the total fits the 32 bit divisor
+    while ((kernel_delta + guest_delta) >> 32) {
+        kernel_delta >>= 1;
+        guest_delta >>= 1;
+    }
+
+    uint32_t total = kernel_delta + guest_delta;
+    if (!total) {
+        return 0;
+    }
+
+    return div64(kernel_delta * 100, total);
+}
+
+void
+stats_status(uint16_t* row, uint32_t width)
+{
+    uint32_t pages_free, pages_used;
+    phys_stats(&pages_free, &pages_used);
+
+    uint32_t gpfs = 0;
+    for (uint32_t i = 0; i < 256; i++) {
+        gpfs += stats.gpf_opcodes[i];
+    }
+
+    uint32_t pos = 0;
+    put_str(row, width, &pos, "krn");
+    put_percent(row, width, &pos, kernel_percent());
+    put_str(row, width, &pos, " gpf ");
+    put_hex(row, width, &pos, gpfs);
+    put_str(row, width, &pos, " irq ");
+    put_hex(row, width, &pos, stats.irqs_reflected);
+    put_str(row, width, &pos, "/");
+    put_hex(row, width, &pos, stats.irqs_pended);
+    put_str(row, width, &pos, " cow ");
+    put_hex(row, width, &pos, stats.cow_faults);
+    put_str(row, width, &pos, " pg ");
+    put_hex(row, width, &pos, pages_used);
+    put_str(row, width, &pos, "/");
+    put_hex(row, width, &pos, pages_free);
+
+    while (pos < width) {
+        row[pos++] = ' ' | STATUS_ATTR;
+    }
+}
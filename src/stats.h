@@ -0,0 +1,47 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "types.h"
+
+// port I/O is counted in ranges of 16 ports below 0x400, plus one counter
+// for everything above
+#define STATS_IO_RANGES     ((0x400 >> 4) + 1)
+
+// kernel counters, in the layout returned to guests by HYPERCALL_STATS
+typedef struct {
+    // size of this structure, so guest tools can detect newer versions
+    uint32_t size;
+    uint32_t irqs_reflected;
+    uint32_t irqs_pended;
+    uint32_t cow_faults;
+    // physical page allocator state at the time of reading
+    uint32_t pages_free;
+    uint32_t pages_used;
+    // summed over all CPUs at the time of reading
+    uint64_t kernel_cycles;
+    uint64_t guest_cycles;
+    uint32_t gpf_opcodes[256];
+    uint32_t io_ranges[STATS_IO_RANGES];
+    // time CPUs spent asleep waiting for halted guests, summed like above
+    uint64_t idle_cycles;
+}
+stats_t;
+
+// must match consts.asm:
+STATIC_ASSERT(stats_irqs_reflected_offset, __builtin_offsetof(stats_t, irqs_reflected) == 4);
+
+extern stats_t
+stats;
+
+#define STATS_INC(counter) __atomic_fetch_add(&stats.counter, 1, __ATOMIC_RELAXED)
+
+void
+stats_io(uint16_t port);
+
+void
+stats_snapshot(stats_t* out);
+
+void
+stats_status(uint16_t* row, uint32_t width);
+
+#endif
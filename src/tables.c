@@ -0,0 +1,288 @@
+#include "tables.h"
+#include "debug.h"
+#include "mm.h"
+
+#define BDA_EBDA_SEGMENT    0x40e
+#define BASE_MEM_TOP        0x9fc00
+#define BIOS_ROM            0xe0000
+#define BIOS_ROM_SIZE       0x20000
+
+#define ACPI_HEADER_SIZE    36
+#define MADT_LOCAL_APIC     0
+#define MADT_IOAPIC         1
+#define MADT_OVERRIDE       2
+#define MADT_ENABLED        (1 << 0)
+
+#define MP_PROCESSOR        0
+#define MP_BUS              1
+#define MP_IOAPIC           2
+#define MP_IO_INTERRUPT     3
+#define MP_PROCESSOR_SIZE   20
+#define MP_OTHER_SIZE       8
+#define MP_ENABLED          (1 << 0)
+#define MP_INT              0
+#define MP_MAX_BUSES        32
+#define MP_DEFAULT_IOAPIC   0xfec00000
+
+tables_t
+tables;
+
+static uint8_t
+read8(phys_t phys)
+{
+    uint8_t value;
+    phys_read(&value, phys, sizeof(value));
+    return value;
+}
+
+static uint16_t
+read16(phys_t phys)
+{
+    uint16_t value;
+    phys_read(&value, phys, sizeof(value));
+    return value;
+}
+
+static uint32_t
+read32(phys_t phys)
+{
+    uint32_t value;
+    phys_read(&value, phys, sizeof(value));
+    return value;
+}
+
+static bool
+signature(phys_t phys, const char* sig)
+{
+    for (; *sig; sig++, phys++) {
+        if (read8(phys) != (uint8_t)*sig) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+checksum(phys_t phys, uint32_t len)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        sum += read8(phys + i);
+    }
+    return sum == 0;
+}
+
+static phys_t
+scan_region(phys_t base, uint32_t len, const char* sig, uint32_t checksum_len)
+{
+    for (phys_t phys = base; phys < base + len; phys += 16) {
+        if (signature(phys, sig) && checksum(phys, checksum_len)) {
+            return phys;
+        }
+    }
+    return 0;
+}
+
+static phys_t
+scan(const char* sig, uint32_t checksum_len)
+{
+    phys_t ebda = (phys_t)read16(BDA_EBDA_SEGMENT) << 4;
+    phys_t found = 0;
+
+    if (ebda) {
+        found = scan_region(ebda, 1024, sig, checksum_len);
+    }
+    if (!found) {
+        found = scan_region(BASE_MEM_TOP, 1024, sig, checksum_len);
+    }
+    if (!found) {
+        found = scan_region(BIOS_ROM, BIOS_ROM_SIZE, sig, checksum_len);
+    }
+    return found;
+}
+
+static void
+add_cpu(uint8_t apic_id)
+{
+    if (tables.cpu_count == MAX_CPUS) {
+        print("tables: ignoring CPU beyond MAX_CPUS\n");
+        return;
+    }
+
+    tables.cpu_apic_ids[tables.cpu_count++] = apic_id;
+}
+
+static void
+add_ioapic(phys_t addr, uint32_t gsi_base)
+{
+    // ISA interrupts are conventionally wired to the IOAPIC at GSI 0
+    if (tables.ioapic && gsi_base != 0) {
+        return;
+    }
+
+    tables.ioapic = addr;
+    tables.ioapic_gsi_base = gsi_base;
+}
+
+static void
+add_override(uint8_t irq, uint32_t gsi, uint16_t flags)
+{
+    if (irq < ISA_IRQS) {
+        tables.irq_gsi[irq] = gsi;
+        tables.irq_flags[irq] = flags;
+    }
+}
+
+static bool
+parse_madt(phys_t madt)
+{
+    uint32_t len = read32(madt + 4);
+    if (!checksum(madt, len)) {
+        return false;
+    }
+
+    tables.lapic = read32(madt + ACPI_HEADER_SIZE);
+
+    for (phys_t entry = madt + ACPI_HEADER_SIZE + 8; entry < madt + len; entry += read8(entry + 1)) {
+        if (read8(entry + 1) == 0) {
+            break;
+        }
+
+        switch (read8(entry)) {
+        case MADT_LOCAL_APIC:
+            if (read32(entry + 4) & MADT_ENABLED) {
+                add_cpu(read8(entry + 3));
+            }
+            break;
+        case MADT_IOAPIC:
+            add_ioapic(read32(entry + 4), read32(entry + 8));
+            break;
+        case MADT_OVERRIDE:
+            add_override(read8(entry + 3), read32(entry + 4), read16(entry + 8));
+            break;
+        }
+    }
+
+    return true;
+}
+
+static bool
+parse_acpi()
+{
+    phys_t rsdp = scan("RSD PTR ", 20);
+    if (!rsdp) {
+        return false;
+    }
+
+    phys_t rsdt = read32(rsdp + 16);
+    if (!signature(rsdt, "RSDT")) {
+        return false;
+    }
+
+    uint32_t len = read32(rsdt + 4);
+    for (phys_t entry = rsdt + ACPI_HEADER_SIZE; entry < rsdt + len; entry += 4) {
+        phys_t table = read32(entry);
+        if (signature(table, "APIC")) {
+            print("tables: using ACPI MADT\n");
+            return parse_madt(table);
+        }
+    }
+
+    return false;
+}
+
+static bool
+parse_mp()
+{
+    phys_t floating = scan("_MP_", 16);
+    if (!floating) {
+        return false;
+    }
+
+    phys_t config = read32(floating + 4);
+    if (!config) {
+        // no configuration table means one of the default configurations,
+        // all of which have two processors with APIC IDs 0 and 1 and an
+        // IOAPIC at the standard address
+        print("tables: using MP default configuration\n");
+        add_cpu(0);
+        add_cpu(1);
+        add_ioapic(MP_DEFAULT_IOAPIC, 0);
+        return true;
+    }
+
+    if (!signature(config, "PCMP") || !checksum(config, read16(config + 4))) {
+        return false;
+    }
+
+    print("tables: using MP configuration table\n");
+    tables.lapic = read32(config + 36);
+
+    // interrupt assignments name buses by ID, so remember which are ISA
+    bool isa_bus[MP_MAX_BUSES] = { false };
+
+    phys_t entry = config + 44;
+    for (uint16_t count = read16(config + 34); count; count--) {
+        switch (read8(entry)) {
+        case MP_PROCESSOR:
+            if (read8(entry + 3) & MP_ENABLED) {
+                add_cpu(read8(entry + 1));
+            }
+            entry += MP_PROCESSOR_SIZE;
+            continue;
+        case MP_BUS:
+            if (read8(entry + 1) < MP_MAX_BUSES && signature(entry + 2, "ISA")) {
+                isa_bus[read8(entry + 1)] = true;
+            }
+            break;
+        case MP_IOAPIC:
+            if (read8(entry + 3) & MP_ENABLED) {
+                add_ioapic(read32(entry + 4), 0);
+            }
+            break;
+        case MP_IO_INTERRUPT:
+            // assumes a single IOAPIC, so the pin number is the GSI
+            if (read8(entry + 1) == MP_INT && read8(entry + 4) < MP_MAX_BUSES && isa_bus[read8(entry + 4)]) {
+                add_override(read8(entry + 5), read8(entry + 7), read16(entry + 2));
+            }
+            break;
+        }
+        entry += MP_OTHER_SIZE;
+    }
+
+    return true;
+}
+
+static void
+reset()
+{
+    tables.lapic = 0;
+    tables.cpu_count = 0;
+    tables.ioapic = 0;
+    tables.ioapic_gsi_base = 0;
+
+    // ISA IRQs are identity mapped to GSIs unless overridden
+    for (uint32_t irq = 0; irq < ISA_IRQS; irq++) {
+        tables.irq_gsi[irq] = irq;
+        tables.irq_flags[irq] = 0;
+    }
+}
+
+void
+tables_init()
+{
+    reset();
+
+    if (!parse_acpi()) {
+        reset();
+
+        if (!parse_mp()) {
+            print("tables: no ACPI or MP tables found\n");
+            return;
+        }
+    }
+
+    print("tables: ");
+    print8(tables.cpu_count);
+    print(" CPU(s)\n");
+}
@@ -0,0 +1,35 @@
+#ifndef TABLES_H
+#define TABLES_H
+
+#include "types.h"
+
+#define MAX_CPUS 8
+#define ISA_IRQS 16
+
+// interrupt polarity and trigger mode, as in MADT and MP table flags
+#define INTI_POLARITY_MASK  0x03
+#define INTI_ACTIVE_LOW     0x03
+#define INTI_TRIGGER_MASK   0x0c
+#define INTI_LEVEL          0x0c
+
+// processor and interrupt configuration as described by the ACPI MADT or
+// the MP tables
+typedef struct {
+    phys_t lapic;
+    uint32_t cpu_count;
+    uint8_t cpu_apic_ids[MAX_CPUS];
+    // first IOAPIC only, which is where ISA interrupts are wired
+    phys_t ioapic;
+    uint32_t ioapic_gsi_base;
+    uint32_t irq_gsi[ISA_IRQS];
+    uint16_t irq_flags[ISA_IRQS];
+}
+tables_t;
+
+extern tables_t
+tables;
+
+void
+tables_init();
+
+#endif
@@ -1,18 +1,29 @@
+#include "a20.h"
+#include "console.h"
+#include "dpmi.h"
 #include "io.h"
+#include "ioport.h"
 #include "kernel.h"
+#include "log.h"
 #include "task.h"
 #include "debug.h"
 #include "framebuffer.h"
-
-static task_t task0 = {
-    .regs = 0,
-    .has_reset = false,
-    .interrupts_enabled = false,
-    .pending_interrupt = false,
-    .pending_interrupt_nr = 0,
-};
-
-task_t* current_task = &task0;
+#include "hist.h"
+#include "profile.h"
+#include "replay.h"
+#include "sched.h"
+#include "stats.h"
+#include "umb.h"
+#include "wset.h"
+#include "x86.h"
+
+// a burst of this many idle polls, each following the last within
+// IDLE_POLL_CYCLES, means the guest is only waiting for input
+#define IDLE_POLLS          16
+#define IDLE_POLL_CYCLES    1000000
+
+#define BDA_KBD_HEAD        0x1a
+#define BDA_KBD_TAIL        0x1c
 
 enum rep_kind {
     NONE,
@@ -24,49 +35,28 @@ enum bit_size {
     BITS32 = 1,
 };
 
-static void*
-linear(uint16_t segment, uint16_t offset)
-{
-    uint32_t seg32 = segment;
-    uint32_t off32 = offset;
-    uint32_t lin = (seg32 << 4) + off32;
-    return (void*)lin;
-}
-
-static uint8_t
-peek8(uint16_t segment, uint16_t offset)
-{
-    return *(uint8_t*)linear(segment, offset);
-}
-
 static void
 poke8(uint16_t segment, uint16_t offset, uint8_t value)
 {
-    *(uint8_t*)linear(segment, offset) = value;
-}
-
-static uint16_t
-peek16(uint16_t segment, uint16_t offset)
-{
-    return *(uint16_t*)linear(segment, offset);
+    *(uint8_t*)guest_writable(seg_off(segment, offset), 1) = value;
 }
 
 static void
 poke16(uint16_t segment, uint16_t offset, uint16_t value)
 {
-    *(uint16_t*)linear(segment, offset) = value;
+    *(uint16_t*)guest_writable(seg_off(segment, offset), 2) = value;
 }
 
 static void
 poke32(uint16_t segment, uint16_t offset, uint32_t value)
 {
-    *(uint32_t*)linear(segment, offset) = value;
+    *(uint32_t*)guest_writable(seg_off(segment, offset), 4) = value;
 }
 
 static uint8_t
 peekip(regs_t* regs, uint16_t offset)
 {
-    return peek8(regs->cs.word.lo, regs->eip.word.lo + offset);
+    return peek8(seg_off(regs->cs.word.lo, regs->eip.word.lo + offset));
 }
 
 struct ivt_descr {
@@ -74,7 +64,7 @@ struct ivt_descr {
     uint16_t segment;
 };
 
-static struct ivt_descr* const IVT = 0;
+static struct ivt_descr* const IVT = GUEST_PTR(0);
 
 static void
 push16(regs_t* regs, uint16_t value)
@@ -86,7 +76,7 @@ push16(regs_t* regs, uint16_t value)
 static uint16_t
 pop16(regs_t* regs)
 {
-    uint16_t value = peek16(regs->ss.word.lo, regs->esp.word.lo);
+    uint16_t value = peek16(seg_off(regs->ss.word.lo, regs->esp.word.lo));
     regs->esp.word.lo += 2;
     return value;
 }
@@ -136,28 +126,248 @@ do_int(task_t* task, uint8_t vector)
 }
 
 static void
-do_software_int(task_t* task, uint8_t vector)
+copy_snapshot(task_t* task, uint8_t function)
 {
-    if (!task->has_reset && vector == 0x7f) {
+    // up to CX bytes of stats_t or wset_t to ES:DI, returning its full size
+    // in CX, or 0 if the guest couldn't have written there itself
+    static union {
+        stats_t stats;
+        wset_t wset;
+    } snapshot;
+    static spinlock_t snapshot_lock;
+    regs_t* regs = task->regs;
+    uint16_t size;
+
+    spin_lock(&snapshot_lock);
+    if (function == HYPERCALL_STATS) {
+        stats_snapshot(&snapshot.stats);
+        size = sizeof(snapshot.stats);
+    } else {
+        wset_snapshot(&snapshot.wset);
+        size = sizeof(snapshot.wset);
+    }
+
+    uint16_t len = regs->ecx.word.lo < size ? regs->ecx.word.lo : size;
+    uint32_t addr = ((uint32_t)regs->es16.word.lo << 4) + regs->edi.word.lo;
+    regs->ecx.word.lo = 0;
+
+    if (user_access(addr, len, true)) {
+        const uint8_t* src = (const uint8_t*)&snapshot;
+        uint8_t* dst = GUEST_PTR(addr);
+        for (uint16_t i = 0; i < len; i++) {
+            dst[i] = src[i];
+        }
+        regs->ecx.word.lo = size;
+    }
+
+    spin_unlock(&snapshot_lock);
+}
+
+static bool
+hypercall(task_t* task)
+{
+    // AH selects the function. anything not for us goes to the guest's own
+    // handler, if it has one
+    switch (task->regs->eax.byte.hi) {
+    case HYPERCALL_RESET:
+        if (task->has_reset) {
+            return false;
+        }
+
         // guest issued reset syscall
         // we're done with our real mode initialisation
         task->has_reset = true;
 
         print("SYSCALL: reset\n");
         lomem_reset();
+        console_reset();
+        // BL holds the number of guests to run:
+        sched_start(task->regs->ebx.byte.lo);
         framebuffer_reset();
+        return true;
+    case HYPERCALL_HIST_DUMP:
+        if (!task->has_reset) {
+            return false;
+        }
+
+        hist_dump();
+        return true;
+    case HYPERCALL_STATS:
+    case HYPERCALL_WSET:
+        if (!task->has_reset) {
+            return false;
+        }
+
+        copy_snapshot(task, task->regs->eax.byte.hi);
+        return true;
+    case HYPERCALL_PRINT: {
+        if (!task->has_reset) {
+            return false;
+        }
+
+        // print the zero terminated string at DS:SI to the debug console in
+        // one piece, so it can't be split up by the kernel's own output
+        char line[128];
+        uint16_t len = 0;
+        for (; len < sizeof(line) - 1; len++) {
+            line[len] = peek8(seg_off(task->regs->ds16.word.lo, task->regs->esi.word.lo + len));
+            if (!line[len]) {
+                break;
+            }
+        }
+        line[len] = 0;
+
+        // flushed straight away, the guest may be about to power off
+        print(line);
+        log_flush();
+        return true;
+    }
+    case HYPERCALL_PROFILE_DUMP:
+        if (!task->has_reset) {
+            return false;
+        }
+
+        profile_dump();
+        return true;
+    case HYPERCALL_DOS_INFO:
+        if (!task->has_reset) {
+            return false;
+        }
+
+        // ES:BX is the DOS list of lists, DS:SI its swappable data area
+        console_dos_info(task->regs->es16.word.lo, task->regs->ebx.word.lo, task->regs->ds16.word.lo, task->regs->esi.word.lo);
+        umb_link_dos(task->regs->es16.word.lo, task->regs->ebx.word.lo);
+        return true;
+    case HYPERCALL_DPMI_STUB:
+        if (!task->has_reset) {
+            return false;
+        }
+
+        // ES:DI is the loader's resident DPMI entry stub
+        dpmi_stub(task->regs->es16.word.lo, task->regs->edi.word.lo);
+        return true;
+    case HYPERCALL_REPLAY:
+        if (!task->has_reset) {
+            return false;
+        }
+
+        replay_hypercall(task);
+        return true;
+    case HYPERCALL_VBE_WINDOW:
+        if (!task->has_reset) {
+            return false;
+        }
+
+        // ES:DI is the loader's resident VBE window function
+        framebuffer_window(task->regs->es16.word.lo, task->regs->edi.word.lo);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void
+idle_poll(task_t* task)
+{
+    // programs waiting for a key spin on INT 16h, and DOS calls INT 28h
+    // while it waits. polls spread out over time are a program checking for
+    // input between doing real work, so only tight bursts count
+    uint64_t now = replay_tsc(task, rdtsc());
+    if (now - task->last_poll_tsc > IDLE_POLL_CYCLES) {
+        task->idle_polls = 0;
+    }
+    task->last_poll_tsc = now;
+
+    if (++task->idle_polls >= IDLE_POLLS && task->interrupts_enabled) {
+        task->idle_polls = 0;
+        task->halted = true;
+    }
+}
+
+static bool
+idle_int(task_t* task, uint8_t vector)
+{
+    // INT 2Fh AX=1680h is the multitasker idle call, which we answer
+    // ourselves. the others go on to the guest's handlers once noted
+    uint8_t ah = task->regs->eax.byte.hi;
+
+    if (vector == 0x2f && task->regs->eax.word.lo == 0x1680) {
+        task->regs->eax.byte.lo = 0x00;
+        if (task->interrupts_enabled) {
+            task->halted = true;
+        }
+        return true;
+    }
+
+    if (vector == 0x16 && (ah == 0x01 || ah == 0x11) && peek16(seg_off(0x40, BDA_KBD_HEAD)) == peek16(seg_off(0x40, BDA_KBD_TAIL))) {
+        idle_poll(task);
+    }
+
+    if (vector == 0x28) {
+        idle_poll(task);
+    }
+
+    return false;
+}
+
+static void
+do_software_int(task_t* task, uint8_t vector)
+{
+    // before hypercalls, the DPMI stub's traps don't set AH
+    if (dpmi_int(task, vector)) {
+        return;
+    }
+
+    if (vector == HYPERCALL_VECTOR && hypercall(task)) {
+        return;
+    }
+
+    if (idle_int(task, vector)) {
+        return;
+    }
+
+    if (a20_int(task, vector)) {
+        return;
+    }
+
+    if (framebuffer_int(task, vector)) {
+        return;
+    }
+
+    if (console_int(task, vector)) {
         return;
     }
 
     do_int(task, vector);
 }
 
+static uint8_t
+irq_vector(uint8_t irq)
+{
+    if (irq < 8) {
+        return irq + 0x08;
+    } else {
+        return irq - 8 + 0x70;
+    }
+}
+
 static void
 do_pending_int(task_t* task)
 {
-    if (task->pending_interrupt) {
-        task->pending_interrupt = false;
-        do_int(task, task->pending_interrupt_nr);
+    // other CPUs may set bits concurrently, so clear ours atomically
+    uint16_t pending = __atomic_load_n(&task->pending_irqs, __ATOMIC_ACQUIRE);
+    if (pending) {
+        // lowest numbered IRQ first
+        uint8_t irq = __builtin_ctz(pending);
+        __atomic_fetch_and(&task->pending_irqs, ~(1 << irq), __ATOMIC_ACQ_REL);
+        task->halted = false;
+        replay_irq(task, irq);
+        if (task->regs->eflags.dword & FLAG_VM8086) {
+            do_int(task, irq_vector(irq));
+        } else {
+            dpmi_irq(task, irq_vector(irq));
+        }
+        STATS_INC(irqs_reflected);
     }
 }
 
@@ -169,122 +379,147 @@ do_iret(task_t* task)
     do_popf(task);
 }
 
-static uint8_t
-do_inb(uint16_t port)
-{
-    uint8_t value = inb(port);
-    print("inb port ");
-    print16(port);
-    print(" => ");
-    print8(value);
-    print("\n");
-    return value;
-}
+static uint32_t
+device_in(task_t* task, uint16_t port, uint8_t size)
+{
+    stats_io(port);
 
-static uint16_t
-do_inw(uint16_t port)
-{
-    uint16_t value = inw(port);
-    print("inw port ");
-    print16(port);
-    print(" => ");
-    print16(value);
-    print("\n");
-    return value;
-}
+    uint32_t value;
+    const io_handler_t* handler = io_handler(port);
+    if (handler && handler->in && handler->in(task, port, size, &value)) {
+        return value;
+    }
+
+    switch (size) {
+    case 1:
+        value = inb(port);
+        print("inb port ");
+        print16(port);
+        print(" => ");
+        print8(value);
+        print("\n");
+        break;
+    case 2:
+        value = inw(port);
+        print("inw port ");
+        print16(port);
+        print(" => ");
+        print16(value);
+        print("\n");
+        break;
+    default:
+        value = ind(port);
+        print("ind port ");
+        print16(port);
+        print(" => ");
+        print32(value);
+        print("\n");
+        break;
+    }
 
-static uint32_t
-do_ind(uint16_t port)
-{
-    uint32_t value = ind(port);
-    print("ind port ");
-    print16(port);
-    print(" => ");
-    print32(value);
-    print("\n");
     return value;
 }
 
 static void
-do_outb(task_t* task, uint16_t port, uint8_t value)
+device_out(task_t* task, uint16_t port, uint8_t size, uint32_t value)
 {
-    if (port != 0x20 || value != 0x20) {
+    stats_io(port);
+
+    const io_handler_t* handler = io_handler(port);
+    if (handler && handler->out && handler->out(task, port, size, value)) {
+        return;
+    }
+
+    irq_claim(task, port);
+
+    switch (size) {
+    case 1:
         print("outb port ");
         print16(port);
         print(" <= ");
         print8(value);
         print("\n");
+        outb(port, value);
+        break;
+    case 2:
+        print("outw port ");
+        print16(port);
+        print(" <= ");
+        print16(value);
+        print("\n");
+        outw(port, value);
+        break;
+    default:
+        print("outd port ");
+        print16(port);
+        print(" <= ");
+        print32(value);
+        print("\n");
+        outd(port, value);
+        break;
     }
+}
 
-    if (task->has_reset) {
-        if (IO_VGA_LO <= port && port <= IO_VGA_HI) {
-            framebuffer_outb(port, value);
-            return;
-        }
-    }
+// what the guest reads is whatever the device returned, unless replaying
 
-    outb(port, value);
+static uint8_t
+do_inb(task_t* task, uint16_t port)
+{
+    return replay_in(task, port, 1, device_in(task, port, 1));
+}
+
+static uint16_t
+do_inw(task_t* task, uint16_t port)
+{
+    return replay_in(task, port, 2, device_in(task, port, 2));
+}
+
+static uint32_t
+do_ind(task_t* task, uint16_t port)
+{
+    return replay_in(task, port, 4, device_in(task, port, 4));
 }
 
 static void
-do_outw(task_t* task, uint16_t port, uint16_t value)
+do_outb(task_t* task, uint16_t port, uint8_t value)
 {
-    print("outw port ");
-    print16(port);
-    print(" <= ");
-    print16(value);
-    print("\n");
-
-    if (task->has_reset) {
-        if (IO_VGA_LO <= port && port <= IO_VGA_HI) {
-            // TODO do we ever outw to the VGA?
-            framebuffer_outb(port, value & 0xff);
-            return;
-        }
-    }
+    device_out(task, port, 1, value);
+}
 
-    outw(port, value);
+static void
+do_outw(task_t* task, uint16_t port, uint16_t value)
+{
+    device_out(task, port, 2, value);
 }
 
 static void
 do_outd(task_t* task, uint16_t port, uint32_t value)
 {
-    print("outd port ");
-    print16(port);
-    print(" <= ");
-    print32(value);
-    print("\n");
-
-    if (task->has_reset) {
-        if (IO_VGA_LO <= port && port <= IO_VGA_HI) {
-            // TODO do we ever outd to the VGA?
-            framebuffer_outb(port, value & 0xff);
-            return;
-        }
-    }
-
-    outd(port, value);
+    device_out(task, port, 4, value);
 }
 
 static void
-do_insb(regs_t* regs)
+do_insb(task_t* task)
 {
-    poke8(regs->es16.word.lo, regs->edi.word.lo, do_inb(regs->edx.word.lo));
+    regs_t* regs = task->regs;
+    poke8(regs->es16.word.lo, regs->edi.word.lo, do_inb(task, regs->edx.word.lo));
     regs->edi.word.lo += 1;
 }
 
 static void
-do_insw(regs_t* regs)
+do_insw(task_t* task)
 {
-    uint16_t value = do_inw(regs->edx.word.lo);
+    regs_t* regs = task->regs;
+    uint16_t value = do_inw(task, regs->edx.word.lo);
     poke16(regs->es16.word.lo, regs->edi.word.lo, value);
     regs->edi.word.lo += 2;
 }
 
 static void
-do_insd(regs_t* regs)
+do_insd(task_t* task)
 {
-    uint32_t value = do_ind(regs->edx.word.lo);
+    regs_t* regs = task->regs;
+    uint32_t value = do_ind(task, regs->edx.word.lo);
     poke32(regs->es16.word.lo, regs->edi.word.lo, value);
     regs->edi.word.lo += 4;
 }
@@ -303,6 +538,17 @@ rep_count(regs_t* regs, enum rep_kind rep_kind, enum bit_size operand, enum bit_
     }
 }
 
+static uint8_t
+insn_opcode(regs_t* regs)
+{
+    // skip the prefixes emulate_insn understands
+    uint16_t offset = 0;
+    while (peekip(regs, offset) == 0x66 || peekip(regs, offset) == 0xf3) {
+        offset++;
+    }
+    return peekip(regs, offset);
+}
+
 static void
 emulate_insn(task_t* task)
 {
@@ -337,11 +583,24 @@ prefix:
     case 0x66:
         // o32 prefix
         panic("O32 prefix in GPF'd instruction");
+    case 0x0f: {
+        if (peekip(task->regs, 1) != 0x31) {
+            goto unknown;
+        }
+
+        // RDTSC, trapped while recording or replaying
+        print("  RDTSC\n");
+        uint64_t tsc = guest_rdtsc(task);
+        task->regs->eax.dword = tsc;
+        task->regs->edx.dword = tsc >> 32;
+        task->regs->eip.word.lo += 2;
+        return;
+    }
     case 0x6c: {
         // INSB
         print("  INSB\n");
         REPEAT({
-            do_insb(task->regs);
+            do_insb(task);
         });
         task->regs->eip.word.lo += 1;
         return;
@@ -352,9 +611,9 @@ prefix:
 
         REPEAT({
             if (operand == BITS32) {
-                do_insd(task->regs);
+                do_insd(task);
             } else {
-                do_insw(task->regs);
+                do_insw(task);
             }
         });
 
@@ -391,16 +650,16 @@ prefix:
     case 0xe4:
         // INB imm
         print("  INB imm\n");
-        task->regs->eax.byte.lo = do_inb(peekip(task->regs, 1));
+        task->regs->eax.byte.lo = do_inb(task, peekip(task->regs, 1));
         task->regs->eip.word.lo += 2;
         return;
     case 0xe5:
         // INW imm
         print("  INW imm\n");
         if (operand == BITS32) {
-            task->regs->eax.dword = do_ind(peekip(task->regs, 1));
+            task->regs->eax.dword = do_ind(task, peekip(task->regs, 1));
         } else {
-            task->regs->eax.word.lo = do_inw(peekip(task->regs, 1));
+            task->regs->eax.word.lo = do_inw(task, peekip(task->regs, 1));
         }
         task->regs->eip.word.lo += 2;
         return;
@@ -423,16 +682,16 @@ prefix:
     case 0xec:
         // INB DX
         print("  INB DX\n");
-        task->regs->eax.byte.lo = do_inb(task->regs->edx.word.lo);
+        task->regs->eax.byte.lo = do_inb(task, task->regs->edx.word.lo);
         task->regs->eip.word.lo += 1;
         return;
     case 0xed:
         // INW DX
         print("  INW DX\n");
         if (operand == BITS32) {
-            task->regs->eax.dword = do_ind(task->regs->edx.word.lo);
+            task->regs->eax.dword = do_ind(task, task->regs->edx.word.lo);
         } else {
-            task->regs->eax.word.lo = do_inw(task->regs->edx.word.lo);
+            task->regs->eax.word.lo = do_inw(task, task->regs->edx.word.lo);
         }
         task->regs->eip.word.lo += 1;
         return;
@@ -459,6 +718,8 @@ prefix:
             panic("8086 task halted CPU with interrupts disabled");
         }
         task->regs->eip.word.lo += 1;
+        // interrupt() puts the CPU to sleep until one arrives
+        task->halted = true;
         return;
     }
     case 0xfa:
@@ -475,34 +736,85 @@ prefix:
         do_pending_int(task);
         return;
     default:
+    unknown:
         print("unknown instruction in gpf\n");
-        __asm__ volatile("cli\nhlt" :: "eax"(linear(task->regs->cs.word.lo, task->regs->eip.word.lo)));
+        // the halt below is for good, so the message can't wait for the ring
+        log_flush();
+        __asm__ volatile("cli\nhlt" :: "eax"(guest_ptr(seg_off(task->regs->cs.word.lo, task->regs->eip.word.lo))));
     }
 
     panic("unhandled GPF");
 }
 
+uint32_t
+guest_in(task_t* task, uint16_t port, uint8_t size)
+{
+    return replay_in(task, port, size, device_in(task, port, size));
+}
+
 void
-vm86_interrupt(task_t* task, uint8_t vector)
+guest_out(task_t* task, uint16_t port, uint8_t size, uint32_t value)
 {
-    if (task->interrupts_enabled) {
-        print("Dispatching interrupt ");
-        print16(vector);
+    device_out(task, port, size, value);
+}
+
+uint64_t
+guest_rdtsc(task_t* task)
+{
+    return replay_tsc(task, rdtsc());
+}
+
+void
+vm86_irq(task_t* task, uint8_t irq)
+{
+    // a replaying guest gets its IRQs from the log instead
+    if (!replay_live_irq(task)) {
+        return;
+    }
+
+    __atomic_fetch_or(&task->pending_irqs, 1 << irq, __ATOMIC_ACQ_REL);
+
+    // interrupts can only be dispatched into the address space of the running
+    // task. other tasks pick up their pending IRQs once they next run with
+    // interrupts enabled
+    if (task == current_task && task->interrupts_enabled) {
+        print("Dispatching IRQ ");
+        print8(irq);
         print("\n");
-        do_int(task, vector);
+        do_pending_int(task);
     } else {
-        print("Setting pending interrupt ");
-        print16(vector);
+        STATS_INC(irqs_pended);
+        print("Setting pending IRQ ");
+        print8(irq);
         print("\n");
-        task->pending_interrupt = true;
-        task->pending_interrupt_nr = vector;
+
+        // the task may be running on another CPU right now
+        cpu_t* cpu = __atomic_load_n(&task->cpu, __ATOMIC_ACQUIRE);
+        if (cpu && cpu != this_cpu()) {
+            smp_wake(cpu);
+        }
+    }
+}
+
+void
+vm86_pending(task_t* task)
+{
+    replay_poll(task);
+
+    if (task->interrupts_enabled) {
+        do_pending_int(task);
     }
 }
 
 void
 vm86_gpf(task_t* task)
 {
+    uint64_t start = hist_begin();
+    uint8_t opcode = insn_opcode(task->regs);
+    STATS_INC(gpf_opcodes[opcode]);
+
     emulate_insn(task);
+    hist_record(HIST_OPCODE, opcode, start);
 
     // FIXME something is setting NT, IOPL=3, and a reserved bit in EFLAGS
     // not sure what's happening, but this causes things to break and clearing
@@ -3,28 +3,82 @@
 
 #include "interrupt.h"
 #include "mm.h"
+#include "smp.h"
 
+#define FLAG_TRAP                   (1 << 8)
 #define FLAG_INTERRUPT              (1 << 9)
 #define FLAG_VM8086                 (1 << 17)
 
-typedef struct {
+#define HYPERCALL_VECTOR            0x7f
+#define HYPERCALL_RESET             0x00
+#define HYPERCALL_HIST_DUMP         0x01
+#define HYPERCALL_STATS             0x02
+#define HYPERCALL_PRINT             0x03
+#define HYPERCALL_PROFILE_DUMP      0x04
+#define HYPERCALL_DOS_INFO          0x05
+#define HYPERCALL_DPMI_STUB         0x06
+#define HYPERCALL_REPLAY            0x07
+#define HYPERCALL_WSET              0x08
+#define HYPERCALL_VBE_WINDOW        0x09
+
+typedef struct task {
     regs_t* regs;
+    // interrupt frame of the task while it is not running
+    regs_t saved_regs;
+    phys_t page_directory;
+    // CPU the task runs on, NULL until the task is ready to run
+    cpu_t* cpu;
+    // kernel mapping of the task's text buffer at 0xb8000
+    uint16_t* text;
     bool has_reset;
     bool interrupts_enabled;
-    bool pending_interrupt;
-    uint8_t pending_interrupt_nr;
+    uint16_t pending_irqs;
+    uint8_t fpu_state[108];
+    // waiting for an interrupt after HLT or idle polling
+    bool halted;
+    // idle polls in the current burst, and when the last one happened
+    uint32_t idle_polls;
+    uint64_t last_poll_tsc;
+    // 8042 command swallowed by the virtual A20 gate, awaiting its data
+    uint8_t kbc_command;
+    // DPMI client state, NULL unless the guest has entered protected mode
+    struct dpmi* dpmi;
 }
 task_t;
 
 STATIC_ASSERT(task_t_fits_in_single_page, sizeof(task_t) < PAGE_SIZE);
 
-extern task_t*
-current_task;
+// must match consts.asm:
+STATIC_ASSERT(task_interrupts_enabled_offset, __builtin_offsetof(task_t, interrupts_enabled) == 109);
+STATIC_ASSERT(task_pending_irqs_offset, __builtin_offsetof(task_t, pending_irqs) == 110);
+
+#define current_task (this_cpu()->task)
+
+static inline bool
+guest_frame(const regs_t* regs)
+{
+    // interrupted in a guest, either in VM8086 mode or a DPMI client in ring 3
+    return (regs->eflags.dword & FLAG_VM8086) || (regs->cs.word.lo & 3);
+}
+
+void
+vm86_irq(task_t* task, uint8_t irq);
 
 void
-vm86_interrupt(task_t* task, uint8_t vector);
+vm86_pending(task_t* task);
 
 void
 vm86_gpf(task_t* task);
 
+// port I/O on behalf of a protected mode guest, size in bytes
+uint32_t
+guest_in(task_t* task, uint16_t port, uint8_t size);
+
+void
+guest_out(task_t* task, uint16_t port, uint8_t size, uint32_t value);
+
+// RDTSC trapped from a guest
+uint64_t
+guest_rdtsc(task_t* task);
+
 #endif
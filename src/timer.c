@@ -0,0 +1,158 @@
+#include "timer.h"
+#include "apic.h"
+#include "debug.h"
+#include "io.h"
+#include "kernel.h"
+#include "smp.h"
+#include "x86.h"
+
+#define IO_DELAY_PORT       0x80
+
+#define PIT_CHANNEL2        0x42
+#define PIT_COMMAND         0x43
+#define PIT_GATE            0x61
+#define PIT_FREQUENCY       1193182
+
+#define PIT_CH2_ONESHOT     0xb0 // channel 2, lo/hi byte, mode 0
+#define GATE_ENABLE         0x01
+#define GATE_SPEAKER        0x02
+#define GATE_OUTPUT         0x20
+
+#define CALIBRATE_USECS     10000
+
+// fixed point with 16 fractional bits
+static uint32_t
+tsc_per_usec;
+
+static uint32_t
+lapic_per_tsc;
+
+static uint64_t
+usecs_to_tsc(uint32_t usecs)
+{
+    return ((uint64_t)usecs * tsc_per_usec) >> 16;
+}
+
+void
+timer_init()
+{
+    if (!(cpuid(CPUID_FEATURES).edx & CPUID_FEATURE_EDX_TSC)) {
+        print("timer: no TSC\n");
+        return;
+    }
+
+    // count a known interval on PIT channel 2, which is gated through the
+    // keyboard controller and invisible to guests. the speaker stays off
+    uint8_t gate = inb(PIT_GATE);
+    outb(PIT_GATE, (gate & ~GATE_SPEAKER) | GATE_ENABLE);
+
+    uint16_t count = (uint64_t)PIT_FREQUENCY * CALIBRATE_USECS / 1000000;
+    outb(PIT_COMMAND, PIT_CH2_ONESHOT);
+    outb(PIT_CHANNEL2, count & 0xff);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    if (lapic_present() && !lapic_tsc_deadline()) {
+        lapic_timer_oneshot(0xffffffff);
+    }
+
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_GATE) & GATE_OUTPUT)) {}
+    uint32_t tsc_elapsed = rdtsc() - start;
+
+    if (lapic_present() && !lapic_tsc_deadline()) {
+        uint32_t lapic_elapsed = 0xffffffff - lapic_timer_current();
+        lapic_timer_oneshot(0);
+        lapic_per_tsc = div64((uint64_t)lapic_elapsed << 16, tsc_elapsed);
+    }
+
+    outb(PIT_GATE, gate);
+
+    tsc_per_usec = div64((uint64_t)tsc_elapsed << 16, CALIBRATE_USECS);
+
+    print("timer: TSC ");
+    print32(tsc_per_usec >> 16);
+    print(" MHz\n");
+}
+
+bool
+timer_available()
+{
+    return tsc_per_usec && lapic_present();
+}
+
+static void
+program(const timer_t* timer)
+{
+    if (lapic_tsc_deadline()) {
+        lapic_timer_deadline(timer->deadline);
+        return;
+    }
+
+    // one-shot mode counts LAPIC timer ticks, which is only 32 bits wide.
+    // deadlines beyond that fire early and are re-programmed
+    uint64_t now = rdtsc();
+    uint64_t cycles = timer->deadline > now ? timer->deadline - now : 0;
+    if (cycles > 0xffffffff) {
+        cycles = 0xffffffff;
+    }
+
+    uint32_t ticks = ((uint64_t)(uint32_t)cycles * lapic_per_tsc) >> 16;
+    lapic_timer_oneshot(ticks ? ticks : 1);
+}
+
+void
+timer_arm(timer_t* timer, uint32_t usecs)
+{
+    if (!timer_available()) {
+        panic("timer_arm without local APIC timer");
+    }
+
+    timer->deadline = rdtsc() + usecs_to_tsc(usecs);
+
+    // keep this CPU's timers sorted by deadline
+    timer_t** link = &this_cpu()->timers;
+    while (*link && (*link)->deadline <= timer->deadline) {
+        link = &(*link)->next;
+    }
+    timer->next = *link;
+    *link = timer;
+
+    if (this_cpu()->timers == timer) {
+        program(timer);
+    }
+}
+
+void
+timer_interrupt()
+{
+    cpu_t* cpu = this_cpu();
+
+    while (cpu->timers && cpu->timers->deadline <= rdtsc()) {
+        timer_t* timer = cpu->timers;
+        cpu->timers = timer->next;
+        timer->next = NULL;
+        timer->callback(timer);
+    }
+
+    if (cpu->timers) {
+        program(cpu->timers);
+    }
+}
+
+void
+udelay(uint32_t usecs)
+{
+    if (tsc_per_usec) {
+        uint64_t end = rdtsc() + usecs_to_tsc(usecs);
+        while (rdtsc() < end) {
+            pause();
+        }
+        return;
+    }
+
+    // before calibration, writes to the POST code port take roughly a
+    // microsecond each
+    for (uint32_t i = 0; i < usecs; i++) {
+        outb(IO_DELAY_PORT, 0);
+    }
+}
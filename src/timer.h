@@ -0,0 +1,30 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "types.h"
+
+// one-shot kernel timer. callbacks run in interrupt context on the CPU that
+// armed the timer, and may re-arm it
+typedef struct timer {
+    uint64_t deadline;
+    void (*callback)(struct timer* timer);
+    struct timer* next;
+}
+timer_t;
+
+void
+timer_init();
+
+bool
+timer_available();
+
+void
+timer_arm(timer_t* timer, uint32_t usecs);
+
+void
+timer_interrupt();
+
+void
+udelay(uint32_t usecs);
+
+#endif
@@ -0,0 +1,144 @@
+#include "umb.h"
+#include "debug.h"
+#include "mm.h"
+
+// DOS 5.0 and later
+#define LOL_FIRST_MCB       (-2)
+#define LOL_FIRST_UMB       0x66
+
+#define MCB_TYPE            0x00
+#define MCB_OWNER           0x01
+#define MCB_SIZE            0x03
+#define MCB_NAME            0x08
+
+#define MCB_MORE            'M'
+#define MCB_LAST            'Z'
+#define OWNER_FREE          0x0000
+#define OWNER_SYSTEM        0x0008
+
+#define NO_UMBS             0xffff
+#define VIDEO_SEGMENT       0xa000
+// the system block over video memory, in the last paragraph of low memory
+#define UMB_HEAD            (VIDEO_SEGMENT - 1)
+
+// an MCB chain longer than this has gone round in circles
+#define MAX_MCBS            4096
+#define MAX_UMBS            ((UMB_END - UMB_BASE) / PAGE_SIZE / 2 + 1)
+
+typedef struct {
+    uint16_t start, end; // segments
+}
+umb_t;
+
+static void
+poke16(uint16_t segment, uint16_t offset, uint16_t value)
+{
+    *(uint16_t*)guest_writable(seg_off(segment, offset), 2) = value;
+}
+
+static void
+mcb(uint16_t segment, uint8_t type, uint16_t owner, uint16_t size)
+{
+    // system blocks are named SC, as DOS names its own
+    uint8_t* block = guest_writable(seg_off(segment, 0), 16);
+    block[MCB_TYPE] = type;
+    *(uint16_t*)&block[MCB_OWNER] = owner;
+    *(uint16_t*)&block[MCB_SIZE] = size;
+    for (uint32_t i = 5; i < 16; i++) {
+        block[i] = 0;
+    }
+    if (owner == OWNER_SYSTEM) {
+        block[MCB_NAME] = 'S';
+        block[MCB_NAME + 1] = 'C';
+    }
+}
+
+static uint32_t
+find_umbs(umb_t* umbs)
+{
+    // runs of consecutive pages
+    uint64_t pages = lomem_umbs();
+    uint32_t count = 0;
+
+    for (uint32_t page = UMB_BASE; page < UMB_END; page += PAGE_SIZE) {
+        if (!(pages & (1ULL << ((page - UMB_BASE) / PAGE_SIZE)))) {
+            continue;
+        }
+
+        if (count && umbs[count - 1].end == page >> 4) {
+            umbs[count - 1].end += PAGE_SIZE >> 4;
+        } else {
+            umbs[count].start = page >> 4;
+            umbs[count].end = (page + PAGE_SIZE) >> 4;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static uint16_t
+last_mcb(uint16_t lol_segment, uint16_t lol_offset)
+{
+    // the 'Z' block ending low memory, 0 if the chain is broken
+    uint16_t segment = peek16(seg_off(lol_segment, lol_offset + LOL_FIRST_MCB));
+
+    for (uint32_t i = 0; i < MAX_MCBS; i++) {
+        uint8_t type = peek8(seg_off(segment, MCB_TYPE));
+        if (type == MCB_LAST) {
+            return segment;
+        }
+        if (type != MCB_MORE) {
+            return 0;
+        }
+        segment += peek16(seg_off(segment, MCB_SIZE)) + 1;
+    }
+
+    return 0;
+}
+
+void
+umb_link_dos(uint16_t lol_segment, uint16_t lol_offset)
+{
+    umb_t umbs[MAX_UMBS];
+    uint32_t count = find_umbs(umbs);
+    if (!count || peek16(seg_off(lol_segment, lol_offset + LOL_FIRST_UMB)) != NO_UMBS) {
+        return;
+    }
+
+    // the last block gives up its last paragraph for the system block
+    uint16_t last = last_mcb(lol_segment, lol_offset);
+    uint16_t size = last ? peek16(seg_off(last, MCB_SIZE)) : 0;
+    if (!last || last + 1 + size != VIDEO_SEGMENT || size < 1) {
+        print("umb: DOS memory chain doesn't end at A000h\n");
+        return;
+    }
+    poke16(last, MCB_SIZE, size - 1);
+
+    // the system block leads on to the UMBs. the block before it stays the
+    // last one until DOS links them in
+    mcb(UMB_HEAD, MCB_MORE, OWNER_SYSTEM, umbs[0].start - UMB_HEAD - 1);
+
+    // each UMB but the last gives up its last paragraph for the system
+    // block over the ROMs up to the next
+    uint32_t free = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i == count - 1) {
+            mcb(umbs[i].start, MCB_LAST, OWNER_FREE, umbs[i].end - umbs[i].start - 1);
+            free += umbs[i].end - umbs[i].start - 1;
+            break;
+        }
+
+        mcb(umbs[i].start, MCB_MORE, OWNER_FREE, umbs[i].end - umbs[i].start - 2);
+        mcb(umbs[i].end - 1, MCB_MORE, OWNER_SYSTEM, umbs[i + 1].start - umbs[i].end);
+        free += umbs[i].end - umbs[i].start - 2;
+    }
+
+    poke16(lol_segment, lol_offset + LOL_FIRST_UMB, UMB_HEAD);
+
+    print("umb: ");
+    print16(free);
+    print(" paragraphs in ");
+    print8(count);
+    print(" UMB(s)\n");
+}
@@ -0,0 +1,17 @@
+#ifndef UMB_H
+#define UMB_H
+
+#include "types.h"
+
+// upper memory blocks for DOS in the unused upper memory lomem_reset backs
+// with RAM. DOS 5 and later is handed them as if DOS=UMB had found them at
+// boot: a system block at 9FFFh covers video memory, the UMBs follow with
+// system blocks over the ROMs between them, and the chain starts unlinked,
+// ending at the block before 9FFFh
+
+// link UMBs into the memory chain of the DOS whose list of lists is given,
+// unless it has some already
+void
+umb_link_dos(uint16_t lol_segment, uint16_t lol_offset);
+
+#endif
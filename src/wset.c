@@ -0,0 +1,125 @@
+#include "wset.h"
+#include "debug.h"
+#include "kernel.h"
+#include "log.h"
+#include "smp.h"
+#include "task.h"
+#include "timer.h"
+
+#define SAMPLE_USECS 100000
+
+static wset_t
+wset;
+
+static spinlock_t
+wset_lock;
+
+static timer_t
+sample_timers[MAX_CPUS];
+
+static void
+sample_timer(timer_t* timer)
+{
+    // idle CPUs have no guest to sample, and the loader's own use of low
+    // memory before the reset isn't the workload's
+    task_t* task = current_task;
+    if (task && task->has_reset) {
+        uint8_t pages[LOW_MEM_PAGES];
+        lomem_sample(pages);
+
+        spin_lock(&wset_lock);
+        wset.samples++;
+        wset.last_accessed = 0;
+        wset.last_dirty = 0;
+        wset.last_private = 0;
+
+        for (uint32_t i = 0; i < LOW_MEM_PAGES; i++) {
+            bool accessed = pages[i] & PAGE_ACCESSED;
+            wset.heat[i] = wset.heat[i] / 2 + (accessed ? 128 : 0);
+
+            if (accessed) {
+                wset.accessed[i]++;
+                wset.last_accessed++;
+            }
+            if (pages[i] & PAGE_DIRTY) {
+                wset.dirty[i]++;
+                wset.last_dirty++;
+            }
+            if (pages[i] & PAGE_RW) {
+                wset.last_private++;
+            }
+        }
+
+        spin_unlock(&wset_lock);
+    }
+
+    timer_arm(timer, SAMPLE_USECS);
+}
+
+void
+wset_init()
+{
+    cpu_t* cpu = this_cpu();
+
+    if (!timer_available()) {
+        if (cpu->index == 0) {
+            print("wset: no local APIC timer, not sampling\n");
+        }
+        return;
+    }
+
+    sample_timers[cpu->index].callback = sample_timer;
+    timer_arm(&sample_timers[cpu->index], SAMPLE_USECS);
+}
+
+void
+wset_snapshot(wset_t* out)
+{
+    const uint32_t* src = (const uint32_t*)&wset;
+    uint32_t* dst = (uint32_t*)out;
+
+    bool crit = critical_begin();
+    spin_lock(&wset_lock);
+    for (uint32_t i = 0; i < sizeof(wset_t) / 4; i++) {
+        dst[i] = src[i];
+    }
+    spin_unlock(&wset_lock);
+    critical_end(crit);
+
+    out->size = sizeof(wset_t);
+}
+
+void
+wset_dump()
+{
+    static wset_t snapshot;
+    wset_snapshot(&snapshot);
+
+    print("wset: ");
+    print32(snapshot.samples);
+    print(" samples, last accessed ");
+    print16(snapshot.last_accessed);
+    print(" dirty ");
+    print16(snapshot.last_dirty);
+    print(" private ");
+    print16(snapshot.last_private);
+    print("\n");
+
+    print("wset: page, heat, samples accessed, samples dirty\n");
+    for (uint32_t i = 0; i < LOW_MEM_PAGES; i++) {
+        if (!snapshot.accessed[i]) {
+            continue;
+        }
+
+        log_throttle();
+        print("wset: ");
+        print32(i * PAGE_SIZE);
+        print(" ");
+        print8(snapshot.heat[i]);
+        print(" ");
+        print32(snapshot.accessed[i]);
+        print(" ");
+        print32(snapshot.dirty[i]);
+        print("\n");
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef WSET_H
+#define WSET_H
+
+#include "types.h"
+#include "mm.h"
+
+// guest working set, from the accessed and dirty bits of low memory PTEs.
+// every CPU samples and clears them in its running guest's address space
+// periodically, so with several guests the counts are summed over all of
+// them. counts only grow, tools diff two snapshots
+
+typedef struct {
+    // size of this structure, so guest tools can detect newer versions
+    uint32_t size;
+    uint32_t samples;
+    // pages found accessed, dirty and private in the latest sample. private
+    // pages are the guest's own copies of copy-on-write memory, plus the
+    // text page
+    uint32_t last_accessed;
+    uint32_t last_dirty;
+    uint32_t last_private;
+    // per page, the samples it was found accessed or dirty in
+    uint32_t accessed[LOW_MEM_PAGES];
+    uint32_t dirty[LOW_MEM_PAGES];
+    // decaying average of accesses. 255 is accessed in every recent sample
+    uint8_t heat[LOW_MEM_PAGES];
+}
+wset_t;
+
+STATIC_ASSERT(wset_t_copies_by_dword, sizeof(wset_t) % 4 == 0);
+
+// called on every CPU
+void
+wset_init();
+
+void
+wset_snapshot(wset_t* out);
+
+void
+wset_dump();
+
+#endif
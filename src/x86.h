@@ -0,0 +1,97 @@
+#ifndef X86_H
+#define X86_H
+
+#include "types.h"
+
+#define CPUID_BASIC                 0x00000000
+#define CPUID_FEATURES              0x00000001
+#define CPUID_FEATURE_EDX_TSC       (1 << 4)
+#define CPUID_FEATURE_EDX_MSR       (1 << 5)
+#define CPUID_FEATURE_EDX_APIC      (1 << 9)
+#define CPUID_FEATURE_EDX_PGE       (1 << 13)
+#define CPUID_FEATURE_ECX_TSC_DEADLINE (1 << 24)
+#define CPUID_PERFMON               0x0000000a
+
+#define MSR_APIC_BASE               0x0000001b
+#define MSR_PMC0                    0x000000c1
+#define MSR_PERFEVTSEL0             0x00000186
+#define MSR_PERF_GLOBAL_CTRL        0x0000038f
+#define MSR_PERF_GLOBAL_OVF_CTRL    0x00000390
+#define MSR_TSC_DEADLINE            0x000006e0
+
+#define CR4_TSD                     (1 << 2)
+#define CR4_PGE                     (1 << 7)
+
+typedef struct {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+}
+cpuid_t;
+
+static inline cpuid_t
+cpuid(uint32_t leaf)
+{
+    cpuid_t result;
+    __asm__ volatile("cpuid"
+        : "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx), "=d"(result.edx)
+        : "a"(leaf), "c"(0));
+    return result;
+}
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint32_t
+read_cr4()
+{
+    uint32_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void
+write_cr4(uint32_t value)
+{
+    __asm__ volatile("mov %0, %%cr4" :: "r"(value) : "memory");
+}
+
+static inline uint64_t
+rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// 64 by 32 bit division without pulling in libgcc. the quotient must fit in
+// 32 bits
+static inline uint32_t
+div64(uint64_t dividend, uint32_t divisor)
+{
+    uint32_t quotient, remainder;
+    __asm__("divl %4"
+        : "=a"(quotient), "=d"(remainder)
+        : "a"((uint32_t)dividend), "d"((uint32_t)(dividend >> 32)), "rm"(divisor));
+    return quotient;
+}
+
+static inline void
+pause()
+{
+    __asm__ volatile("pause");
+}
+
+#endif
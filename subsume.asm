@@ -1,10 +1,26 @@
 use16
 org 0x100
 
-%define VBE_MODE 0x0118 ; 1024x768x24
-
 %include "consts.asm"
 
+    jmp start
+
+; the only part of the loader which stays resident. DPMI clients far call it
+; to enter protected mode, and the host returns to real mode through it.
+; the kernel traps the interrupt at any segment:offset alias of this address
+dpmi_stub:
+    int HYPERCALL_VECTOR
+
+; the window function of the kernel's VBE mode. real mode far calls it with
+; the arguments of INT 10h AX=4F05h, which the kernel answers. the caller's
+; AX is lost, as the VBE spec allows
+vbe_window:
+    mov ax, 0x4f05
+    int 0x10
+    retf
+resident_end:
+
+start:
     ; save necessary registers
     mov ax, cs
     mov [realdata + REALDATA_TASK + TASK_CS], ax
@@ -16,6 +32,19 @@ org 0x100
     mov [realdata + REALDATA_TASK + TASK_SS], ax
     mov [realdata + REALDATA_TASK + TASK_SP], sp
 
+    ; parse number of guests to run from command line, eg. "subsume 4"
+    mov si, 0x81
+cmdline:
+    lodsb
+    cmp al, ' '
+    je cmdline
+    sub al, '1'
+    cmp al, 8
+    ja .done ; not a digit 1-9, keep default
+    inc al
+    mov [guests], al
+.done:
+
     ; fetch text mode font from BIOS
     mov ax, 0x1130
     mov bh, 6
@@ -40,6 +69,31 @@ org 0x100
     mov di, realdata + REALDATA_VBE_INFO
     int 0x10
 
+    ; fetch the VBE protected mode interface, so the kernel can set the
+    ; display start without a trip through real mode
+    mov word [realdata + REALDATA_VBE_PMI], 0
+    push es
+    mov ax, 0x4f0a
+    xor bl, bl
+    int 0x10
+    cmp ax, 0x004f
+    jne .no_pmi
+    cmp cx, VBE_PMI_MAX
+    ja .no_pmi
+    mov [realdata + REALDATA_VBE_PMI], cx
+    ; copy the table at ES:DI, swapping ES and DS for MOVS
+    push ds
+    push es
+    pop ds
+    pop es
+    mov si, di
+    mov di, realdata + REALDATA_VBE_PMI + 2
+    rep movsb
+    push es
+    pop ds
+.no_pmi:
+    pop es
+
     ; fetch memory map from BIOS
     mov di, realdata + REALDATA_MEMMAP
     xor ebx, ebx
@@ -100,19 +154,61 @@ retn:
     mov bx, VBE_MODE | (1 << 14) ; linear frame buffer
     int 0x10
 
-    ; reset low memory
-    int 0x7f
+    ; reset low memory and start guests
+    mov ah, HYPERCALL_RESET
+    mov bl, [guests]
+    int HYPERCALL_VECTOR
+
+    ; tell the kernel where DOS 4+ keeps the current PSP and the system file
+    ; tables, so it can write console output for DOS
+    mov ah, 0x30
+    int 0x21
+    cmp al, 4
+    jb .dos_info_done
+    push ds
+    push es
+    mov ah, 0x52
+    int 0x21 ; ES:BX = list of lists
+    mov ax, 0x5d06
+    int 0x21 ; DS:SI = swappable data area
+    mov ah, HYPERCALL_DOS_INFO
+    int HYPERCALL_VECTOR
+    pop es
+    pop ds
+.dos_info_done:
+
+    ; register the DPMI entry stub at ES:DI
+    push es
+    push cs
+    pop es
+    mov di, dpmi_stub
+    mov ah, HYPERCALL_DPMI_STUB
+    int HYPERCALL_VECTOR
+    pop es
+
+    ; and the VBE window function
+    push es
+    push cs
+    pop es
+    mov di, vbe_window
+    mov ah, HYPERCALL_VBE_WINDOW
+    int HYPERCALL_VECTOR
+    pop es
 
     ; print welcome to subsume message:
     mov ah, 0x09
     mov dx, .msg
     int 0x21
 
-    ; return to MS-DOS
-    int 0x20
+    ; return to MS-DOS, keeping the stub resident
+    mov ax, 0x3100
+    mov dx, (resident_end - $$ + 0x100 + 15) >> 4
+    int 0x21
 
 .msg db "Welcome to Subsume$"
 
+guests db 1
+
 gdtr:
     dw gdt.end - gdt - 1
 .offset:
@@ -158,11 +254,59 @@ pmode:
     ; restore previous value of 0x0
     mov [0], eax
 
-    ; find start of high
-    lea esi, [ADDR(kernelcode)]
+    ; decompress kernel to its load address. it's an LZ4 legacy frame: a
+    ; magic number followed by blocks, each prefixed with its compressed size
+    lea esi, [ADDR(kernelcode) + 4]
     mov edi, KERNEL_PHYS_BASE
-    mov ecx, kernelcode.end - kernelcode
+.block:
+    lea ecx, [ADDR(kernelcode.end)]
+    cmp esi, ecx
+    jae .decompressed
+    mov ebx, [esi]
+    add esi, 4
+    add ebx, esi ; end of block
+.sequence:
+    ; token: literal length in the high nibble, match length in the low
+    movzx eax, byte [esi]
+    inc esi
+    mov ecx, eax
+    shr ecx, 4
+    cmp ecx, 15
+    jne .literals
+.literal_length:
+    movzx edx, byte [esi]
+    inc esi
+    add ecx, edx
+    cmp dl, 255
+    je .literal_length
+.literals:
+    rep movsb
+    ; the last sequence in a block has literals only
+    cmp esi, ebx
+    jae .block
+    ; match offset back from the output position
+    movzx edx, word [esi]
+    add esi, 2
+    mov ecx, eax
+    and ecx, 0x0f
+    cmp ecx, 15
+    jne .match
+.match_length:
+    movzx eax, byte [esi]
+    inc esi
+    add ecx, eax
+    cmp al, 255
+    je .match_length
+.match:
+    add ecx, 4
+    ; matches may overlap the output, which a forward byte copy handles
+    mov eax, esi
+    mov esi, edi
+    sub esi, edx
     rep movsb
+    mov esi, eax
+    jmp .sequence
+.decompressed:
 
     ; ebp still contains address of pmode
     ; add task offset to it so that kernel receives task data pointer in ebp
@@ -172,7 +316,7 @@ pmode:
     jmp eax
 
 kernelcode:
-    incbin "subsumek.bin"
+    incbin "subsumek.lz4"
 .end:
 
 align 4